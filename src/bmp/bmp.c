@@ -1,12 +1,18 @@
+#define _GNU_SOURCE
+
 #include "bmp.h"
-#include "../utils/utils.h"
+#include "../io/io.h"
+#include "../numa/numa.h"
 #include <errno.h>
+#include <fcntl.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #define BMP_SIMPLE_CLEANUP(msg, bmp)                                                                                   \
   do {                                                                                                                 \
@@ -15,16 +21,11 @@
     return NULL;                                                                                                       \
   } while (0)
 
-#define BMP_WRITE_CLEANUP(msg, file)                                                                                   \
-  do {                                                                                                                 \
-    perror(msg);                                                                                                       \
-    fclose(file);                                                                                                      \
-    return 1;                                                                                                          \
-  } while (0)
-
 #define BYTE_SIZE 8
 #define BASE_HEADER_SIZE 14
 #define DEFAULT_INFO_HEADER_SIZE 40
+// Bytes read with the first request, enough for the headers, a 256 color table and the extra data of most files.
+#define HEADER_PREFIX_SIZE 4096
 
 typedef struct BMP_CDT {
   char id[2];
@@ -33,7 +34,7 @@ typedef struct BMP_CDT {
   uint32_t offset;                //
   uint32_t info_header_size;      // Info header starts starts at this address.
   uint32_t width;                 // In pixels.
-  uint32_t height;                // In pixels.
+  int32_t height;                 // In pixels. Negative for top-down images, stored from the top row down.
   uint16_t n_planes;              // No clue what this is...
   uint16_t bpp;                   // Bits Per Pixel.
   uint32_t compression_type;      // 0: none - 1: RLE 8-bit/pixel - 2: RLE 4-bit/pixel - ...
@@ -49,118 +50,119 @@ typedef struct BMP_CDT {
   uint32_t extra_data_size;
   uint8_t* extra_data;
   uint8_t* image;
+  size_t image_mapped;   // Size of the mapping of `image` when it was placed with `numaAlloc`, 0 if malloc'd.
+  size_t image_capacity; // Size of `image` when it was allocated for a window, 0 otherwise.
+  uint64_t pixel_bytes;  // Size of the pixel array. The `image_size` and `filesize` fields are 0 when it doesn't fit.
+  uint64_t window_from;  // `image` holds the pixel bytes [window_from, window_from + window_size), the whole pixel
+  uint64_t window_size;  // array unless a window was loaded with `bmpLoadWindow`.
+  uint32_t src_offset;   // Pixel data offset in the file the image was parsed from.
+  uint64_t dirty_from;   // Pixel bytes in [dirty_from, dirty_to) were modified since parsing.
+  uint64_t dirty_to;     //
 } BMP_CDT;
 
+// Headers are read into memory and parsed from there, so reading a BMP takes a couple of requests instead of a syscall
+// per field.
+typedef struct HeaderBuffer {
+  uint8_t* data;
+  uint32_t size;
+  uint32_t pos;
+} HeaderBuffer;
+
 void printColor(Color color);
-static bool freadWithPerror(FILE* file, void* dest, size_t size, const char* err);
-static bool parseBaseHeader(FILE* file, BMP bmp);
-static bool parseInfoHeader(FILE* file, BMP bmp);
-static bool parseColorTable(FILE* file, BMP bmp);
-static bool parseExtraData(FILE* file, BMP bmp);
-static bool parseImageData(FILE* file, BMP bmp);
+static BMP newBmp(
+  uint32_t width, int32_t height, uint16_t bpp, uint8_t reserved[4], uint32_t n_colors, Color colors[n_colors],
+  uint32_t extra_data_size, uint8_t extra_data[extra_data_size], bool with_pixels
+);
+static BMP loadBmp(const char* filename, bool with_colors, bool with_pixels, uint64_t spread);
+static bool readWithError(HeaderBuffer* header, void* dest, size_t size, const char* err);
+static bool parseBaseHeader(HeaderBuffer* header, BMP bmp);
+static bool parseInfoHeader(HeaderBuffer* header, BMP bmp);
+static bool parseColorTable(HeaderBuffer* header, BMP bmp);
+static bool skipColorTable(HeaderBuffer* header, BMP bmp);
+static bool parseExtraData(HeaderBuffer* header, BMP bmp);
+static bool readRemaining(
+  const char* filename, int fd, BMP bmp, HeaderBuffer* header, bool with_pixels, uint64_t spread
+);
+static void freeImage(BMP bmp);
+static bool pixelArraySize(uint32_t width, int32_t height, uint32_t bpp, uint64_t* size);
+static uint64_t rowSize(uint32_t width, uint32_t bpp);
+static uint32_t rowCount(int32_t height);
+static uint32_t headerSize(BMP bmp);
+static void serializeHeader(BMP bmp, uint8_t* header);
+static uint32_t pixelRequests(int fd, BMP bmp, uint64_t from, uint64_t to, IoRequest* requests);
+static bool copyRange(int fd_in, off_t offset_in, int fd_out, off_t offset_out, size_t size);
+static bool copyThrough(int fd_in, off_t offset_in, int fd_out, off_t offset_out, size_t size);
+static bool wholeImage(BMP bmp);
 
 #define EXTRA_LBL_LEN 5
 static const char extra_label[EXTRA_LBL_LEN] = {'E', 'X', 'T', 'R', 'A'};
 
 BMP bmpNew(
-  uint32_t width, uint32_t height, uint16_t bpp, uint8_t reserved[4], uint32_t n_colors, Color colors[n_colors],
+  uint32_t width, int32_t height, uint16_t bpp, uint8_t reserved[4], uint32_t n_colors, Color colors[n_colors],
   uint32_t extra_data_size, uint8_t extra_data[extra_data_size]
 ) {
-  BMP bmp = malloc(sizeof(BMP_CDT));
-  if (bmp == NULL) {
-    perror("malloc");
-    return NULL;
-  }
-  bmp->image = NULL;
-  bmp->extra_data = NULL;
-
-  uint32_t image_size = height * ((ceilDiv(width * bpp, BYTE_SIZE) + 3) & ~3u);
-  uint32_t extra_data_bytes = extra_data_size == 0 ? 0 : EXTRA_LBL_LEN + sizeof(uint32_t) + extra_data_size;
-  uint32_t header_size = BASE_HEADER_SIZE + DEFAULT_INFO_HEADER_SIZE + (sizeof(Color) * n_colors) + extra_data_bytes;
-
-  bmp->id[0] = 'B';
-  bmp->id[1] = 'M';
-  bmp->filesize = image_size + header_size;
-  if (reserved != NULL) memcpy(bmp->reserved, reserved, 4);
-  else memset(bmp->reserved, 0, 4);
-  bmp->offset = header_size;
-  bmp->info_header_size = DEFAULT_INFO_HEADER_SIZE;
-  bmp->width = width;
-  bmp->height = height;
-  bmp->n_planes = 1;
-  bmp->bpp = bpp;
-  bmp->compression_type = 0;
-  bmp->image_size = image_size;
-  bmp->horizontal_resolution = 0;
-  bmp->vertical_resolution = 0;
-  bmp->n_colors = n_colors;
-  bmp->n_important_colors = 0;
-  if (n_colors > 0 && colors != NULL) {
-    size_t color_bytes = sizeof(Color) * bmp->n_colors;
-    bmp->colors = malloc(color_bytes);
-    if (bmp->colors == NULL) BMP_SIMPLE_CLEANUP("malloc", bmp);
-    memcpy(bmp->colors, colors, color_bytes);
-  } else {
-    bmp->n_colors = 0;
-    bmp->colors = NULL;
-  }
-  if (extra_data_size > 0 && extra_data != NULL) {
-    memcpy(bmp->extra_data_label, extra_label, EXTRA_LBL_LEN);
-    bmp->extra_data_size = extra_data_size;
-    bmp->extra_data = malloc(extra_data_size);
-    if (bmp->extra_data == NULL) BMP_SIMPLE_CLEANUP("malloc", bmp);
-    memcpy(bmp->extra_data, extra_data, extra_data_size);
-  } else {
-    bmp->extra_data_size = 0;
-    bmp->extra_data = NULL;
-  }
-  bmp->image = malloc(image_size);
-  if (bmp->image == NULL) BMP_SIMPLE_CLEANUP("malloc", bmp);
+  return newBmp(width, height, bpp, reserved, n_colors, colors, extra_data_size, extra_data, true);
+}
 
-  return bmp;
+// Same as `bmpNew` but without a pixel array, like the BMPs returned by `bmpProbe`.
+BMP bmpNewHeader(
+  uint32_t width, int32_t height, uint16_t bpp, uint8_t reserved[4], uint32_t n_colors, Color colors[n_colors],
+  uint32_t extra_data_size, uint8_t extra_data[extra_data_size]
+) {
+  return newBmp(width, height, bpp, reserved, n_colors, colors, extra_data_size, extra_data, false);
 }
 
 BMP bmpParse(const char* filename) {
-  // "rb" is for binary files.
-  FILE* file = fopen(filename, "rb");
-  if (file == NULL) {
-    perror("fopen");
-    return NULL;
-  }
+  return loadBmp(filename, true, true, 0);
+}
 
-  BMP bmp = malloc(sizeof(BMP_CDT));
-  if (bmp == NULL) {
-    perror("malloc");
-    fclose(file);
-    return NULL;
-  }
-  bmp->colors = NULL;
-  bmp->image = NULL;
-  bmp->extra_data = NULL;
+// Same as `bmpParse`, but the first `span` bytes of the pixel array are spread over the NUMA nodes in equal slices
+// before they are read (see `numaAlloc`), for threads that each work on the slice of their node.
+BMP bmpParseSpread(const char* filename, uint64_t span) {
+  return loadBmp(filename, true, true, span);
+}
 
-  if (!parseBaseHeader(file, bmp) || !parseInfoHeader(file, bmp) || !parseColorTable(file, bmp) ||
-      !parseExtraData(file, bmp) || !parseImageData(file, bmp)) {
+// Same as `bmpParse` but only the pixel bytes [from, to) are loaded (see `bmpLoadWindow`).
+BMP bmpParseWindow(const char* filename, uint64_t from, uint64_t to) {
+  BMP bmp = loadBmp(filename, true, false, 0);
+  if (bmp != NULL && !bmpLoadWindow(bmp, filename, from, to)) {
     bmpFree(bmp);
-    fclose(file);
     return NULL;
   }
+  return bmp;
+}
 
-  if (fclose(file) != 0) {
-    perror("fclose");
+// Same as `bmpParseWindow(filename, 0, UINT64_MAX)`, but the pixel buffer of `recycled` is reused when it is big
+// enough, so that a sequence of images of the same size is read without allocating. `recycled` is freed, whatever the
+// outcome, and may be NULL.
+BMP bmpParseRecycled(const char* filename, BMP recycled) {
+  BMP bmp = loadBmp(filename, true, false, 0);
+  if (bmp != NULL && recycled != NULL && recycled->image_capacity > 0) {
+    bmp->image = recycled->image;
+    bmp->image_capacity = recycled->image_capacity;
+    recycled->image = NULL;
+    recycled->image_capacity = 0;
+  }
+  bmpFree(recycled);
+  if (bmp != NULL && !bmpLoadWindow(bmp, filename, 0, UINT64_MAX)) {
     bmpFree(bmp);
     return NULL;
   }
   return bmp;
 }
 
+// Same as `bmpParse` but neither the color table nor the pixel array are loaded, so `bmpColors` and `bmpImage` return
+// NULL for probed images.
+BMP bmpProbe(const char* filename) {
+  return loadBmp(filename, false, false, 0);
+}
+
 void bmpFree(BMP bmp) {
   if (bmp != NULL) {
     if (bmp->colors != NULL) {
       free(bmp->colors);
     }
-    if (bmp->image != NULL) {
-      free(bmp->image);
-    }
+    freeImage(bmp);
     if (bmp->extra_data != NULL) {
       free(bmp->extra_data);
     }
@@ -168,20 +170,96 @@ void bmpFree(BMP bmp) {
   }
 }
 
+// Frees the pixel array, keeping the header. `bmpImage` returns NULL afterwards.
+void bmpDropImage(BMP bmp) {
+  freeImage(bmp);
+}
+
+// Pixels held in memory, which start at pixel byte `bmpWindowFrom` of the pixel array.
 uint8_t* bmpImage(BMP bmp) {
   return bmp->image;
 }
 
-uint32_t bmpImageSize(BMP bmp) {
-  return bmp->image_size;
+uint64_t bmpWindowFrom(BMP bmp) {
+  return bmp->window_from;
+}
+
+// Replaces the pixels held by `bmp` with the bytes [from, to) of the pixel array of `filename`, the file it was parsed
+// from, so that images bigger than memory are worked on a window at a time. The buffer of the previous window is
+// reused when it is big enough. Nothing is dirty afterwards.
+bool bmpLoadWindow(BMP bmp, const char* filename, uint64_t from, uint64_t to) {
+  if (to > bmp->pixel_bytes) to = bmp->pixel_bytes;
+  if (from > to) from = to;
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) {
+    perror("open");
+    return false;
+  }
+  // Same as the whole pixel array, direct I/O reads the aligned span around the window.
+  int direct_fd = ioDirect() ? open(filename, O_RDONLY | O_DIRECT) : -1;
+  off_t read_from = (off_t)(bmp->src_offset + from);
+  off_t read_to = (off_t)(bmp->src_offset + to);
+  if (direct_fd >= 0) {
+    read_from -= read_from % IO_ALIGN;
+    read_to += (IO_ALIGN - (read_to % IO_ALIGN)) % IO_ALIGN;
+  }
+  size_t read_size = read_to - read_from;
+  if (bmp->image_capacity < read_size) {
+    freeImage(bmp);
+    void* image;
+    if (posix_memalign(&image, IO_ALIGN, read_size > 0 ? read_size : 1) != 0) {
+      perror("malloc image");
+      if (direct_fd >= 0) close(direct_fd);
+      close(fd);
+      return false;
+    }
+    bmp->image = image;
+    bmp->image_capacity = read_size;
+  }
+
+  IoRequest* requests = malloc((ioChunkCount(read_size, read_from) + 1) * sizeof(IoRequest));
+  bool ok = requests != NULL;
+  if (!ok) perror("malloc");
+  size_t window_read = 0;
+  if (ok) {
+    uint32_t n = ioSplit(direct_fd >= 0 ? direct_fd : fd, bmp->image, read_size, read_from, requests);
+    ok = ioRead(n, requests);
+    for (uint32_t i = 0; ok && i < n && window_read == (size_t)(requests[i].offset - read_from); ++i) {
+      window_read += requests[i].done;
+    }
+  }
+  free(requests);
+  if (direct_fd >= 0) close(direct_fd);
+  close(fd);
+  if (!ok) return false;
+
+  size_t skip = bmp->src_offset + from - read_from;
+  if (window_read < skip + (to - from)) {
+    fprintf(stderr, "`%s`: Unexpected end of file in the pixel data.\n", filename);
+    return false;
+  }
+  if (skip > 0) memmove(bmp->image, bmp->image + skip, to - from);
+  bmp->window_from = from;
+  bmp->window_size = to - from;
+  bmpMarkClean(bmp);
+  return true;
+}
+
+uint64_t bmpImageSize(BMP bmp) {
+  return bmp->pixel_bytes;
 }
 
 uint32_t bmpWidth(BMP bmp) {
   return bmp->width;
 }
 
+// Number of rows, whatever the orientation of the image.
 uint32_t bmpHeight(BMP bmp) {
-  return bmp->height;
+  return rowCount(bmp->height);
+}
+
+bool bmpTopDown(BMP bmp) {
+  return bmp->height < 0;
 }
 
 uint32_t bmpBpp(BMP bmp) {
@@ -205,6 +283,12 @@ uint8_t* bmpExtraData(BMP bmp) {
 }
 
 void bmpSetExtraData(BMP bmp, uint32_t extra_data_size, uint8_t* extra_data) {
+  // Replacing the extra data of a carrier that is reused for several secrets must not leak nor shift the offset twice.
+  if (bmp->extra_data_size > 0) {
+    uint32_t old_extra_data_bytes = EXTRA_LBL_LEN + sizeof(uint32_t) + bmp->extra_data_size;
+    bmp->offset -= old_extra_data_bytes;
+  }
+  free(bmp->extra_data);
   if (extra_data_size > 0 && extra_data != NULL) {
     memcpy(bmp->extra_data_label, extra_label, EXTRA_LBL_LEN);
     bmp->extra_data_size = extra_data_size;
@@ -215,8 +299,10 @@ void bmpSetExtraData(BMP bmp, uint32_t extra_data_size, uint8_t* extra_data) {
     }
     memcpy(bmp->extra_data, extra_data, extra_data_size);
     uint32_t extra_data_bytes = EXTRA_LBL_LEN + sizeof(uint32_t) + extra_data_size;
-    bmp->filesize += extra_data_bytes;
     bmp->offset += extra_data_bytes;
+    // Extra data that fits before the pixels of the file the image was parsed from leaves them where they were, so
+    // the file can still be patched in place.
+    if (bmp->offset < bmp->src_offset) bmp->offset = bmp->src_offset;
   } else {
     bmp->extra_data_size = 0;
     bmp->extra_data = NULL;
@@ -232,61 +318,186 @@ void bmpSetReserved(BMP bmp, uint8_t reserved[4]) {
 }
 
 int bmpWriteFile(const char* filename, BMP bmp) {
-  FILE* file = fopen(filename, "w");
-  if (file == NULL) {
-    perror("fopen");
+  if (!wholeImage(bmp)) {
+    fprintf(stderr, "bmpWriteFile: `%s` can't be written, only a window of its pixels is loaded.\n", filename);
+    return 1;
+  }
+  int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    perror("open");
     return 1;
   }
 
-  size_t written = fwrite(bmp, 2, 1, file);
-  if (written != 1) BMP_WRITE_CLEANUP("fwrite", file);
+  // The header and the pixel data are written with a single batch. Any gap between them is left as a hole, which
+  // reads as zeros.
+  uint32_t header_size = headerSize(bmp);
+  uint8_t* header = malloc(header_size);
+  uint32_t n_requests = 1 + ioChunkCount(bmp->pixel_bytes, bmp->offset);
+  IoRequest* requests = malloc(n_requests * sizeof(IoRequest));
+  bool ok = header != NULL && requests != NULL;
+  if (!ok) perror("malloc");
+  if (ok) {
+    serializeHeader(bmp, header);
+    // Pixels take precedence over a header that overlaps them.
+    uint32_t header_bytes = header_size < bmp->offset ? header_size : bmp->offset;
+    requests[0] = (IoRequest){.fd = fd, .buf = header, .size = header_bytes, .offset = 0};
+    pixelRequests(fd, bmp, 0, bmp->pixel_bytes, &requests[1]);
+    ok = ioWrite(n_requests, requests);
+  }
+  free(requests);
+  free(header);
 
-  written = fwrite(&bmp->filesize, BASE_HEADER_SIZE - 2, 1, file);
-  if (written != 1) BMP_WRITE_CLEANUP("fwrite", file);
+  if (close(fd) != 0) {
+    perror("close");
+    return 1;
+  }
+  return ok ? 0 : 1;
+}
 
-  written = fwrite(&bmp->info_header_size, bmp->info_header_size, 1, file);
-  if (written != 1) BMP_WRITE_CLEANUP("fwrite", file);
+void bmpMarkDirty(BMP bmp, uint64_t from, uint64_t to) {
+  if (from >= to) return;
+  if (bmp->dirty_from == bmp->dirty_to) {
+    bmp->dirty_from = from;
+    bmp->dirty_to = to;
+    return;
+  }
+  if (from < bmp->dirty_from) bmp->dirty_from = from;
+  if (to > bmp->dirty_to) bmp->dirty_to = to;
+}
 
-  if (bmp->n_colors > 0) {
-    written = fwrite(bmp->colors, sizeof(Color) * bmp->n_colors, 1, file);
-    if (written != 1) BMP_WRITE_CLEANUP("fwrite", file);
+void bmpMarkClean(BMP bmp) {
+  bmp->dirty_from = 0;
+  bmp->dirty_to = 0;
+}
+
+// Pixel bytes modified since parsing, empty when `from == to`.
+void bmpDirtyRange(BMP bmp, uint64_t* from, uint64_t* to) {
+  *from = bmp->dirty_from;
+  *to = bmp->dirty_to;
+}
+
+// Writes `bmp` to `filename` assuming that only the header, the extra data and the dirty pixel range differ from
+// `base_filename`, the file `bmp` was parsed from. The untouched pixel ranges are cloned from the base file with
+// `copy_file_range` so they never go through user space. When both are the same file and the pixel data didn't move,
+// the file is patched in place and nothing but the header and the dirty range is written.
+int bmpPatchFile(const char* filename, const char* base_filename, BMP bmp) {
+  int fd_in = open(base_filename, O_RDONLY);
+  if (fd_in < 0) {
+    perror("open");
+    return 1;
+  }
+  struct stat in_stat;
+  struct stat out_stat;
+  if (fstat(fd_in, &in_stat) != 0) {
+    perror("fstat");
+    close(fd_in);
+    return 1;
+  }
+  bool same_file = stat(filename, &out_stat) == 0 && out_stat.st_dev == in_stat.st_dev &&
+                   out_stat.st_ino == in_stat.st_ino;
+  if ((uint64_t)in_stat.st_size < bmp->src_offset + bmp->pixel_bytes) {
+    fprintf(stderr, "bmpPatchFile: `%s` is smaller than its pixel data.\n", base_filename);
+    close(fd_in);
+    return 1;
   }
 
-  if (bmp->extra_data_size > 0) {
-    written = fwrite(&bmp->extra_data_label, EXTRA_LBL_LEN, 1, file);
-    if (written != 1) BMP_WRITE_CLEANUP("fwrite extra data label", file);
-    written = fwrite(&bmp->extra_data_size, sizeof(uint32_t), 1, file);
-    if (written != 1) BMP_WRITE_CLEANUP("fwrite extra data size", file);
-    written = fwrite(bmp->extra_data, bmp->extra_data_size, 1, file);
-    if (written != 1) BMP_WRITE_CLEANUP("fwrite extra data", file);
+  uint32_t header_size = headerSize(bmp);
+  if (same_file && (bmp->offset != bmp->src_offset || header_size > bmp->offset)) {
+    // The pixel data would have to be moved, so the whole file is rewritten.
+    close(fd_in);
+    return bmpWriteFile(filename, bmp);
+  }
+
+  int fd_out = same_file ? open(filename, O_WRONLY) : open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd_out < 0) {
+    perror("open");
+    close(fd_in);
+    return 1;
   }
 
-  if (fseek(file, bmp->offset, SEEK_SET) != 0) BMP_WRITE_CLEANUP("fseek", file);
-  written = fwrite(bmp->image, bmp->image_size, 1, file);
-  if (written != 1) BMP_WRITE_CLEANUP("fwrite", file);
+  uint64_t dirty_from = bmp->dirty_from;
+  uint64_t dirty_to = bmp->dirty_to;
+  uint8_t* header = malloc(header_size);
+  // Enough requests for the header and any pixel range.
+  uint32_t n_requests = 1 + ioChunkCount(bmp->pixel_bytes, bmp->offset) + 2;
+  IoRequest* requests = malloc(n_requests * sizeof(IoRequest));
+  bool ok = header != NULL && requests != NULL;
+  if (!ok) perror("malloc");
+  if (ok) {
+    // The header and the dirty range go out in a single batch.
+    serializeHeader(bmp, header);
+    requests[0] = (IoRequest){.fd = fd_out, .buf = header, .size = header_size, .offset = 0};
+    uint32_t n = 1 + pixelRequests(fd_out, bmp, dirty_from, dirty_to, &requests[1]);
+    ok = ioWrite(n, requests);
+  }
 
-  if (fclose(file) != 0) {
-    perror("fclose");
+  if (ok && !same_file) {
+    ok = copyRange(fd_in, bmp->src_offset, fd_out, bmp->offset, dirty_from) &&
+         copyRange(
+           fd_in, (off_t)(bmp->src_offset + dirty_to), fd_out, (off_t)(bmp->offset + dirty_to),
+           bmp->pixel_bytes - dirty_to
+         );
+    // `copy_file_range` may not be supported between these files, fall back to the pixels in memory, or to copying
+    // through user space when only a window of them is loaded.
+    if (!ok && wholeImage(bmp)) {
+      uint32_t n = pixelRequests(fd_out, bmp, 0, dirty_from, requests);
+      n += pixelRequests(fd_out, bmp, dirty_to, bmp->pixel_bytes, &requests[n]);
+      ok = ioWrite(n, requests);
+    } else if (!ok) {
+      ok = copyThrough(fd_in, bmp->src_offset, fd_out, bmp->offset, dirty_from) &&
+           copyThrough(
+             fd_in, (off_t)(bmp->src_offset + dirty_to), fd_out, (off_t)(bmp->offset + dirty_to),
+             bmp->pixel_bytes - dirty_to
+           );
+    }
+  }
+  free(requests);
+  free(header);
+
+  close(fd_in);
+  if (close(fd_out) != 0) {
+    perror("close");
+    return 1;
+  }
+  return ok ? 0 : 1;
+}
+
+// Writes the dirty pixel range of `bmp` over `filename`, which must already hold the header and the pixel array of
+// `bmp`, like the file `bmpPatchFile` wrote for a previous window.
+int bmpWriteDirty(const char* filename, BMP bmp) {
+  int fd = open(filename, O_WRONLY);
+  if (fd < 0) {
+    perror("open");
+    return 1;
+  }
+  uint64_t dirty_size = bmp->dirty_to - bmp->dirty_from;
+  IoRequest* requests = malloc((ioChunkCount(dirty_size, bmp->offset + bmp->dirty_from) + 1) * sizeof(IoRequest));
+  bool ok = requests != NULL;
+  if (!ok) perror("malloc");
+  if (ok) ok = ioWrite(pixelRequests(fd, bmp, bmp->dirty_from, bmp->dirty_to, requests), requests);
+  free(requests);
+  if (close(fd) != 0) {
+    perror("close");
     return 1;
   }
-  return 0;
+  return ok ? 0 : 1;
 }
 
 void bmpPrintHeader(BMP bmp) {
   printf("=== BMP Header ===\n");
   printf("ID:                 %c%c\n", bmp->id[0], bmp->id[1]);
-  printf("Filesize:           %d bytes\n", bmp->filesize);
+  printf("Filesize:           %lu bytes\n", (unsigned long)(bmp->offset + bmp->pixel_bytes));
   printf(
     "Reserved:           %02x %02x %02x %02x\n", bmp->reserved[0], bmp->reserved[1], bmp->reserved[2], bmp->reserved[3]
   );
   printf("Pixel Data Offset:  %d bytes\n", bmp->offset);
   printf("Info Header Size:   %d bytes\n", bmp->info_header_size);
   printf("Width:              %d px\n", bmp->width);
-  printf("Height:             %d px\n", bmp->height);
+  printf("Height:             %d px%s\n", bmp->height, bmp->height < 0 ? " (top-down)" : "");
   printf("Planes:             %d\n", bmp->n_planes);
   printf("Bits Per Pixel:     %d\n", bmp->bpp);
   printf("Compression Type:   %d\n", bmp->compression_type);
-  printf("Image Size:         %d bytes\n", bmp->image_size);
+  printf("Image Size:         %lu bytes\n", (unsigned long)bmp->pixel_bytes);
   printf("X Resolution:       %d px/meter\n", bmp->horizontal_resolution);
   printf("Y Resolution:       %d px/meter\n", bmp->vertical_resolution);
   printf("Total Colors:       %d\n", bmp->n_colors);
@@ -315,24 +526,146 @@ void printColor(Color color) {
   printf("#%02x%02x%02x", color.r, color.g, color.b);
 }
 
-static bool freadWithPerror(FILE* file, void* dest, size_t size, const char* err) {
-  if (fread(dest, size, 1, file) != 1) {
-    perror(err);
+static BMP newBmp(
+  uint32_t width, int32_t height, uint16_t bpp, uint8_t reserved[4], uint32_t n_colors, Color colors[n_colors],
+  uint32_t extra_data_size, uint8_t extra_data[extra_data_size], bool with_pixels
+) {
+  BMP bmp = malloc(sizeof(BMP_CDT));
+  if (bmp == NULL) {
+    perror("malloc");
+    return NULL;
+  }
+  bmp->image = NULL;
+  bmp->image_mapped = 0;
+  bmp->image_capacity = 0;
+  bmp->window_from = 0;
+  bmp->window_size = 0;
+  bmp->extra_data = NULL;
+  bmp->src_offset = 0;
+  bmp->dirty_from = 0;
+  bmp->dirty_to = 0;
+
+  uint64_t image_size;
+  if (!pixelArraySize(width, height, bpp, &image_size)) {
+    fprintf(stderr, "bmpNew: A %ux%u image with %u bpp is too large.\n", width, rowCount(height), bpp);
+    free(bmp);
+    return NULL;
+  }
+  uint32_t extra_data_bytes = extra_data_size == 0 ? 0 : EXTRA_LBL_LEN + sizeof(uint32_t) + extra_data_size;
+  uint32_t header_size = BASE_HEADER_SIZE + DEFAULT_INFO_HEADER_SIZE + (sizeof(Color) * n_colors) + extra_data_bytes;
+
+  bmp->id[0] = 'B';
+  bmp->id[1] = 'M';
+  bmp->filesize = image_size + header_size <= UINT32_MAX ? image_size + header_size : 0;
+  if (reserved != NULL) memcpy(bmp->reserved, reserved, 4);
+  else memset(bmp->reserved, 0, 4);
+  bmp->offset = header_size;
+  bmp->info_header_size = DEFAULT_INFO_HEADER_SIZE;
+  bmp->width = width;
+  bmp->height = height;
+  bmp->n_planes = 1;
+  bmp->bpp = bpp;
+  bmp->compression_type = 0;
+  bmp->image_size = image_size <= UINT32_MAX ? image_size : 0;
+  bmp->pixel_bytes = image_size;
+  bmp->horizontal_resolution = 0;
+  bmp->vertical_resolution = 0;
+  bmp->n_colors = n_colors;
+  bmp->n_important_colors = 0;
+  if (n_colors > 0 && colors != NULL) {
+    size_t color_bytes = sizeof(Color) * bmp->n_colors;
+    bmp->colors = malloc(color_bytes);
+    if (bmp->colors == NULL) BMP_SIMPLE_CLEANUP("malloc", bmp);
+    memcpy(bmp->colors, colors, color_bytes);
+  } else {
+    bmp->n_colors = 0;
+    bmp->colors = NULL;
+  }
+  if (extra_data_size > 0 && extra_data != NULL) {
+    memcpy(bmp->extra_data_label, extra_label, EXTRA_LBL_LEN);
+    bmp->extra_data_size = extra_data_size;
+    bmp->extra_data = malloc(extra_data_size);
+    if (bmp->extra_data == NULL) BMP_SIMPLE_CLEANUP("malloc", bmp);
+    memcpy(bmp->extra_data, extra_data, extra_data_size);
+  } else {
+    bmp->extra_data_size = 0;
+    bmp->extra_data = NULL;
+  }
+  if (with_pixels) {
+    bmp->image = malloc(image_size);
+    if (bmp->image == NULL) BMP_SIMPLE_CLEANUP("malloc", bmp);
+    bmp->window_size = image_size;
+  }
+
+  return bmp;
+}
+
+static BMP loadBmp(const char* filename, bool with_colors, bool with_pixels, uint64_t spread) {
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) {
+    perror("open");
+    return NULL;
+  }
+
+  BMP bmp = malloc(sizeof(BMP_CDT));
+  if (bmp == NULL) {
+    perror("malloc");
+    close(fd);
+    return NULL;
+  }
+  bmp->colors = NULL;
+  bmp->image = NULL;
+  bmp->image_mapped = 0;
+  bmp->image_capacity = 0;
+  bmp->window_from = 0;
+  bmp->window_size = 0;
+  bmp->extra_data = NULL;
+  bmp->dirty_from = 0;
+  bmp->dirty_to = 0;
+
+  HeaderBuffer header = {.data = malloc(HEADER_PREFIX_SIZE), .size = 0, .pos = 0};
+  bool ok = header.data != NULL;
+  if (!ok) perror("malloc");
+  if (ok) {
+    IoRequest prefix = {.fd = fd, .buf = header.data, .size = HEADER_PREFIX_SIZE, .offset = 0};
+    ok = ioRead(1, &prefix);
+    header.size = prefix.done;
+  }
+  ok = ok && parseBaseHeader(&header, bmp) && parseInfoHeader(&header, bmp) &&
+       readRemaining(filename, fd, bmp, &header, with_pixels, spread) &&
+       (with_colors ? parseColorTable(&header, bmp) : skipColorTable(&header, bmp)) && parseExtraData(&header, bmp);
+
+  free(header.data);
+  close(fd);
+  if (!ok) {
+    bmpFree(bmp);
+    return NULL;
+  }
+  return bmp;
+}
+
+static bool readWithError(HeaderBuffer* header, void* dest, size_t size, const char* err) {
+  if (header->pos + size > header->size) {
+    fprintf(stderr, "%s: Unexpected end of file.\n", err);
     return false;
   }
+  memcpy(dest, header->data + header->pos, size);
+  header->pos += size;
   return true;
 }
 
-static bool parseBaseHeader(FILE* file, BMP bmp) {
+static bool parseBaseHeader(HeaderBuffer* header, BMP bmp) {
   // I need to split the reading because in the strcut, the `filesize` field
   // will be shifted 2 bytes to align with the closest dword.
-  if (!freadWithPerror(file, bmp, 2, "fread base")) return false;
+  if (!readWithError(header, bmp, 2, "read base")) return false;
   if (bmp->id[0] != 'B' || bmp->id[1] != 'M') return false;
-  return freadWithPerror(file, &bmp->filesize, BASE_HEADER_SIZE - 2, "fread base");
+  if (!readWithError(header, &bmp->filesize, BASE_HEADER_SIZE - 2, "read base")) return false;
+  bmp->src_offset = bmp->offset;
+  return true;
 }
 
-static bool parseInfoHeader(FILE* file, BMP bmp) {
-  if (!freadWithPerror(file, &bmp->info_header_size, sizeof(uint32_t), "fread info_size")) return false;
+static bool parseInfoHeader(HeaderBuffer* header, BMP bmp) {
+  if (!readWithError(header, &bmp->info_header_size, sizeof(uint32_t), "read info_size")) return false;
   if (bmp->info_header_size > DEFAULT_INFO_HEADER_SIZE) {
     // fprintf(stderr, "Error: info_header_size != %d. Can't parse.\n", DEFAULT_INFO_HEADER_SIZE);
     // return false;
@@ -348,22 +681,31 @@ static bool parseInfoHeader(FILE* file, BMP bmp) {
     // // read from an incorrect offset.
     // bmp->offset -= diff;
   }
-  if (!freadWithPerror(
-        file, ((uint8_t*)&bmp->info_header_size) + sizeof(uint32_t), bmp->info_header_size - sizeof(uint32_t),
-        "fread info"
+  if (!readWithError(
+        header, ((uint8_t*)&bmp->info_header_size) + sizeof(uint32_t), bmp->info_header_size - sizeof(uint32_t),
+        "read info"
       )) {
     return false;
   } else {
-    // BMP rows must be padded to be multiple of 4 bytes.
-    // The `+3 & ~3` is to get closest rounded up multiple of 4
-    uint32_t should_be_size = bmp->height * ((ceilDiv(bmp->width * bmp->bpp, BYTE_SIZE) + 3) & ~3u);
-    if (bmp->image_size != should_be_size) {
+    if (bmp->width > INT32_MAX || bmp->height == INT32_MIN) {
+      fprintf(stderr, "Error: Invalid image geometry (width %d, height %d).\n", (int32_t)bmp->width, bmp->height);
+      return false;
+    }
+    uint64_t should_be_size;
+    if (!pixelArraySize(bmp->width, bmp->height, bmp->bpp, &should_be_size)) {
+      fprintf(stderr, "Error: A %ux%u image with %u bpp is too large.\n", bmp->width, rowCount(bmp->height), bmp->bpp);
+      return false;
+    }
+    // Past 4 GiB the field can't hold the size, writers leave it as 0.
+    uint32_t should_be_field = should_be_size <= UINT32_MAX ? should_be_size : 0;
+    if (bmp->image_size != should_be_field) {
       fprintf(
-        stderr, "Warning: Incorrect image_size found. Expected %u, found %u. Using correct value.\n", should_be_size,
-        bmp->image_size
+        stderr, "Warning: Incorrect image_size found. Expected %lu, found %u. Using correct value.\n",
+        (unsigned long)should_be_size, bmp->image_size
       );
-      bmp->image_size = should_be_size;
+      bmp->image_size = should_be_field;
     }
+    bmp->pixel_bytes = should_be_size;
     uint32_t should_be_n_colors = 1u << bmp->bpp;
     if (bmp->bpp <= 8 && bmp->n_colors != should_be_n_colors) {
       fprintf(
@@ -378,7 +720,7 @@ static bool parseInfoHeader(FILE* file, BMP bmp) {
   }
 }
 
-static bool parseColorTable(FILE* file, BMP bmp) {
+static bool parseColorTable(HeaderBuffer* header, BMP bmp) {
   if (bmp->n_colors == 0) {
     bmp->colors = NULL;
     return true;
@@ -395,17 +737,26 @@ static bool parseColorTable(FILE* file, BMP bmp) {
     return false;
   }
 
-  return freadWithPerror(file, bmp->colors, color_bytes, "fread colors");
+  return readWithError(header, bmp->colors, color_bytes, "read colors");
 }
 
-static bool parseExtraData(FILE* file, BMP bmp) {
-  if (ftell(file) == bmp->offset) {
+static bool skipColorTable(HeaderBuffer* header, BMP bmp) {
+  if (bmp->n_colors > 10000) {
+    fprintf(stderr, "Too many colors (%u), probably an error.\n", bmp->n_colors);
+    return false;
+  }
+  header->pos += bmp->n_colors * sizeof(Color);
+  return true;
+}
+
+static bool parseExtraData(HeaderBuffer* header, BMP bmp) {
+  if (header->pos == bmp->offset) {
     bmp->extra_data_size = 0;
     bmp->extra_data = NULL;
     return true;
   }
 
-  if (!freadWithPerror(file, &bmp->extra_data_label, EXTRA_LBL_LEN, "fread extra data label")) return false;
+  if (!readWithError(header, &bmp->extra_data_label, EXTRA_LBL_LEN, "read extra data label")) return false;
   for (int i = 0; i < EXTRA_LBL_LEN; ++i) {
     if (bmp->extra_data_label[i] != extra_label[i]) {
       bmp->extra_data_size = 0;
@@ -414,7 +765,7 @@ static bool parseExtraData(FILE* file, BMP bmp) {
     }
   }
 
-  if (!freadWithPerror(file, &bmp->extra_data_size, sizeof(uint32_t), "fread extra data size")) return false;
+  if (!readWithError(header, &bmp->extra_data_size, sizeof(uint32_t), "read extra data size")) return false;
   if (bmp->extra_data_size == 0) {
     bmp->extra_data = NULL;
     return true;
@@ -425,26 +776,188 @@ static bool parseExtraData(FILE* file, BMP bmp) {
     return false;
   }
 
-  return freadWithPerror(file, bmp->extra_data, bmp->extra_data_size, "fread extra data");
+  return readWithError(header, bmp->extra_data, bmp->extra_data_size, "read extra data");
 }
 
-static bool parseImageData(FILE* file, BMP bmp) {
-  if (fseek(file, bmp->offset, SEEK_SET) != 0) {
-    perror("fseek");
+// Reads the rest of the header, up to the pixel data, and the pixel data with a single batch of requests. With direct
+// I/O the pixels are read through a second descriptor opened with `O_DIRECT`, which needs aligned offsets, sizes and
+// buffers, so the aligned span around them is read and the pixels are moved to the start of the buffer afterwards.
+// With a `spread` and more than one NUMA node, the buffer is mapped and placed before the read first touches it.
+static bool readRemaining(
+  const char* filename, int fd, BMP bmp, HeaderBuffer* header, bool with_pixels, uint64_t spread
+) {
+  struct stat file_stat;
+  if (fstat(fd, &file_stat) != 0) {
+    perror("fstat");
     return false;
   }
-
-  bmp->image = malloc(bmp->image_size);
-  if (!bmp->image) {
-    perror("malloc image");
+  if (bmp->offset > file_stat.st_size) {
+    fprintf(stderr, "`%s`: Pixel data offset %u is past the end of the file.\n", filename, bmp->offset);
     return false;
   }
+  uint32_t tail_size = bmp->offset > header->size ? bmp->offset - header->size : 0;
+  if (tail_size > 0) {
+    uint8_t* grown = realloc(header->data, bmp->offset);
+    if (grown == NULL) {
+      perror("realloc");
+      return false;
+    }
+    header->data = grown;
+  }
 
-  size_t read = fread(bmp->image, 1, bmp->image_size, file);
-  if (read != bmp->image_size) {
-    perror("fread image");
+  int direct_fd = (with_pixels && ioDirect()) ? open(filename, O_RDONLY | O_DIRECT) : -1;
+  off_t pixels_from = bmp->offset;
+  size_t pixels_size = with_pixels ? bmp->pixel_bytes : 0;
+  if (direct_fd >= 0) {
+    pixels_from = bmp->offset - (bmp->offset % IO_ALIGN);
+    off_t pixels_to = (off_t)(bmp->offset + bmp->pixel_bytes);
+    pixels_to += (IO_ALIGN - (pixels_to % IO_ALIGN)) % IO_ALIGN;
+    pixels_size = pixels_to - pixels_from;
+  }
+  if (with_pixels) {
+    void* image = NULL;
+    if (spread > 0 && numaNodeCount() > 1) {
+      // Mappings are page aligned, which is enough for direct I/O.
+      image = numaAlloc(pixels_size, spread < pixels_size ? spread : pixels_size);
+      if (image != NULL) bmp->image_mapped = pixels_size;
+    } else if (direct_fd >= 0 && posix_memalign(&image, IO_ALIGN, pixels_size) != 0) image = NULL;
+    else if (direct_fd < 0) image = malloc(pixels_size > 0 ? pixels_size : 1);
+    if (image == NULL) {
+      perror("malloc image");
+      if (direct_fd >= 0) close(direct_fd);
+      return false;
+    }
+    bmp->image = image;
+  }
+
+  uint32_t n_requests = (tail_size > 0) + ioChunkCount(pixels_size, pixels_from);
+  IoRequest* requests = malloc((n_requests + 1) * sizeof(IoRequest));
+  if (requests == NULL) {
+    perror("malloc");
+    if (direct_fd >= 0) close(direct_fd);
     return false;
   }
+  uint32_t n = 0;
+  if (tail_size > 0) {
+    uint8_t* tail = header->data + header->size;
+    requests[n++] = (IoRequest){.fd = fd, .buf = tail, .size = tail_size, .offset = header->size};
+  }
+  n += ioSplit(direct_fd >= 0 ? direct_fd : fd, bmp->image, pixels_size, pixels_from, &requests[n]);
+  bool ok = ioRead(n, requests);
+  if (direct_fd >= 0) close(direct_fd);
+
+  if (ok && tail_size > 0) header->size += requests[0].done;
+  size_t pixels_read = 0;
+  for (uint32_t i = tail_size > 0; ok && i < n && pixels_read == (size_t)(requests[i].offset - pixels_from); ++i) {
+    pixels_read += requests[i].done;
+  }
+  free(requests);
+  if (!ok) return false;
+
+  if (with_pixels) {
+    size_t skip = bmp->offset - pixels_from;
+    if (pixels_read < skip + bmp->pixel_bytes) {
+      fprintf(stderr, "`%s`: Unexpected end of file in the pixel data.\n", filename);
+      return false;
+    }
+    if (skip > 0) memmove(bmp->image, bmp->image + skip, bmp->pixel_bytes);
+    bmp->window_size = bmp->pixel_bytes;
+  }
+  return true;
+}
+
+// Fails when the pixel array wouldn't fit in memory or in a file, or when the geometry doesn't fit in the signed fields
+// of the header.
+static bool pixelArraySize(uint32_t width, int32_t height, uint32_t bpp, uint64_t* size) {
+  if (width > INT32_MAX || height == INT32_MIN) return false;
+  if (__builtin_mul_overflow(rowSize(width, bpp), (uint64_t)rowCount(height), size)) return false;
+  return *size <= SIZE_MAX && *size <= (uint64_t)INT64_MAX - UINT32_MAX;
+}
+
+// Rows are padded to a multiple of 4 bytes.
+static uint64_t rowSize(uint32_t width, uint32_t bpp) {
+  return ((((uint64_t)width * bpp) + BYTE_SIZE - 1) / BYTE_SIZE + 3) & ~(uint64_t)3;
+}
+
+static uint32_t rowCount(int32_t height) {
+  return height < 0 ? 0u - (uint32_t)height : (uint32_t)height;
+}
+
+static uint32_t headerSize(BMP bmp) {
+  uint32_t extra_data_bytes = bmp->extra_data_size == 0 ? 0 : EXTRA_LBL_LEN + sizeof(uint32_t) + bmp->extra_data_size;
+  return BASE_HEADER_SIZE + bmp->info_header_size + (sizeof(Color) * bmp->n_colors) + extra_data_bytes;
+}
 
+// Same layout `bmpWriteFile` writes, in a single buffer of `headerSize` bytes.
+static void serializeHeader(BMP bmp, uint8_t* header) {
+  memcpy(header, bmp->id, 2);
+  header += 2;
+  // The file ends with the pixel data, whatever the size of the file it was parsed from.
+  uint64_t filesize = bmp->offset + bmp->pixel_bytes;
+  bmp->filesize = filesize <= UINT32_MAX ? filesize : 0;
+  memcpy(header, &bmp->filesize, BASE_HEADER_SIZE - 2);
+  header += BASE_HEADER_SIZE - 2;
+  memcpy(header, &bmp->info_header_size, bmp->info_header_size);
+  header += bmp->info_header_size;
+  if (bmp->n_colors > 0) {
+    memcpy(header, bmp->colors, sizeof(Color) * bmp->n_colors);
+    header += sizeof(Color) * bmp->n_colors;
+  }
+  if (bmp->extra_data_size > 0) {
+    memcpy(header, bmp->extra_data_label, EXTRA_LBL_LEN);
+    header += EXTRA_LBL_LEN;
+    memcpy(header, &bmp->extra_data_size, sizeof(uint32_t));
+    header += sizeof(uint32_t);
+    memcpy(header, bmp->extra_data, bmp->extra_data_size);
+  }
+}
+
+// Fills `requests` with the writes of the pixel bytes in [from, to), returning how many it used.
+static uint32_t pixelRequests(int fd, BMP bmp, uint64_t from, uint64_t to, IoRequest* requests) {
+  if (from >= to) return 0;
+  return ioSplit(fd, bmp->image + (from - bmp->window_from), to - from, (off_t)bmp->offset + from, requests);
+}
+
+static bool copyRange(int fd_in, off_t offset_in, int fd_out, off_t offset_out, size_t size) {
+  while (size > 0) {
+    ssize_t copied = copy_file_range(fd_in, &offset_in, fd_out, &offset_out, size, 0);
+    if (copied < 0 && errno == EINTR) continue;
+    if (copied <= 0) return false;
+    size -= copied;
+  }
   return true;
 }
+
+// Falls back to reads and writes for file systems that `copy_file_range` doesn't support.
+static bool copyThrough(int fd_in, off_t offset_in, int fd_out, off_t offset_out, size_t size) {
+  uint8_t* buf = malloc(size < IO_CHUNK_SIZE ? size + 1 : IO_CHUNK_SIZE);
+  if (buf == NULL) {
+    perror("malloc");
+    return false;
+  }
+  bool ok = true;
+  for (size_t done = 0; ok && done < size;) {
+    size_t chunk = size - done < IO_CHUNK_SIZE ? size - done : IO_CHUNK_SIZE;
+    IoRequest request = {.fd = fd_in, .buf = buf, .size = chunk, .offset = offset_in + (off_t)done};
+    ok = ioRead(1, &request) && request.done == chunk;
+    request = (IoRequest){.fd = fd_out, .buf = buf, .size = chunk, .offset = offset_out + (off_t)done};
+    ok = ok && ioWrite(1, &request);
+    done += chunk;
+  }
+  free(buf);
+  return ok;
+}
+
+static bool wholeImage(BMP bmp) {
+  return bmp->image != NULL && bmp->window_from == 0 && bmp->window_size == bmp->pixel_bytes;
+}
+
+static void freeImage(BMP bmp) {
+  if (bmp->image_mapped > 0) numaFree(bmp->image, bmp->image_mapped);
+  else free(bmp->image);
+  bmp->image = NULL;
+  bmp->image_mapped = 0;
+  bmp->image_capacity = 0;
+  bmp->window_from = 0;
+  bmp->window_size = 0;
+}
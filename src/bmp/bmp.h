@@ -1,6 +1,7 @@
 #ifndef BMP_H
 #define BMP_H
 
+#include <stdbool.h>
 #include <stdint.h>
 
 typedef struct BMP_CDT* BMP;
@@ -13,15 +14,27 @@ typedef struct Color {
 } Color;
 
 BMP bmpNew(
-  uint32_t width, uint32_t height, uint16_t bpp, uint8_t reserved[4], uint32_t n_colors,
+  uint32_t width, int32_t height, uint16_t bpp, uint8_t reserved[4], uint32_t n_colors,
+  Color colors[n_colors], uint32_t extra_data_size, uint8_t extra_data[extra_data_size]
+);
+BMP bmpNewHeader(
+  uint32_t width, int32_t height, uint16_t bpp, uint8_t reserved[4], uint32_t n_colors,
   Color colors[n_colors], uint32_t extra_data_size, uint8_t extra_data[extra_data_size]
 );
 BMP bmpParse(const char* filename);
+BMP bmpParseSpread(const char* filename, uint64_t span);
+BMP bmpParseWindow(const char* filename, uint64_t from, uint64_t to);
+BMP bmpParseRecycled(const char* filename, BMP recycled);
+BMP bmpProbe(const char* filename);
 void bmpFree(BMP bmp);
+void bmpDropImage(BMP bmp);
 uint8_t* bmpImage(BMP bmp);
-uint32_t bmpImageSize(BMP bmp);
+uint64_t bmpWindowFrom(BMP bmp);
+bool bmpLoadWindow(BMP bmp, const char* filename, uint64_t from, uint64_t to);
+uint64_t bmpImageSize(BMP bmp);
 uint32_t bmpWidth(BMP bmp);
 uint32_t bmpHeight(BMP bmp);
+bool bmpTopDown(BMP bmp);
 uint32_t bmpBpp(BMP bmp);
 uint32_t bmpNColors(BMP bmp);
 Color* bmpColors(BMP bmp);
@@ -31,6 +44,11 @@ void bmpSetExtraData(BMP bmp, uint32_t extra_data_size, uint8_t* extra_data);
 uint8_t* bmpReserved(BMP bmp);
 void bmpSetReserved(BMP bmp, uint8_t reserved[4]);
 int bmpWriteFile(const char* filename, BMP bmp);
+void bmpMarkDirty(BMP bmp, uint64_t from, uint64_t to);
+void bmpMarkClean(BMP bmp);
+void bmpDirtyRange(BMP bmp, uint64_t* from, uint64_t* to);
+int bmpPatchFile(const char* filename, const char* base_filename, BMP bmp);
+int bmpWriteDirty(const char* filename, BMP bmp);
 void bmpPrintHeader(BMP bmp);
 
 #endif
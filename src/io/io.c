@@ -0,0 +1,289 @@
+#define _GNU_SOURCE
+
+#include "io.h"
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define RING_ENTRIES 64
+
+typedef enum RingState {
+  RING_UNINITIALIZED = 0,
+  RING_READY,
+  RING_UNAVAILABLE,
+} RingState;
+
+// io_uring is used through its raw syscalls, so there's no dependency on liburing.
+typedef struct Ring {
+  RingState state;
+  int fd;
+  uint32_t entries;
+  uint32_t* sq_head;
+  uint32_t* sq_tail;
+  uint32_t* sq_mask;
+  uint32_t* sq_array;
+  struct io_uring_sqe* sqes;
+  uint32_t* cq_head;
+  uint32_t* cq_tail;
+  uint32_t* cq_mask;
+  struct io_uring_cqe* cqes;
+  void* sq_ptr;
+  size_t sq_len;
+  void* cq_ptr;
+  size_t cq_len;
+  size_t sqes_len;
+} Ring;
+
+static IoBackendKind backend = IO_BACKEND_AUTO;
+static bool direct = false;
+// Every thread gets its own ring, a ring must not be shared between threads without locking.
+static _Thread_local Ring ring = {.state = RING_UNINITIALIZED, .fd = -1};
+
+static bool ringInit(Ring* r);
+static bool ringSubmit(Ring* r, uint32_t n_requests, IoRequest requests[n_requests], bool write);
+static void ringAbandon(Ring* r, uint32_t in_flight);
+static void ringClose(Ring* r);
+static bool syncTransfer(IoRequest* request, bool write);
+static bool transfer(uint32_t n_requests, IoRequest requests[n_requests], bool write);
+
+// Returns false if io_uring was asked for but the kernel doesn't allow it.
+bool ioSetBackend(IoBackendKind kind) {
+  backend = kind;
+  if (kind != IO_BACKEND_URING) return true;
+  if (ring.state == RING_UNINITIALIZED) ringInit(&ring);
+  return ring.state == RING_READY;
+}
+
+const char* ioBackendName(void) {
+  if (backend == IO_BACKEND_SYNC) return "sync";
+  if (ring.state == RING_UNINITIALIZED) ringInit(&ring);
+  return ring.state == RING_READY ? "io_uring" : "sync";
+}
+
+// Pixel reads bypass the page cache with `O_DIRECT` when possible, see `bmpParse`.
+void ioSetDirect(bool value) {
+  direct = value;
+}
+
+bool ioDirect(void) {
+  return direct;
+}
+
+bool ioRead(uint32_t n_requests, IoRequest requests[n_requests]) {
+  return transfer(n_requests, requests, false);
+}
+
+bool ioWrite(uint32_t n_requests, IoRequest requests[n_requests]) {
+  return transfer(n_requests, requests, true);
+}
+
+// Number of requests `ioSplit` splits a transfer of `size` bytes at `offset` into.
+uint32_t ioChunkCount(size_t size, off_t offset) {
+  if (size == 0) return 0;
+  off_t first = offset - (offset % IO_CHUNK_SIZE);
+  off_t end = offset + (off_t)size;
+  return (uint32_t)((end - first + IO_CHUNK_SIZE - 1) / IO_CHUNK_SIZE);
+}
+
+// Splits a transfer at file offsets that are multiples of `IO_CHUNK_SIZE`, so every request but the first starts
+// aligned. `requests` must have room for `ioChunkCount(size, offset)` requests.
+uint32_t ioSplit(int fd, void* buf, size_t size, off_t offset, IoRequest* requests) {
+  uint32_t n = 0;
+  uint8_t* bytes = buf;
+  while (size > 0) {
+    size_t chunk = IO_CHUNK_SIZE - (offset % IO_CHUNK_SIZE);
+    if (chunk > size) chunk = size;
+    requests[n++] = (IoRequest){.fd = fd, .buf = bytes, .size = chunk, .offset = offset, .done = 0};
+    bytes += chunk;
+    offset += (off_t)chunk;
+    size -= chunk;
+  }
+  return n;
+}
+
+// Tears down the ring of the calling thread.
+void ioRelease(void) {
+  if (ring.state != RING_READY) return;
+  ringClose(&ring);
+  ring.state = RING_UNINITIALIZED;
+}
+
+// Internal functions
+
+static bool ringInit(Ring* r) {
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  r->state = RING_UNAVAILABLE;
+  int fd = (int)syscall(__NR_io_uring_setup, RING_ENTRIES, &params);
+  // ENOSYS, EPERM (seccomp, `kernel.io_uring_disabled`), ENOMEM... all mean falling back to synchronous I/O.
+  if (fd < 0) return false;
+
+  r->sq_len = params.sq_off.array + (params.sq_entries * sizeof(uint32_t));
+  r->cq_len = params.cq_off.cqes + (params.cq_entries * sizeof(struct io_uring_cqe));
+  bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+  if (single_mmap && r->cq_len > r->sq_len) r->sq_len = r->cq_len;
+  r->sq_ptr = mmap(NULL, r->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  if (r->sq_ptr == MAP_FAILED) {
+    close(fd);
+    return false;
+  }
+  if (single_mmap) {
+    r->cq_ptr = r->sq_ptr;
+    r->cq_len = r->sq_len;
+  } else {
+    r->cq_ptr = mmap(NULL, r->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    if (r->cq_ptr == MAP_FAILED) {
+      munmap(r->sq_ptr, r->sq_len);
+      close(fd);
+      return false;
+    }
+  }
+  r->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+  r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+  if (r->sqes == MAP_FAILED) {
+    if (!single_mmap) munmap(r->cq_ptr, r->cq_len);
+    munmap(r->sq_ptr, r->sq_len);
+    close(fd);
+    return false;
+  }
+
+  uint8_t* sq = r->sq_ptr;
+  uint8_t* cq = r->cq_ptr;
+  r->sq_head = (uint32_t*)(sq + params.sq_off.head);
+  r->sq_tail = (uint32_t*)(sq + params.sq_off.tail);
+  r->sq_mask = (uint32_t*)(sq + params.sq_off.ring_mask);
+  r->sq_array = (uint32_t*)(sq + params.sq_off.array);
+  r->cq_head = (uint32_t*)(cq + params.cq_off.head);
+  r->cq_tail = (uint32_t*)(cq + params.cq_off.tail);
+  r->cq_mask = (uint32_t*)(cq + params.cq_off.ring_mask);
+  r->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+  r->entries = params.sq_entries;
+  r->fd = fd;
+  r->state = RING_READY;
+  return true;
+}
+
+// Submits the requests a ring-full at a time and waits for all of them. The result of every request is left in its
+// `done` field as the raw completion value, negative on error.
+static bool ringSubmit(Ring* r, uint32_t n_requests, IoRequest requests[n_requests], bool write) {
+  for (uint32_t first = 0; first < n_requests; first += r->entries) {
+    uint32_t batch = n_requests - first < r->entries ? n_requests - first : r->entries;
+    uint32_t tail = *r->sq_tail;
+    for (uint32_t i = 0; i < batch; ++i) {
+      IoRequest* request = &requests[first + i];
+      uint32_t idx = tail & *r->sq_mask;
+      struct io_uring_sqe* sqe = &r->sqes[idx];
+      memset(sqe, 0, sizeof(*sqe));
+      sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+      sqe->fd = request->fd;
+      sqe->addr = (uint64_t)(uintptr_t)request->buf;
+      sqe->len = request->size;
+      sqe->off = request->offset;
+      sqe->user_data = first + i;
+      r->sq_array[idx] = idx;
+      ++tail;
+    }
+    __atomic_store_n(r->sq_tail, tail, __ATOMIC_RELEASE);
+
+    uint32_t to_submit = batch;
+    uint32_t completed = 0;
+    while (completed < batch) {
+      int ret = (int)syscall(__NR_io_uring_enter, r->fd, to_submit, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+      if (ret < 0) {
+        if (errno == EINTR) continue;
+        perror("io_uring_enter");
+        ringAbandon(r, batch - to_submit - completed);
+        return false;
+      }
+      to_submit -= (uint32_t)ret < to_submit ? (uint32_t)ret : to_submit;
+
+      uint32_t head = *r->cq_head;
+      uint32_t cq_tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+      for (; head != cq_tail; ++head) {
+        struct io_uring_cqe* cqe = &r->cqes[head & *r->cq_mask];
+        // Only requests of this batch can complete, anything else is ignored rather than trusted as an index.
+        if (cqe->user_data < first || cqe->user_data >= (uint64_t)first + batch) continue;
+        requests[cqe->user_data].done = (size_t)(ssize_t)cqe->res;
+        ++completed;
+      }
+      __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+    }
+  }
+  return true;
+}
+
+// Called when `io_uring_enter` failed in the middle of a batch. The entries that weren't submitted are dropped and the
+// `in_flight` requests that were are waited for, since they still point to the caller's buffers. The ring is then torn
+// down and the thread falls back to synchronous I/O, so no completion of the batch is ever mistaken for a later one.
+static void ringAbandon(Ring* r, uint32_t in_flight) {
+  __atomic_store_n(r->sq_tail, __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE), __ATOMIC_RELEASE);
+  while (in_flight > 0) {
+    int ret = (int)syscall(__NR_io_uring_enter, r->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+    if (ret < 0 && errno != EINTR) break;
+    uint32_t head = *r->cq_head;
+    uint32_t cq_tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != cq_tail && in_flight > 0; ++head) --in_flight;
+    __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+  }
+  ringClose(r);
+  r->state = RING_UNAVAILABLE;
+}
+
+static void ringClose(Ring* r) {
+  munmap(r->sqes, r->sqes_len);
+  if (r->cq_ptr != r->sq_ptr) munmap(r->cq_ptr, r->cq_len);
+  munmap(r->sq_ptr, r->sq_len);
+  close(r->fd);
+  r->fd = -1;
+}
+
+// Transfers what's left of `request` after `request->done` bytes.
+static bool syncTransfer(IoRequest* request, bool write) {
+  uint8_t* bytes = request->buf;
+  while (request->done < request->size) {
+    size_t left = request->size - request->done;
+    off_t offset = request->offset + (off_t)request->done;
+    ssize_t ret = write ? pwrite(request->fd, bytes + request->done, left, offset)
+                        : pread(request->fd, bytes + request->done, left, offset);
+    if (ret < 0) {
+      if (errno == EINTR) continue;
+      perror(write ? "pwrite" : "pread");
+      return false;
+    }
+    if (ret == 0) {
+      if (!write) break; // End of file.
+      errno = EIO;
+      perror("pwrite");
+      return false;
+    }
+    request->done += ret;
+  }
+  return true;
+}
+
+static bool transfer(uint32_t n_requests, IoRequest requests[n_requests], bool write) {
+  for (uint32_t i = 0; i < n_requests; ++i) requests[i].done = 0;
+  if (backend != IO_BACKEND_SYNC && ring.state == RING_UNINITIALIZED) ringInit(&ring);
+  // A single request gains nothing from the ring.
+  if (backend != IO_BACKEND_SYNC && ring.state == RING_READY && n_requests > 1) {
+    if (!ringSubmit(&ring, n_requests, requests, write)) return false;
+    // Failed requests (e.g. an opcode the kernel doesn't know) are retried from scratch, and short transfers are
+    // completed, synchronously. A short read only stops there at the end of the file.
+    for (uint32_t i = 0; i < n_requests; ++i) {
+      if ((ssize_t)requests[i].done < 0) requests[i].done = 0;
+      if (requests[i].done < requests[i].size && !syncTransfer(&requests[i], write)) return false;
+    }
+    return true;
+  }
+  for (uint32_t i = 0; i < n_requests; ++i) {
+    if (!syncTransfer(&requests[i], write)) return false;
+  }
+  return true;
+}
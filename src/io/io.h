@@ -0,0 +1,38 @@
+#ifndef IO_H
+#define IO_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// Alignment of the file offsets that pixel transfers are split at, and of the buffers used with `O_DIRECT`.
+#define IO_ALIGN 4096
+// Big transfers are split into requests of at most this many bytes so that several of them are in flight at once.
+#define IO_CHUNK_SIZE (1024 * 1024)
+
+typedef enum IoBackendKind {
+  IO_BACKEND_AUTO = 0, // io_uring when the kernel allows it, synchronous otherwise.
+  IO_BACKEND_SYNC,     // pread/pwrite, one request at a time.
+  IO_BACKEND_URING,    // io_uring, every request of a batch submitted with a single syscall.
+} IoBackendKind;
+
+typedef struct IoRequest {
+  int fd;
+  void* buf;
+  size_t size;
+  off_t offset;
+  size_t done; // Bytes transferred. Only less than `size` for reads that reach the end of the file.
+} IoRequest;
+
+bool ioSetBackend(IoBackendKind kind);
+const char* ioBackendName(void);
+void ioSetDirect(bool direct);
+bool ioDirect(void);
+bool ioRead(uint32_t n_requests, IoRequest requests[n_requests]);
+bool ioWrite(uint32_t n_requests, IoRequest requests[n_requests]);
+uint32_t ioChunkCount(size_t size, off_t offset);
+uint32_t ioSplit(int fd, void* buf, size_t size, off_t offset, IoRequest* requests);
+void ioRelease(void);
+
+#endif
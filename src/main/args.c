@@ -2,7 +2,9 @@
 
 #include "args.h"
 #include "../bmp/bmp.h"
-#include <dirent.h>
+#include "../io/io.h"
+#include "../sis/keystream.h"
+#include "../sis/scan.h"
 #include <errno.h>
 #include <getopt.h>
 #include <stdint.h>
@@ -14,9 +16,8 @@
 
 static void printHelp(const char* executable_name);
 static uint8_t strToKRange(const char* str, const char* var_name);
-static uint16_t strToUInt16(const char* str, const char* var_name);
-static int countBmpFiles(const char* directory);
-static void collectBmpFiles(Args* args, int needed_count);
+static uint64_t strToUInt64(const char* str, const char* var_name);
+static uint32_t strToNumInRange(const char* str, uint32_t min, uint32_t max, const char* var_name);
 static bool printHeader(const char* secret_filename);
 static bool is_directory(const char* path);
 __attribute__((noreturn)) static void clean_exit(Args* args, int err);
@@ -25,8 +26,27 @@ static void parseOptions(Args* args, int argc, char* argv[]);
 
 Args* argsParse(int argc, char* argv[]) {
   Args* args = initArgs();
+  args->secret_filenames = malloc(argc * sizeof(const char*));
+  if (args->secret_filenames == NULL) {
+    perror("malloc");
+    clean_exit(args, EXIT_FAILURE);
+  }
   parseOptions(args, argc, argv);
 
+  // Jobs come from the socket in daemon mode.
+  if (args->listen_path != NULL) return args;
+
+  // Deltas are read from --dir and materialized into --dir-out, no secret is involved.
+  if (args->materialize) {
+    if (args->directory == NULL) args->directory = ".";
+    if (args->directory_out == NULL) args->directory_out = args->directory;
+    if (!is_directory(args->directory) || !is_directory(args->directory_out)) {
+      fprintf(stderr, "Error: --materialize needs valid --dir and --dir-out directories.\n");
+      clean_exit(args, EXIT_FAILURE);
+    }
+    return args;
+  }
+
   if (!args->secret_filename) {
     fprintf(stderr, "Error: secret filename/path is required.\n");
     fprintf(stderr, "Try '%s --help' for usage.\n", argv[0]);
@@ -38,6 +58,30 @@ Args* argsParse(int argc, char* argv[]) {
     clean_exit(args, EXIT_FAILURE);
   }
 
+  // The reserved bytes only hold 16 bits of the seed, the LCG mask has nowhere else to store it.
+  if (args->distribute && args->mask == MASK_LCG && args->seed > UINT16_MAX) {
+    fprintf(stderr, "Error: Seeds past %u need --mask chacha.\n", UINT16_MAX);
+    clean_exit(args, EXIT_FAILURE);
+  }
+
+  // Every frame of a sequence is hidden in the same carriers, each into its own sub-directory.
+  if (args->sequence && (!args->distribute || args->pack || args->in_place || args->max_memory > 0)) {
+    fprintf(
+      stderr, "Error: --sequence needs --distribute and can't be used with --pack, --in-place or --max-memory.\n"
+    );
+    clean_exit(args, EXIT_FAILURE);
+  }
+
+  if (args->deltas && (!args->distribute || args->in_place)) {
+    fprintf(stderr, "Error: --delta needs --distribute and can't be used with --in-place.\n");
+    clean_exit(args, EXIT_FAILURE);
+  }
+
+  if (args->recover && args->n_secrets > 1) {
+    fprintf(stderr, "Error: only one secret can be recovered at a time.\n");
+    clean_exit(args, EXIT_FAILURE);
+  }
+
   if (args->min_shadows == 0) {
     fprintf(stderr, "Error: --min-shadows must be specified.\n");
     clean_exit(args, EXIT_FAILURE);
@@ -58,8 +102,10 @@ Args* argsParse(int argc, char* argv[]) {
     clean_exit(args, EXIT_FAILURE);
   }
 
-  int bmps_in_dir = countBmpFiles(args->directory);
-  if (args->tot_shadows == 0) args->tot_shadows = bmps_in_dir;
+  args->carriers = args->recover && args->sidecars ? scanSidecars(args->directory) : scanCarriers(args->directory);
+  if (args->carriers == NULL) clean_exit(args, EXIT_FAILURE);
+  uint32_t bmps_in_dir = args->carriers->count;
+  if (args->tot_shadows == 0) args->tot_shadows = bmps_in_dir > UINT8_MAX ? UINT8_MAX : bmps_in_dir;
   else if (bmps_in_dir < args->tot_shadows) {
     fprintf(
       stderr, "Error: Not enough carrier images. Want %u shadows but found only %u carrier images.\n",
@@ -73,13 +119,6 @@ Args* argsParse(int argc, char* argv[]) {
     clean_exit(args, EXIT_FAILURE);
   }
 
-  uint8_t to_parse;
-  if (args->distribute) to_parse = args->tot_shadows;
-  else to_parse = args->min_shadows;
-
-  args->dir_bmps = (BMP*)malloc(to_parse * sizeof(BMP));
-  collectBmpFiles(args, to_parse);
-
   return args;
 }
 
@@ -92,14 +131,32 @@ static Args* initArgs() {
   args->distribute = false;
   args->recover = false;
   args->secret_filename = NULL;
+  args->secret_filenames = NULL;
+  args->n_secrets = 0;
   args->min_shadows = 0;
   args->tot_shadows = 0;
   args->directory = NULL;
   args->directory_out = NULL;
   args->_directory_allocated = NULL;
-  args->_parsed_bmps = 0;
-  args->dir_bmps = NULL;
+  args->carriers = NULL;
   args->seed = 0;
+  args->pack = false;
+  args->in_place = false;
+  args->sequence = false;
+  args->verify = false;
+  args->sidecars = false;
+  args->deltas = false;
+  args->materialize = false;
+  args->secret_idx = 0;
+  args->field = FIELD_GF257;
+  args->mask = MASK_LCG;
+  args->listen_path = NULL;
+  args->processes = 0;
+  args->threads = 0;
+  args->max_memory = 0;
+  args->workers = 0;
+  args->cache_size = 256;
+  args->cache_extract = false;
   return args;
 }
 
@@ -115,11 +172,31 @@ static void parseOptions(Args* args, int argc, char* argv[]) {
     {"dir", required_argument, NULL, 'D'},
     {"dir-out", required_argument, NULL, 'O'},
     {"seed", required_argument, NULL, 'S'},
+    {"pack", no_argument, NULL, 'P'},
+    {"in-place", no_argument, NULL, 'I'},
+    {"sequence", no_argument, NULL, 'Q'},
+    {"verify", no_argument, NULL, 'V'},
+    {"index", required_argument, NULL, 'i'},
+    {"field", required_argument, NULL, 'F'},
+    {"mask", required_argument, NULL, 'M'},
+    {"io-backend", required_argument, NULL, 'B'},
+    {"direct-io", no_argument, NULL, 'X'},
+    {"keystream-cache", required_argument, NULL, 'K'},
+    {"listen", required_argument, NULL, 'L'},
+    {"workers", required_argument, NULL, 'W'},
+    {"cache-size", required_argument, NULL, 'C'},
+    {"cache-extract", no_argument, NULL, 'E'},
+    {"sidecar", no_argument, NULL, 'T'},
+    {"delta", no_argument, NULL, 'G'},
+    {"materialize", no_argument, NULL, 'Z'},
+    {"processes", required_argument, NULL, 'j'},
+    {"threads", required_argument, NULL, 't'},
+    {"max-memory", required_argument, NULL, 'm'},
     {0, 0, 0, 0}
   };
 
   int opt;
-  while ((opt = getopt_long(argc, argv, "hpdrs:k:n:D:O:S:", long_options, NULL)) != -1) {
+  while ((opt = getopt_long(argc, argv, "hpdrs:k:n:D:O:S:PIQVi:F:M:B:XK:L:W:C:ETGZj:t:m:", long_options, NULL)) != -1) {
     switch (opt) {
     case 'h':
       printHelp(argv[0]);
@@ -142,7 +219,8 @@ static void parseOptions(Args* args, int argc, char* argv[]) {
       args->recover = true;
       break;
     case 's':
-      args->secret_filename = optarg;
+      if (args->secret_filename == NULL) args->secret_filename = optarg;
+      args->secret_filenames[args->n_secrets++] = optarg;
       break;
     case 'k':
       errno = 0;
@@ -162,7 +240,98 @@ static void parseOptions(Args* args, int argc, char* argv[]) {
       break;
     case 'S':
       errno = 0;
-      args->seed = strToUInt16(optarg, "--seed | -S");
+      args->seed = strToUInt64(optarg, "--seed | -S");
+      if (errno != 0) clean_exit(args, EXIT_FAILURE);
+      break;
+    case 'P':
+      args->pack = true;
+      break;
+    case 'I':
+      args->in_place = true;
+      break;
+    case 'Q':
+      args->sequence = true;
+      break;
+    case 'V':
+      args->verify = true;
+      break;
+    case 'i':
+      errno = 0;
+      args->secret_idx = strToNumInRange(optarg, 0, UINT32_MAX, "--index | -i");
+      if (errno != 0) clean_exit(args, EXIT_FAILURE);
+      break;
+    case 'F':
+      if (strcmp(optarg, "gf257") == 0) args->field = FIELD_GF257;
+      else if (strcmp(optarg, "gf256") == 0) args->field = FIELD_GF256;
+      else {
+        fprintf(stderr, "Invalid value for `--field | -F`: %s (expected gf257 or gf256)\n", optarg);
+        clean_exit(args, EXIT_FAILURE);
+      }
+      break;
+    case 'M':
+      if (strcmp(optarg, "lcg") == 0) args->mask = MASK_LCG;
+      else if (strcmp(optarg, "chacha") == 0) args->mask = MASK_CHACHA;
+      else {
+        fprintf(stderr, "Invalid value for `--mask | -M`: %s (expected lcg or chacha)\n", optarg);
+        clean_exit(args, EXIT_FAILURE);
+      }
+      break;
+    case 'B':
+      if (strcmp(optarg, "auto") == 0) ioSetBackend(IO_BACKEND_AUTO);
+      else if (strcmp(optarg, "sync") == 0) ioSetBackend(IO_BACKEND_SYNC);
+      else if (strcmp(optarg, "uring") == 0) {
+        if (!ioSetBackend(IO_BACKEND_URING)) {
+          fprintf(stderr, "Warning: io_uring is not available, falling back to synchronous I/O.\n");
+        }
+      } else {
+        fprintf(stderr, "Invalid value for `--io-backend | -B`: %s (expected auto, sync or uring)\n", optarg);
+        clean_exit(args, EXIT_FAILURE);
+      }
+      break;
+    case 'X':
+      ioSetDirect(true);
+      break;
+    case 'K':
+      if (!keystreamCacheOpen(optarg)) clean_exit(args, EXIT_FAILURE);
+      break;
+    case 'L':
+      args->listen_path = optarg;
+      break;
+    case 'W':
+      errno = 0;
+      args->workers = strToNumInRange(optarg, 1, 1024, "--workers | -W");
+      if (errno != 0) clean_exit(args, EXIT_FAILURE);
+      break;
+    case 'C':
+      errno = 0;
+      args->cache_size = strToNumInRange(optarg, 0, 1024 * 1024, "--cache-size | -C");
+      if (errno != 0) clean_exit(args, EXIT_FAILURE);
+      break;
+    case 'E':
+      args->cache_extract = true;
+      break;
+    case 'T':
+      args->sidecars = true;
+      break;
+    case 'G':
+      args->deltas = true;
+      break;
+    case 'Z':
+      args->materialize = true;
+      break;
+    case 'j':
+      errno = 0;
+      args->processes = strToNumInRange(optarg, 1, 1024, "--processes | -j");
+      if (errno != 0) clean_exit(args, EXIT_FAILURE);
+      break;
+    case 't':
+      errno = 0;
+      args->threads = strToNumInRange(optarg, 1, 1024, "--threads | -t");
+      if (errno != 0) clean_exit(args, EXIT_FAILURE);
+      break;
+    case 'm':
+      errno = 0;
+      args->max_memory = strToNumInRange(optarg, 1, 16 * 1024 * 1024, "--max-memory | -m");
       if (errno != 0) clean_exit(args, EXIT_FAILURE);
       break;
     default:
@@ -175,68 +344,23 @@ static void parseOptions(Args* args, int argc, char* argv[]) {
 void argsFree(Args* args) {
   // `free(NULL)` is a no-op so it's fine to have no check.
   free(args->_directory_allocated);
-  for (int i = 0; i < args->_parsed_bmps; ++i) bmpFree(args->dir_bmps[i]);
-  free((void*)args->dir_bmps);
+  free((void*)args->secret_filenames);
+  scanFree(args->carriers);
   free(args);
 }
 
-static int countBmpFiles(const char* directory) {
-  DIR* dir = opendir(directory);
-  if (dir == NULL) {
-    perror("opendir");
-    return -1;
-  }
-
-  struct dirent* entry;
-  int count = 0;
-
-  while ((entry = readdir(dir)) != NULL) {
-    if (entry->d_type == DT_REG) ++count;
-  }
-
-  closedir(dir);
-
-  return count;
-}
-
-static void collectBmpFiles(Args* args, int needed_count) {
-  DIR* dir = opendir(args->directory);
-  if (dir == NULL) {
-    perror("opendir");
-    clean_exit(args, EXIT_FAILURE);
-  }
-
-  struct dirent* entry;
-
-  int count = 0;
-  while ((entry = readdir(dir)) != NULL && count < needed_count) {
-    if (entry->d_type == DT_REG) {
-      const char* name = entry->d_name;
-      size_t full_len = strlen(args->directory) + 1 + strlen(name) + 1;
-      char full_path[full_len];
-      snprintf(full_path, full_len, "%s/%s", args->directory, name);
-      printf("parsing bmp: `%s`...\n", full_path);
-      args->dir_bmps[count] = bmpParse(full_path);
-      if (args->dir_bmps[count] == NULL) {
-        fprintf(stderr, "Error parsing bmp `%s`\n", full_path);
-        clean_exit(args, EXIT_FAILURE);
-      }
-      args->_parsed_bmps = ++count;
-    }
-  }
-
-  closedir(dir);
-}
-
 static void printHelp(const char* executable_name) {
   printf("Usage: %s <-r | -d> -s FILE -k NUM [options]\n", executable_name);
+  printf("       %s -L SOCKET [-W NUM]\n", executable_name);
+  printf("       %s -Z [-D DIR] [-O DIR]\n", executable_name);
   printf("Options:\n");
   printf("  -h, --help               Show this help message and exit\n");
   printf("  -p, --print-header       Optional: Print the BMP header of the input image\n");
   printf("  -d, --distribute         Required: Distribute a secret into shadow images (mutually exclusive with -r)\n");
   printf("  -r, --recover            Required: Recover a secret from shadow images (mutually exclusive with -d)\n");
   printf("  -s, --secret FILE        Required:\n");
-  printf("                             - With -d: input BMP image to hide/distribute\n");
+  printf("                             - With -d: input BMP image to hide/distribute. Can be repeated to\n");
+  printf("                               distribute a batch of secrets, each into its own sub-directory\n");
   printf("                             - With -r: output file for the recovered secret\n");
   printf(
     "  -k, --min-shadows NUM    Required: Minimum number of shadow images needed to reconstruct the secret"
@@ -247,8 +371,49 @@ static void printHelp(const char* executable_name) {
   printf("                             (default: current working directory)\n");
   printf("  -O, --dir-out DIR        Optional: Directory to write shadow images to (only if -d used)\n");
   printf("                             (default: the value provided to --dir)\n");
-  printf("  -S, --seed NUM           Optional: Seed to use for permutation matrix.\n");
+  printf("  -S, --seed NUM           Optional: Seed to use for permutation matrix, up to 65535 unless --mask chacha\n");
   printf("                             (default: 0 if -d used, `seed` from reserved bytes in shadow if -r used)\n");
+  printf("  -P, --pack               Optional: Pack the shadows of several secrets into the same carriers\n");
+  printf("                             (only if -d used)\n");
+  printf("  -I, --in-place           Optional: Hide the shadows in the carrier images themselves instead of writing\n");
+  printf("                             new files to --dir-out (only if -d used)\n");
+  printf("  -Q, --sequence           Optional: The secrets are the frames of a sequence, all hidden in the same\n");
+  printf("                             carriers. Reading, sharing and writing of consecutive frames overlap\n");
+  printf("                             (only if -d used)\n");
+  printf("  -V, --verify             Optional: Use every shadow in --dir to verify the recovered secret and repair\n");
+  printf("                             blocks from corrupt shadows (only if -r used)\n");
+  printf("  -i, --index NUM          Optional: Index of the secret to recover from packed carriers (only if -r used)\n");
+  printf("                             (default: 0)\n");
+  printf("  -F, --field FIELD        Optional: Arithmetic of the shadows, gf257 or gf256. gf256 avoids altering the\n");
+  printf("                             secret bytes, so recovery is lossless. Recovery reads it from the shadows\n");
+  printf("                             (default: gf257, only if -d used)\n");
+  printf("  -M, --mask MASK          Optional: Keystream the secret is masked with, lcg or chacha. chacha is faster\n");
+  printf("                             and takes 64-bit seeds. Recovery reads it from the shadows\n");
+  printf("                             (default: lcg, only if -d used)\n");
+  printf("  -B, --io-backend BACKEND Optional: How BMP files are read and written: auto, sync (pread/pwrite) or\n");
+  printf("                             uring (io_uring, falls back to sync when not available) (default: auto)\n");
+  printf("  -T, --sidecar            Optional: With -d, also write a sidecar with the extracted shadow bytes next\n");
+  printf("                             to every shadow. With -r, recover from the sidecars in --dir instead\n");
+  printf("  -G, --delta              Optional: Write every shadow as a delta of its carrier (`<shadow>.bmp.dlt`),\n");
+  printf("                             8 times smaller, instead of a whole BMP (only if -d used)\n");
+  printf("  -Z, --materialize        Optional: Rebuild the shadows of the deltas in --dir into --dir-out, reading\n");
+  printf("                             their carriers. Takes neither -r nor -d\n");
+  printf("  -X, --direct-io          Optional: Read pixel data with O_DIRECT, bypassing the page cache\n");
+  printf("  -K, --keystream-cache DIR Optional: Keep the masks of the seeds used in DIR and read them from there\n");
+  printf("                             instead of generating them again\n");
+  printf("  -j, --processes NUM      Optional: Compute the shadows in NUM worker processes (only if -d used)\n");
+  printf("                             (default: 1, no workers)\n");
+  printf("  -t, --threads NUM        Optional: Compute the shadows in NUM threads spread over the NUMA nodes, which\n");
+  printf("                             also hold the part of the images their threads work on. Ignored with -j\n");
+  printf("                             (default: 1, only if -d used)\n");
+  printf("  -m, --max-memory MIB     Optional: Memory the distribution may use. Carriers are streamed through\n");
+  printf("                             windows when they don't fit whole, and workers default to a thread per CPU\n");
+  printf("                             (default: no limit, only if -d used)\n");
+  printf("  -L, --listen SOCKET      Optional: Run as a daemon serving distribute/recover jobs on the Unix domain\n");
+  printf("                             socket SOCKET instead of running a single job (see README)\n");
+  printf("  -W, --workers NUM        Optional: Jobs the daemon runs at once (default: number of CPUs)\n");
+  printf("  -C, --cache-size MIB     Optional: Daemon memory for parsed carriers, 0 disables it (default: 256)\n");
+  printf("  -E, --cache-extract      Optional: Cache only the shadow bytes of each carrier instead of its pixels\n");
 }
 
 static uint32_t strToNumInRange(const char* str, uint32_t min, uint32_t max, const char* var_name) {
@@ -278,8 +443,20 @@ static uint8_t strToKRange(const char* str, const char* var_name) {
   return (uint8_t)strToNumInRange(str, 2, UINT8_MAX, var_name);
 }
 
-static uint16_t strToUInt16(const char* str, const char* var_name) {
-  return (uint16_t)strToNumInRange(str, 0, UINT16_MAX, var_name);
+static uint64_t strToUInt64(const char* str, const char* var_name) {
+  char* endptr;
+  errno = 0;
+  unsigned long long val = strtoull(str, &endptr, 10);
+  if (errno != 0) {
+    perror("strtoull");
+    return 0;
+  }
+  if (*endptr != 0 || *str == '-') {
+    fprintf(stderr, "Invalid character '%c' in `%s`: %s\n", *endptr != 0 ? *endptr : '-', var_name, str);
+    errno = EINVAL;
+    return 0;
+  }
+  return val;
 }
 
 static bool printHeader(const char* secret_filename) {
@@ -2,6 +2,9 @@
 #define ARGS_H
 
 #include "../bmp/bmp.h"
+#include "../sis/field.h"
+#include "../sis/permutation.h"
+#include "../sis/scan.h"
 #include <stdbool.h>
 #include <stdint.h>
 
@@ -9,14 +12,32 @@ typedef struct Args {
   bool distribute;
   bool recover;
   const char* secret_filename;
+  const char** secret_filenames;
+  uint32_t n_secrets;
   uint8_t min_shadows;
   uint8_t tot_shadows;
   const char* directory;
   const char* directory_out;
   char* _directory_allocated;
-  uint8_t _parsed_bmps;
-  BMP* dir_bmps;
-  uint16_t seed;
+  CarrierList* carriers;
+  uint64_t seed;
+  bool pack;
+  bool in_place;
+  bool sequence; // The secrets are the frames of a sequence (see `sequenceDistribute`).
+  bool verify;
+  bool sidecars; // Write sidecars with -d, recover from them instead of the shadows with -r.
+  bool deltas;   // Write the shadows as deltas of their carriers with -d.
+  bool materialize;
+  uint32_t secret_idx;
+  Field field;
+  Mask mask;
+  const char* listen_path; // Daemon mode if not NULL.
+  uint32_t processes;      // Worker processes of a distribution.
+  uint32_t threads;        // Threads of a distribution.
+  uint32_t max_memory;     // MiB a distribution may hold at once, no limit if 0.
+  uint32_t workers;
+  uint32_t cache_size; // MiB, the carrier cache of the daemon is disabled if 0.
+  bool cache_extract;
 } Args;
 
 Args* argsParse(int argc, char* argv[]);
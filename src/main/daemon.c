@@ -0,0 +1,633 @@
+#define _GNU_SOURCE
+
+#include "daemon.h"
+#include "../io/io.h"
+#include "../sis/cache.h"
+#include "../sis/field.h"
+#include "../sis/scan.h"
+#include "../sis/sis.h"
+#include "jobs.h"
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define MAX_QUEUED_JOBS 64
+#define MAX_REQUEST_SIZE (64 * 1024)
+#define REQUEST_TIMEOUT_SECONDS 5
+
+/*
+   Every connection carries a single request, one line of space separated tokens: the kind of job followed by
+   `key=value` options that mirror the command line ones.
+
+     recover k=3 dir=/shadows out=/tmp/secret.bmp [seed=N] [index=N] [verify=1] [sidecar=1]
+     distribute k=3 dir=/carriers secret=a.bmp [secret=b.bmp ...] [n=N] [out=DIR] [seed=N] [field=gf256] [pack=1]
+                [in-place=1] [sidecar=1] [mask=chacha]
+
+   The daemon answers with one line per state change: `queued ID`, `running ID`, `report ...` (only for verified
+   recoveries), and finally `ok ID` or `error [ID] MESSAGE`. Recover jobs are interactive, so they are run before any
+   queued distribute job.
+*/
+
+typedef enum JobKind {
+  JOB_RECOVER = 0, // Also the priority, lower runs first.
+  JOB_DISTRIBUTE = 1,
+} JobKind;
+
+typedef struct Request {
+  JobKind kind;
+  char* line; // Every string of the request points into it.
+  const char** secret_filenames;
+  uint32_t n_secrets;
+  const char* directory;
+  const char* out;
+  uint32_t min_shadows;
+  uint32_t tot_shadows;
+  uint64_t seed;
+  uint32_t secret_idx;
+  Field field;
+  Mask mask;
+  bool pack;
+  bool in_place;
+  bool verify;
+  bool sidecars;
+} Request;
+
+typedef struct QueuedJob {
+  uint64_t id;
+  int client;
+  Request request;
+  struct QueuedJob* next;
+} QueuedJob;
+
+// Scanning a carrier directory reads the header of every file in it, so the result is kept until the directory
+// changes or a distribute job writes to it. Entries are reference counted since a running job may still use an entry
+// that was replaced.
+typedef struct ScanEntry {
+  char* directory;
+  dev_t dev;
+  ino_t ino;
+  struct timespec mtime;
+  bool sidecars; // Lists the sidecars of the directory instead of its BMPs.
+  CarrierList* carriers;
+  uint32_t refs;
+  struct ScanEntry* next;
+} ScanEntry;
+
+typedef struct Daemon {
+  pthread_mutex_t lock;
+  pthread_cond_t not_empty;
+  QueuedJob* head[2]; // One FIFO per `JobKind`.
+  QueuedJob* tail[2]; //
+  uint32_t queued;
+  bool stopping;
+  uint64_t next_id;
+  ScanEntry* scans;
+  uint64_t scan_generation; // Bumped whenever scans are dropped, so that scans that raced with it aren't cached.
+  CarrierCache* cache; // Parsed shadows shared by recover jobs, NULL if disabled.
+} Daemon;
+
+static volatile sig_atomic_t stop_requested = 0;
+
+static void onSignal(int sig);
+static int openSocket(const char* socket_path);
+static bool readRequest(int client, char* buf, size_t size);
+static bool parseRequest(char* line, Request* request, char* err, size_t err_size);
+static bool parseNumber(const char* value, uint32_t min, uint32_t max, uint32_t* out);
+static bool parseSeed(const char* value, uint64_t* out);
+static void reply(int client, const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+static bool enqueue(Daemon* daemon, QueuedJob* job);
+static QueuedJob* dequeue(Daemon* daemon);
+static void* workerMain(void* arg);
+static void runJob(Daemon* daemon, QueuedJob* job);
+static ScanEntry* acquireScan(Daemon* daemon, const char* directory, bool sidecars);
+static void releaseScan(Daemon* daemon, ScanEntry* entry);
+static void dropScans(Daemon* daemon, const char* directory);
+static void freeScan(ScanEntry* entry);
+static void freeJob(QueuedJob* job);
+
+// Serves jobs on a Unix domain socket until SIGINT or SIGTERM. Queued jobs are finished before returning.
+int daemonRun(const char* socket_path, uint32_t n_workers, size_t cache_budget, bool cache_extract) {
+  int listen_fd = openSocket(socket_path);
+  if (listen_fd < 0) return EXIT_FAILURE;
+
+  Daemon daemon = {.queued = 0, .stopping = false, .next_id = 1, .scans = NULL, .scan_generation = 0, .cache = NULL};
+  if (cache_budget > 0) {
+    daemon.cache = cacheNew(cache_budget, cache_extract);
+    if (daemon.cache == NULL) {
+      close(listen_fd);
+      unlink(socket_path);
+      return EXIT_FAILURE;
+    }
+  }
+  pthread_mutex_init(&daemon.lock, NULL);
+  pthread_cond_init(&daemon.not_empty, NULL);
+
+  // Workers block the signals so that they interrupt `accept` in this thread.
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &signals, NULL);
+  pthread_t* workers = malloc(n_workers * sizeof(pthread_t));
+  uint32_t n_started = 0;
+  if (workers == NULL) perror("malloc");
+  for (uint32_t i = 0; workers != NULL && i < n_workers; ++i) {
+    int err = pthread_create(&workers[i], NULL, workerMain, &daemon);
+    if (err != 0) {
+      fprintf(stderr, "pthread_create: %s\n", strerror(err));
+      break;
+    }
+    ++n_started;
+  }
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = onSignal; // No SA_RESTART, `accept` has to return on a signal.
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGINT, &action, NULL);
+  sigaction(SIGTERM, &action, NULL);
+  pthread_sigmask(SIG_UNBLOCK, &signals, NULL);
+
+  int status = n_started > 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+  if (n_started > 0) printf("Listening on `%s` with %u workers (I/O: %s)\n", socket_path, n_started, ioBackendName());
+  fflush(stdout);
+
+  while (n_started > 0 && !stop_requested) {
+    int client = accept(listen_fd, NULL, NULL);
+    if (client < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) continue;
+      perror("accept");
+      status = EXIT_FAILURE;
+      break;
+    }
+    QueuedJob* job = calloc(1, sizeof(QueuedJob));
+    char* line = malloc(MAX_REQUEST_SIZE);
+    char err[256];
+    if (job == NULL || line == NULL) {
+      perror("malloc");
+      reply(client, "error out of memory\n");
+      free(job);
+      free(line);
+      close(client);
+      continue;
+    }
+    job->client = client;
+    if (!readRequest(client, line, MAX_REQUEST_SIZE)) {
+      reply(client, "error could not read the request\n");
+      free(line);
+      freeJob(job);
+      continue;
+    }
+    if (!parseRequest(line, &job->request, err, sizeof(err))) {
+      reply(client, "error %s\n", err);
+      freeJob(job);
+      continue;
+    }
+    if (!enqueue(&daemon, job)) {
+      reply(client, "error too many queued jobs\n");
+      freeJob(job);
+    }
+  }
+
+  close(listen_fd);
+  unlink(socket_path);
+  pthread_mutex_lock(&daemon.lock);
+  daemon.stopping = true;
+  pthread_cond_broadcast(&daemon.not_empty);
+  pthread_mutex_unlock(&daemon.lock);
+  for (uint32_t i = 0; i < n_started; ++i) pthread_join(workers[i], NULL);
+  free(workers);
+
+  if (daemon.cache != NULL) {
+    CacheStats stats = cacheStats(daemon.cache);
+    printf(
+      "Carrier cache: %lu hits, %lu misses, %lu evictions\n", (unsigned long)stats.hits, (unsigned long)stats.misses,
+      (unsigned long)stats.evictions
+    );
+    cacheFree(daemon.cache);
+  }
+  while (daemon.scans != NULL) {
+    ScanEntry* next = daemon.scans->next;
+    freeScan(daemon.scans);
+    daemon.scans = next;
+  }
+  pthread_cond_destroy(&daemon.not_empty);
+  pthread_mutex_destroy(&daemon.lock);
+  return status;
+}
+
+// Internal functions
+
+static void onSignal(int sig) {
+  (void)sig;
+  stop_requested = 1;
+}
+
+static int openSocket(const char* socket_path) {
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "Error: Socket path `%s` is too long.\n", socket_path);
+    return -1;
+  }
+  strcpy(addr.sun_path, socket_path);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    perror("socket");
+    return -1;
+  }
+
+  // A socket left behind by a daemon that didn't shut down cleanly would make `bind` fail. It is only removed when
+  // nothing accepts connections on it, a live daemon keeps its socket.
+  struct stat socket_stat;
+  if (stat(socket_path, &socket_stat) == 0 && S_ISSOCK(socket_stat.st_mode)) {
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0) {
+      fprintf(stderr, "Error: A daemon is already listening on `%s`.\n", socket_path);
+      close(fd);
+      return -1;
+    }
+    if (errno == ECONNREFUSED) unlink(socket_path);
+    close(fd);
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+      perror("socket");
+      return -1;
+    }
+  }
+  if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(fd, MAX_QUEUED_JOBS) != 0) {
+    perror("bind");
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// Reads up to the first newline. A client that stalls, reading or writing, is dropped after `REQUEST_TIMEOUT_SECONDS`.
+static bool readRequest(int client, char* buf, size_t size) {
+  struct timeval timeout = {.tv_sec = REQUEST_TIMEOUT_SECONDS, .tv_usec = 0};
+  setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+  size_t len = 0;
+  while (len < size - 1) {
+    ssize_t got = recv(client, buf + len, size - 1 - len, 0);
+    if (got < 0 && errno == EINTR) continue;
+    if (got <= 0) break;
+    char* newline = memchr(buf + len, '\n', got);
+    len += got;
+    if (newline != NULL) {
+      *newline = '\0';
+      return true;
+    }
+  }
+  buf[len] = '\0';
+  return len > 0 && len < size - 1;
+}
+
+static bool parseRequest(char* line, Request* request, char* err, size_t err_size) {
+  memset(request, 0, sizeof(Request));
+  request->line = line;
+  request->field = FIELD_GF257;
+  request->mask = MASK_LCG;
+  request->secret_filenames = malloc((strlen(line) / 2 + 1) * sizeof(const char*));
+  if (request->secret_filenames == NULL) {
+    snprintf(err, err_size, "out of memory");
+    return false;
+  }
+
+  char* save = NULL;
+  char* token = strtok_r(line, " \t\r", &save);
+  if (token == NULL) {
+    snprintf(err, err_size, "empty request");
+    return false;
+  }
+  if (strcmp(token, "recover") == 0) request->kind = JOB_RECOVER;
+  else if (strcmp(token, "distribute") == 0) request->kind = JOB_DISTRIBUTE;
+  else {
+    snprintf(err, err_size, "unknown job `%s`, expected recover or distribute", token);
+    return false;
+  }
+
+  while ((token = strtok_r(NULL, " \t\r", &save)) != NULL) {
+    char* value = strchr(token, '=');
+    if (value == NULL) {
+      snprintf(err, err_size, "expected key=value, found `%s`", token);
+      return false;
+    }
+    *value++ = '\0';
+    bool ok = true;
+    if (strcmp(token, "k") == 0) ok = parseNumber(value, 2, UINT8_MAX, &request->min_shadows);
+    else if (strcmp(token, "n") == 0) ok = parseNumber(value, 2, UINT8_MAX, &request->tot_shadows);
+    else if (strcmp(token, "seed") == 0) ok = parseSeed(value, &request->seed);
+    else if (strcmp(token, "index") == 0) ok = parseNumber(value, 0, UINT32_MAX, &request->secret_idx);
+    else if (strcmp(token, "dir") == 0) request->directory = value;
+    else if (strcmp(token, "out") == 0) request->out = value;
+    else if (strcmp(token, "secret") == 0) request->secret_filenames[request->n_secrets++] = value;
+    else if (strcmp(token, "verify") == 0) request->verify = strcmp(value, "0") != 0;
+    else if (strcmp(token, "pack") == 0) request->pack = strcmp(value, "0") != 0;
+    else if (strcmp(token, "in-place") == 0) request->in_place = strcmp(value, "0") != 0;
+    else if (strcmp(token, "sidecar") == 0) request->sidecars = strcmp(value, "0") != 0;
+    else if (strcmp(token, "field") == 0) {
+      if (strcmp(value, "gf257") == 0) request->field = FIELD_GF257;
+      else if (strcmp(value, "gf256") == 0) request->field = FIELD_GF256;
+      else ok = false;
+    } else if (strcmp(token, "mask") == 0) {
+      if (strcmp(value, "lcg") == 0) request->mask = MASK_LCG;
+      else if (strcmp(value, "chacha") == 0) request->mask = MASK_CHACHA;
+      else ok = false;
+    } else {
+      snprintf(err, err_size, "unknown option `%s`", token);
+      return false;
+    }
+    if (!ok) {
+      snprintf(err, err_size, "invalid value for `%s`: %s", token, value);
+      return false;
+    }
+  }
+
+  if (request->min_shadows == 0 || request->directory == NULL) {
+    snprintf(err, err_size, "k and dir are required");
+    return false;
+  }
+  if (request->kind == JOB_RECOVER && request->out == NULL) {
+    snprintf(err, err_size, "out is required");
+    return false;
+  }
+  if (request->kind == JOB_DISTRIBUTE && request->n_secrets == 0) {
+    snprintf(err, err_size, "at least one secret is required");
+    return false;
+  }
+  if (request->kind == JOB_DISTRIBUTE && request->mask == MASK_LCG && request->seed > UINT16_MAX) {
+    snprintf(err, err_size, "seeds past %u need mask=chacha", UINT16_MAX);
+    return false;
+  }
+  return true;
+}
+
+static bool parseNumber(const char* value, uint32_t min, uint32_t max, uint32_t* out) {
+  char* end;
+  errno = 0;
+  unsigned long val = strtoul(value, &end, 10);
+  if (errno != 0 || *value == '\0' || *end != '\0' || val < min || val > max) return false;
+  *out = val;
+  return true;
+}
+
+static bool parseSeed(const char* value, uint64_t* out) {
+  char* end;
+  errno = 0;
+  unsigned long long val = strtoull(value, &end, 10);
+  if (errno != 0 || *value == '\0' || *value == '-' || *end != '\0') return false;
+  *out = val;
+  return true;
+}
+
+static void reply(int client, const char* fmt, ...) {
+  char buf[512];
+  va_list args;
+  va_start(args, fmt);
+  int len = vsnprintf(buf, sizeof(buf), fmt, args);
+  va_end(args);
+  if (len < 0) return;
+  if ((size_t)len >= sizeof(buf)) len = sizeof(buf) - 1;
+  // The client may have gone away, MSG_NOSIGNAL avoids dying from SIGPIPE.
+  for (int sent = 0; sent < len;) {
+    ssize_t ret = send(client, buf + sent, len - sent, MSG_NOSIGNAL);
+    if (ret < 0 && errno == EINTR) continue;
+    if (ret <= 0) return;
+    sent += ret;
+  }
+}
+
+// Only the accepting thread enqueues, so the queue can't fill up between the check and the push. The client is told
+// its id without holding the lock, so that a client slow to read doesn't stall the workers, and before the job is
+// pushed, so that no worker replies to it first.
+static bool enqueue(Daemon* daemon, QueuedJob* job) {
+  pthread_mutex_lock(&daemon->lock);
+  bool full = daemon->queued >= MAX_QUEUED_JOBS;
+  if (!full) job->id = daemon->next_id++;
+  pthread_mutex_unlock(&daemon->lock);
+  if (full) return false;
+  reply(job->client, "queued %lu\n", (unsigned long)job->id);
+
+  pthread_mutex_lock(&daemon->lock);
+  JobKind kind = job->request.kind;
+  if (daemon->tail[kind] != NULL) daemon->tail[kind]->next = job;
+  else daemon->head[kind] = job;
+  daemon->tail[kind] = job;
+  ++daemon->queued;
+  pthread_cond_signal(&daemon->not_empty);
+  pthread_mutex_unlock(&daemon->lock);
+  return true;
+}
+
+// Blocks until there's a job, recover jobs first. Returns NULL once the daemon is stopping and the queue is empty.
+static QueuedJob* dequeue(Daemon* daemon) {
+  pthread_mutex_lock(&daemon->lock);
+  while (daemon->queued == 0 && !daemon->stopping) pthread_cond_wait(&daemon->not_empty, &daemon->lock);
+  QueuedJob* job = NULL;
+  for (int kind = JOB_RECOVER; kind <= JOB_DISTRIBUTE && job == NULL; ++kind) {
+    job = daemon->head[kind];
+    if (job == NULL) continue;
+    daemon->head[kind] = job->next;
+    if (daemon->head[kind] == NULL) daemon->tail[kind] = NULL;
+    --daemon->queued;
+  }
+  pthread_mutex_unlock(&daemon->lock);
+  return job;
+}
+
+static void* workerMain(void* arg) {
+  Daemon* daemon = arg;
+  QueuedJob* job;
+  while ((job = dequeue(daemon)) != NULL) {
+    runJob(daemon, job);
+    freeJob(job);
+  }
+  ioRelease();
+  return NULL;
+}
+
+static void runJob(Daemon* daemon, QueuedJob* job) {
+  const Request* request = &job->request;
+  unsigned long id = job->id;
+  reply(job->client, "running %lu\n", id);
+
+  ScanEntry* scan = acquireScan(daemon, request->directory, request->kind == JOB_RECOVER && request->sidecars);
+  if (scan == NULL) {
+    reply(job->client, "error %lu could not scan `%s`\n", id, request->directory);
+    return;
+  }
+  const CarrierList* carriers = scan->carriers;
+  uint32_t available = carriers->count > UINT8_MAX ? UINT8_MAX : carriers->count;
+
+  int status;
+  if (request->kind == JOB_RECOVER) {
+    SisReport report;
+    memset(&report, 0, sizeof(report));
+    RecoverJob recover = {
+      .secret_filename = request->out,
+      .carriers = carriers,
+      .min_shadows = request->min_shadows,
+      .n_shadows = request->verify ? available : request->min_shadows,
+      .seed = request->seed,
+      .secret_idx = request->secret_idx,
+      .report = request->verify ? &report : NULL,
+      .cache = daemon->cache,
+      .sidecars = request->sidecars,
+    };
+    status = jobRecover(&recover);
+    if (request->verify && report.blocks > 0) {
+      reply(
+        job->client, "report %lu blocks=%lu mismatched=%lu repaired=%lu unresolved=%lu\n", id,
+        (unsigned long)report.blocks, (unsigned long)report.mismatched_blocks, (unsigned long)report.repaired_blocks,
+        (unsigned long)report.unresolved_blocks
+      );
+    }
+  } else {
+    uint32_t tot_shadows = request->tot_shadows == 0 ? available : request->tot_shadows;
+    if (tot_shadows > carriers->count || tot_shadows < request->min_shadows) {
+      reply(job->client, "error %lu %u carriers found, need between k and n\n", id, carriers->count);
+      releaseScan(daemon, scan);
+      return;
+    }
+    DistributeJob distribute = {
+      .secret_filenames = request->secret_filenames,
+      .n_secrets = request->n_secrets,
+      .carriers = carriers,
+      .min_shadows = request->min_shadows,
+      .tot_shadows = tot_shadows,
+      .seed = request->seed,
+      .field = request->field,
+      .mask = request->mask,
+      .pack = request->pack,
+      .in_place = request->in_place,
+      .sidecars = request->sidecars,
+      .directory_out = request->out != NULL ? request->out : request->directory,
+    };
+    status = jobDistribute(&distribute);
+    // Shadows and carriers rewritten in place don't change the mtime of their directory.
+    dropScans(daemon, request->directory);
+    if (request->out != NULL) dropScans(daemon, request->out);
+  }
+  releaseScan(daemon, scan);
+  fflush(stdout);
+
+  if (status == EXIT_SUCCESS) reply(job->client, "ok %lu\n", id);
+  else reply(job->client, "error %lu job failed, see the daemon log\n", id);
+}
+
+static ScanEntry* acquireScan(Daemon* daemon, const char* directory, bool sidecars) {
+  struct stat dir_stat;
+  if (stat(directory, &dir_stat) != 0) {
+    perror("stat");
+    return NULL;
+  }
+
+  pthread_mutex_lock(&daemon->lock);
+  ScanEntry** link = &daemon->scans;
+  while (*link != NULL && (strcmp((*link)->directory, directory) != 0 || (*link)->sidecars != sidecars)) {
+    link = &(*link)->next;
+  }
+  ScanEntry* entry = *link;
+  if (entry != NULL && entry->dev == dir_stat.st_dev && entry->ino == dir_stat.st_ino &&
+      entry->mtime.tv_sec == dir_stat.st_mtim.tv_sec && entry->mtime.tv_nsec == dir_stat.st_mtim.tv_nsec) {
+    ++entry->refs;
+    pthread_mutex_unlock(&daemon->lock);
+    return entry;
+  }
+  if (entry != NULL) {
+    // Stale, running jobs keep their reference.
+    *link = entry->next;
+    releaseScan(NULL, entry);
+  }
+  uint64_t generation = daemon->scan_generation;
+  pthread_mutex_unlock(&daemon->lock);
+
+  // Scanning happens without the lock. Two workers may scan the same directory at once, the last scan is kept.
+  ScanEntry* fresh = calloc(1, sizeof(ScanEntry));
+  if (fresh == NULL) {
+    perror("calloc");
+    return NULL;
+  }
+  fresh->directory = strdup(directory);
+  fresh->sidecars = sidecars;
+  fresh->carriers = sidecars ? scanSidecars(directory) : scanCarriers(directory);
+  if (fresh->directory == NULL || fresh->carriers == NULL) {
+    freeScan(fresh);
+    return NULL;
+  }
+  fresh->dev = dir_stat.st_dev;
+  fresh->ino = dir_stat.st_ino;
+  fresh->mtime = dir_stat.st_mtim;
+  fresh->refs = 2; // The cache and the caller.
+
+  pthread_mutex_lock(&daemon->lock);
+  if (daemon->scan_generation != generation) {
+    // A distribute job finished during the scan, which may have read its files half written.
+    fresh->refs = 1;
+    pthread_mutex_unlock(&daemon->lock);
+    return fresh;
+  }
+  for (link = &daemon->scans; *link != NULL; link = &(*link)->next) {
+    if (strcmp((*link)->directory, directory) == 0 && (*link)->sidecars == sidecars) {
+      ScanEntry* other = *link;
+      *link = other->next;
+      releaseScan(NULL, other);
+      break;
+    }
+  }
+  fresh->next = daemon->scans;
+  daemon->scans = fresh;
+  pthread_mutex_unlock(&daemon->lock);
+  return fresh;
+}
+
+// With a NULL `daemon` the lock is assumed to be held already.
+static void releaseScan(Daemon* daemon, ScanEntry* entry) {
+  if (daemon != NULL) pthread_mutex_lock(&daemon->lock);
+  bool last = --entry->refs == 0;
+  if (daemon != NULL) pthread_mutex_unlock(&daemon->lock);
+  if (last) freeScan(entry);
+}
+
+// Drops the scans of `directory` and of the directories below it, where batches write their shadows.
+static void dropScans(Daemon* daemon, const char* directory) {
+  size_t length = strlen(directory);
+  while (length > 1 && directory[length - 1] == '/') --length;
+  pthread_mutex_lock(&daemon->lock);
+  ++daemon->scan_generation;
+  ScanEntry** link = &daemon->scans;
+  while (*link != NULL) {
+    ScanEntry* entry = *link;
+    if (strncmp(entry->directory, directory, length) == 0 &&
+        (entry->directory[length] == '\0' || entry->directory[length] == '/')) {
+      *link = entry->next;
+      releaseScan(NULL, entry);
+    } else link = &entry->next;
+  }
+  pthread_mutex_unlock(&daemon->lock);
+}
+
+static void freeScan(ScanEntry* entry) {
+  free(entry->directory);
+  scanFree(entry->carriers);
+  free(entry);
+}
+
+static void freeJob(QueuedJob* job) {
+  close(job->client);
+  free((void*)job->request.secret_filenames);
+  free(job->request.line);
+  free(job);
+}
@@ -0,0 +1,11 @@
+#ifndef DAEMON_H
+#define DAEMON_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// A `cache_budget` of 0 disables the carrier cache.
+int daemonRun(const char* socket_path, uint32_t n_workers, size_t cache_budget, bool cache_extract);
+
+#endif
@@ -0,0 +1,265 @@
+#include "jobs.h"
+#include "../bmp/bmp.h"
+#include "../sis/delta.h"
+#include "../sis/plan.h"
+#include "../sis/sequence.h"
+#include "../sis/shard.h"
+#include "../sis/sidecar.h"
+#include "../sis/sis.h"
+#include "../utils/utils.h"
+#include <dirent.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static bool distinctOutputNames(uint32_t n_secrets, const char* const secret_filenames[n_secrets]);
+static int distributeSequence(const DistributeJob* job, const uint64_t shadow_sizes[]);
+static uint8_t pickShadows(const CarrierList* carriers, uint8_t n_shadows, uint32_t picked[n_shadows]);
+
+int jobDistribute(const DistributeJob* job) {
+  // The shadows of every frame of a sequence, and of every secret of a batch that isn't packed, go to a sub-directory
+  // named after it.
+  bool named_outputs = job->sequence || (!job->pack && !job->in_place);
+  if (named_outputs && !distinctOutputNames(job->n_secrets, job->secret_filenames)) return EXIT_FAILURE;
+
+  uint64_t* shadow_sizes = malloc(job->n_secrets * sizeof(uint64_t));
+  if (shadow_sizes == NULL) {
+    perror("malloc");
+    return EXIT_FAILURE;
+  }
+  for (uint32_t i = 0; i < job->n_secrets; ++i) {
+    BMP bmp = bmpProbe(job->secret_filenames[i]);
+    if (bmp == NULL) {
+      fprintf(stderr, "Error parsing bmp `%s`\n", job->secret_filenames[i]);
+      free(shadow_sizes);
+      return EXIT_FAILURE;
+    }
+    shadow_sizes[i] = ceilDiv(bmpImageSize(bmp), job->min_shadows);
+    bmpFree(bmp);
+  }
+
+  if (job->sequence) {
+    int status = distributeSequence(job, shadow_sizes);
+    free(shadow_sizes);
+    return status;
+  }
+
+  Plan* plan = planAssign(job->carriers, job->n_secrets, shadow_sizes, job->tot_shadows, job->pack, job->in_place);
+  free(shadow_sizes);
+  if (plan == NULL) return EXIT_FAILURE;
+  if (!planSchedule(
+        plan, job->carriers, job->min_shadows, job->max_memory, job->sidecars, job->deltas, job->processes,
+        job->threads
+      )) {
+    planFree(plan);
+    return EXIT_FAILURE;
+  }
+  planPrint(plan, job->carriers, job->secret_filenames);
+  SisEngine engine = {.pool = NULL, .threads = plan->threads};
+  if (plan->processes > 1 && (engine.pool = shardStart(plan->processes)) == NULL) {
+    planFree(plan);
+    return EXIT_FAILURE;
+  }
+  bool ok = planExecute(
+    plan, job->carriers, job->secret_filenames, job->min_shadows, job->seed, job->field, job->mask,
+    job->directory_out, job->sidecars, job->deltas, &engine
+  );
+  if (!shardStop(engine.pool)) ok = false;
+  planFree(plan);
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// Fails when the secret can't be recovered, and also after writing it when verification left some block unresolved.
+int jobRecover(const RecoverJob* job) {
+  // Shadows are picked from the x-coordinates found by the scan, before any pixel is read, so that duplicated shadows
+  // don't make the system singular after a whole pass over the carriers.
+  uint32_t picked[job->n_shadows];
+  uint8_t n_shadows = pickShadows(job->carriers, job->n_shadows, picked);
+  if (n_shadows < job->min_shadows || (job->report == NULL && n_shadows < job->n_shadows)) {
+    fprintf(
+      stderr, "Error: Not enough shadows with distinct x-coordinates. Need %u but found only %u.\n", job->n_shadows,
+      n_shadows
+    );
+    return EXIT_FAILURE;
+  }
+  BMP* shadows = calloc(n_shadows, sizeof(BMP));
+  const uint8_t** shadow_bytes = calloc(n_shadows, sizeof(uint8_t*));
+  uint64_t* shadow_lengths = calloc(n_shadows, sizeof(uint64_t));
+  CacheEntry** entries = calloc(n_shadows, sizeof(CacheEntry*));
+  Sidecar** sidecars = calloc(n_shadows, sizeof(Sidecar*));
+  if (shadows == NULL || shadow_bytes == NULL || shadow_lengths == NULL || entries == NULL || sidecars == NULL) {
+    perror("calloc");
+    free((void*)shadows);
+    free((void*)shadow_bytes);
+    free(shadow_lengths);
+    free((void*)entries);
+    free((void*)sidecars);
+    return EXIT_FAILURE;
+  }
+  int status = EXIT_SUCCESS;
+  for (uint32_t i = 0; i < n_shadows && status == EXIT_SUCCESS; ++i) {
+    const char* full_path = job->carriers->carriers[picked[i]].path;
+    if (job->sidecars) {
+      printf("mapping sidecar: `%s`...\n", full_path);
+      sidecars[i] = sidecarOpen(full_path);
+      if (sidecars[i] == NULL) {
+        status = EXIT_FAILURE;
+        continue;
+      }
+      if (i == 0 && sidecarMinShadows(sidecars[i]) != job->min_shadows) {
+        fprintf(
+          stderr, "Warning: `%s` was written for k = %u but k = %u was given.\n", full_path,
+          sidecarMinShadows(sidecars[i]), job->min_shadows
+        );
+      }
+      shadows[i] = sidecarBmp(sidecars[i]);
+      shadow_bytes[i] = sidecarShadowBytes(sidecars[i]);
+      shadow_lengths[i] = sidecarShadowLength(sidecars[i]);
+      continue;
+    }
+    if (job->cache != NULL) {
+      entries[i] = cacheAcquire(job->cache, full_path);
+      if (entries[i] == NULL) {
+        status = EXIT_FAILURE;
+        continue;
+      }
+      shadows[i] = cacheEntryBmp(entries[i]);
+      shadow_bytes[i] = cacheEntryShadowBytes(entries[i]);
+      shadow_lengths[i] = bmpImageSize(shadows[i]) / 8;
+      continue;
+    }
+    printf("parsing bmp: `%s`...\n", full_path);
+    shadows[i] = bmpParse(full_path);
+    if (shadows[i] == NULL) {
+      fprintf(stderr, "Error parsing bmp `%s`\n", full_path);
+      status = EXIT_FAILURE;
+    }
+  }
+
+  BMP secret = NULL;
+  if (status == EXIT_SUCCESS) {
+    secret = sisRecoverExtracted(
+      job->min_shadows, n_shadows, shadows, shadow_bytes, shadow_lengths, job->seed, job->secret_idx, job->report
+    );
+  }
+  for (uint32_t i = 0; i < n_shadows; ++i) {
+    if (job->sidecars) sidecarClose(sidecars[i]);
+    else if (job->cache == NULL) bmpFree(shadows[i]);
+    else if (entries[i] != NULL) cacheRelease(job->cache, entries[i]);
+  }
+  free((void*)shadows);
+  free((void*)shadow_bytes);
+  free(shadow_lengths);
+  free((void*)entries);
+  free((void*)sidecars);
+  if (secret == NULL) return EXIT_FAILURE;
+
+  if (bmpWriteFile(job->secret_filename, secret) != 0) status = EXIT_FAILURE;
+  bmpFree(secret);
+  if (job->report != NULL && job->report->unresolved_blocks > 0) status = EXIT_FAILURE;
+  return status;
+}
+
+// Materializes every delta of `directory` into `directory_out`, under the name of the shadow it was written for.
+int jobMaterialize(const char* directory, const char* directory_out) {
+  DIR* dir = opendir(directory);
+  if (dir == NULL) {
+    perror("opendir");
+    return EXIT_FAILURE;
+  }
+  int status = EXIT_SUCCESS;
+  uint32_t n_deltas = 0;
+  size_t suffix_len = strlen(DELTA_SUFFIX);
+  struct dirent* entry;
+  while ((entry = readdir(dir)) != NULL) {
+    size_t len = strlen(entry->d_name);
+    if (len <= suffix_len || strcmp(entry->d_name + len - suffix_len, DELTA_SUFFIX) != 0) continue;
+    char delta_path[4096];
+    char out_path[4096];
+    snprintf(delta_path, sizeof(delta_path), "%s/%s", directory, entry->d_name);
+    snprintf(out_path, sizeof(out_path), "%s/%.*s", directory_out, (int)(len - suffix_len), entry->d_name);
+    printf("materializing delta: `%s`...\n", delta_path);
+    if (!deltaMaterialize(delta_path, out_path)) status = EXIT_FAILURE;
+    ++n_deltas;
+  }
+  closedir(dir);
+  if (n_deltas == 0) {
+    fprintf(stderr, "Error: No delta found in `%s`.\n", directory);
+    return EXIT_FAILURE;
+  }
+  return status;
+}
+
+// Internal functions
+
+static bool distinctOutputNames(uint32_t n_secrets, const char* const secret_filenames[n_secrets]) {
+  for (uint32_t i = 1; i < n_secrets; ++i) {
+    char stem[4096];
+    fileStem(stem, sizeof(stem), secret_filenames[i]);
+    for (uint32_t k = 0; k < i; ++k) {
+      char other[4096];
+      fileStem(other, sizeof(other), secret_filenames[k]);
+      if (strcmp(stem, other) == 0) {
+        fprintf(
+          stderr, "Error: `%s` and `%s` would both write their shadows to `%s`.\n", secret_filenames[k],
+          secret_filenames[i], stem
+        );
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+// Frames all go to the carriers picked for the biggest of them, which are read once and reused by every frame.
+static int distributeSequence(const DistributeJob* job, const uint64_t shadow_sizes[]) {
+  uint64_t shadow_size = 0;
+  for (uint32_t i = 0; i < job->n_secrets; ++i) {
+    if (shadow_sizes[i] > shadow_size) shadow_size = shadow_sizes[i];
+  }
+  Plan* plan = planAssign(job->carriers, 1, &shadow_size, job->tot_shadows, false, false);
+  if (plan == NULL) return EXIT_FAILURE;
+  printf("=== Sequence of %u frames ===\n", job->n_secrets);
+  for (int j = 0; j < plan->tot_shadows; ++j) {
+    const CarrierInfo* info = &job->carriers->carriers[plan->assignment[j]];
+    printf("  shadow %3d -> `%s` (capacity %lu bytes)\n", j, info->path, (unsigned long)info->capacity);
+  }
+  SisEngine engine = {.pool = NULL, .threads = job->threads};
+  if (job->processes > 1 && (engine.pool = shardStart(job->processes)) == NULL) {
+    planFree(plan);
+    return EXIT_FAILURE;
+  }
+  bool ok = sequenceDistribute(
+    job->n_secrets, job->secret_filenames, job->carriers, job->min_shadows, plan->tot_shadows, plan->assignment,
+    shadow_size, job->seed, job->field, job->mask, job->directory_out, job->sidecars, job->deltas, &engine
+  );
+  if (!shardStop(engine.pool)) ok = false;
+  planFree(plan);
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// Fills `picked` with the indexes of up to `n_shadows` carriers with distinct x-coordinates, skipping carriers that
+// hold no shadow and copies of a shadow already picked. Returns how many were picked.
+static uint8_t pickShadows(const CarrierList* carriers, uint8_t n_shadows, uint32_t picked[n_shadows]) {
+  const CarrierInfo* by_x[UINT8_MAX + 1] = {NULL};
+  uint8_t n_picked = 0;
+  for (uint32_t i = 0; i < carriers->count && n_picked < n_shadows; ++i) {
+    const CarrierInfo* info = &carriers->carriers[i];
+    if (info->x == 0) {
+      fprintf(stderr, "Warning: `%s` doesn't hold a shadow, skipping it.\n", info->path);
+      continue;
+    }
+    if (by_x[info->x] != NULL) {
+      fprintf(
+        stderr, "Warning: `%s` has the same x-coordinate (%u) as `%s`, skipping it.\n", info->path, info->x,
+        by_x[info->x]->path
+      );
+      continue;
+    }
+    by_x[info->x] = info;
+    picked[n_picked++] = i;
+  }
+  return n_picked;
+}
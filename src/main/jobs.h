@@ -0,0 +1,50 @@
+#ifndef JOBS_H
+#define JOBS_H
+
+#include "../sis/cache.h"
+#include "../sis/field.h"
+#include "../sis/permutation.h"
+#include "../sis/scan.h"
+#include "../sis/sis.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+// A job holds everything needed to run a distribution or a recovery, so that it can be run from the command line or
+// by a worker of the daemon (see `daemonRun`). Jobs don't own any of the memory they point to.
+typedef struct DistributeJob {
+  const char* const* secret_filenames;
+  uint32_t n_secrets;
+  const CarrierList* carriers;
+  uint8_t min_shadows;
+  uint8_t tot_shadows;
+  uint64_t seed; // Must fit in 16 bits with `MASK_LCG`.
+  Field field;
+  Mask mask;
+  bool pack;
+  bool in_place;
+  bool sequence;       // The secrets are the frames of a sequence (see `sequenceDistribute`).
+  bool sidecars;       // Also write the sidecar of every shadow (see `sidecarWrite`).
+  bool deltas;         // Write the shadows as deltas of their carriers (see `deltaWrite`).
+  uint32_t processes;  // Worker processes computing the shares (see `shardStart`), none if 0 or 1.
+  uint32_t threads;    // Threads computing the shares without worker processes (see `SisEngine`).
+  uint64_t max_memory; // Bytes the distribution may hold at once, no limit if 0 (see `planSchedule`).
+  const char* directory_out;
+} DistributeJob;
+
+typedef struct RecoverJob {
+  const char* secret_filename;
+  const CarrierList* carriers;
+  uint8_t min_shadows;
+  uint8_t n_shadows;   // Shadows to read, more than `min_shadows` only with a `report`.
+  uint64_t seed;       // Read from the shadows if 0.
+  uint32_t secret_idx;
+  SisReport* report;   // Verified recovery if not NULL.
+  CarrierCache* cache; // Shadows are parsed on every job if NULL.
+  bool sidecars;       // `carriers` lists sidecars (see `scanSidecars`), they are mapped instead of cached.
+} RecoverJob;
+
+int jobDistribute(const DistributeJob* job);
+int jobRecover(const RecoverJob* job);
+int jobMaterialize(const char* directory, const char* directory_out);
+
+#endif
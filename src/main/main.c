@@ -1,36 +1,68 @@
+#include "../io/io.h"
+#include "../sis/keystream.h"
 #include "../sis/sis.h"
-#include "../bmp/bmp.h"
 #include "args.h"
-#include <limits.h>
-#include <stdbool.h>
+#include "daemon.h"
+#include "jobs.h"
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
 int main(int argc, char* argv[]) {
   Args* args = argsParse(argc, argv);
-  if (args->distribute) {
-    BMP bmp = bmpParse(args->secret_filename);
-    printf("parsing secret: `%s`...\n", args->secret_filename);
-    if (bmp == NULL) {
-      fprintf(stderr, "Error parsing bmp `%s`", args->secret_filename);
-      exit(EXIT_FAILURE);
-    }
-    sisShadows(bmp, args->min_shadows, args->tot_shadows, args->dir_bmps, args->seed);
-    for (int i = 0; i < args->tot_shadows; ++i) {
-      char full_path[4096];
-      snprintf(full_path, 4096, "%s/shadow-%03d.bmp", args->directory_out, i);
-      printf("Saving `%s`...\n", full_path);
-      bmpWriteFile(full_path, args->dir_bmps[i]);
-    }
-    bmpFree(bmp);
+  int status;
+  if (args->listen_path != NULL) {
+    long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    uint32_t workers = args->workers > 0 ? args->workers : (n_cpus > 0 ? (uint32_t)n_cpus : 1);
+    status = daemonRun(
+      args->listen_path, workers, (size_t)args->cache_size * 1024 * 1024, args->cache_extract
+    );
+  } else if (args->materialize) {
+    status = jobMaterialize(args->directory, args->directory_out);
+  } else if (args->distribute) {
+    DistributeJob job = {
+      .secret_filenames = args->secret_filenames,
+      .n_secrets = args->n_secrets,
+      .carriers = args->carriers,
+      .min_shadows = args->min_shadows,
+      .tot_shadows = args->tot_shadows,
+      .seed = args->seed,
+      .field = args->field,
+      .mask = args->mask,
+      .pack = args->pack,
+      .in_place = args->in_place,
+      .sequence = args->sequence,
+      .sidecars = args->sidecars,
+      .deltas = args->deltas,
+      .processes = args->processes,
+      .threads = args->threads,
+      .max_memory = (uint64_t)args->max_memory * 1024 * 1024,
+      .directory_out = args->directory_out,
+    };
+    status = jobDistribute(&job);
   } else {
-    BMP secret = sisRecover(args->min_shadows, args->dir_bmps, args->seed);
-    bmpWriteFile(args->secret_filename, secret);
-    bmpFree(secret);
+    // Verified recovery reads every shadow.
+    SisReport report;
+    memset(&report, 0, sizeof(report));
+    RecoverJob job = {
+      .secret_filename = args->secret_filename,
+      .carriers = args->carriers,
+      .min_shadows = args->min_shadows,
+      .n_shadows = args->verify ? args->tot_shadows : args->min_shadows,
+      .seed = args->seed,
+      .secret_idx = args->secret_idx,
+      .report = args->verify ? &report : NULL,
+      .sidecars = args->sidecars,
+    };
+    status = jobRecover(&job);
+    if (args->verify && report.blocks > 0) sisPrintReport(&report);
   }
 
   argsFree(args);
+  ioRelease();
+  keystreamCacheClose();
 
-  return 0;
+  return status;
 }
@@ -0,0 +1,119 @@
+#define _GNU_SOURCE
+
+#include "numa.h"
+#include <linux/mempolicy.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define NODE_DIR "/sys/devices/system/node"
+#define NUMA_MAX_NODES 64
+#define MASK_BITS (8 * sizeof(unsigned long))
+
+// Read from sysfs and placed with the raw syscalls, so there's no dependency on libnuma. Only nodes with CPUs are
+// used, memory-only nodes have no thread to pin to them.
+typedef struct Topology {
+  uint32_t n_nodes;
+  int ids[NUMA_MAX_NODES]; // Kernel ids of the nodes, they may have gaps.
+  cpu_set_t cpus[NUMA_MAX_NODES];
+} Topology;
+
+static Topology topology = {.n_nodes = 1};
+static pthread_once_t topology_once = PTHREAD_ONCE_INIT;
+
+static void loadTopology(void);
+static bool readList(const char* path, cpu_set_t* set);
+static void bindRange(uintptr_t from, uintptr_t to, int id);
+
+uint32_t numaNodeCount(void) {
+  pthread_once(&topology_once, loadTopology);
+  return topology.n_nodes;
+}
+
+// Restricts the calling thread to the CPUs of `node`.
+bool numaPinThread(uint32_t node) {
+  if (numaNodeCount() < 2) return true;
+  return pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &topology.cpus[node % topology.n_nodes]) == 0;
+}
+
+// Maps `size` bytes of untouched memory, and places its first `span` bytes on the nodes in equal contiguous slices,
+// in order, so the pages of slice `i` are taken from node `i` when they are first written, whatever the thread that
+// writes them. Placement is only a preference: pages come from other nodes when a node is full, and failing to
+// place them is ignored. Returns NULL with `errno` set on failure. Free with `numaFree`.
+void* numaAlloc(size_t size, size_t span) {
+  void* buf = mmap(NULL, size > 0 ? size : 1, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (buf == MAP_FAILED) return NULL;
+  uint32_t n_nodes = numaNodeCount();
+  if (n_nodes < 2) return buf;
+
+  if (span > size) span = size;
+  uintptr_t page = sysconf(_SC_PAGESIZE);
+  uintptr_t base = (uintptr_t)buf;
+  size_t slice = span / n_nodes;
+  for (uint32_t i = 0; i < n_nodes; ++i) {
+    uintptr_t from = (base + (slice * i)) & ~(page - 1);
+    uintptr_t to = (i + 1 < n_nodes) ? base + (slice * (i + 1)) : base + span + page - 1;
+    to &= ~(page - 1);
+    if (to > from) bindRange(from, to, topology.ids[i]);
+  }
+  return buf;
+}
+
+void numaFree(void* buf, size_t size) {
+  if (buf != NULL) munmap(buf, size > 0 ? size : 1);
+}
+
+// Internal functions
+
+static void loadTopology(void) {
+  cpu_set_t nodes;
+  if (!readList(NODE_DIR "/has_cpu", &nodes)) return;
+  uint32_t n_nodes = 0;
+  for (int id = 0; id < CPU_SETSIZE && n_nodes < NUMA_MAX_NODES; ++id) {
+    if (!CPU_ISSET(id, &nodes) || id >= NUMA_MAX_NODES) continue;
+    char path[64];
+    snprintf(path, sizeof(path), NODE_DIR "/node%d/cpulist", id);
+    if (!readList(path, &topology.cpus[n_nodes]) || CPU_COUNT(&topology.cpus[n_nodes]) == 0) continue;
+    topology.ids[n_nodes++] = id;
+  }
+  if (n_nodes > 0) topology.n_nodes = n_nodes;
+}
+
+// Parses lists like "0-3,8,10-11" into `set`.
+static bool readList(const char* path, cpu_set_t* set) {
+  FILE* file = fopen(path, "r");
+  if (file == NULL) return false;
+  char buf[4096];
+  bool ok = fgets(buf, sizeof(buf), file) != NULL;
+  fclose(file);
+  CPU_ZERO(set);
+  for (char* pos = buf; ok && *pos != '\0' && *pos != '\n';) {
+    char* end;
+    unsigned long first = strtoul(pos, &end, 10);
+    unsigned long last = first;
+    if (end == pos) return false;
+    if (*end == '-') {
+      pos = end + 1;
+      last = strtoul(pos, &end, 10);
+      if (end == pos) return false;
+    }
+    for (unsigned long i = first; i <= last && i < CPU_SETSIZE; ++i) CPU_SET(i, set);
+    pos = *end == ',' ? end + 1 : end;
+  }
+  return ok;
+}
+
+static void bindRange(uintptr_t from, uintptr_t to, int id) {
+  unsigned long mask[NUMA_MAX_NODES / MASK_BITS] = {0};
+  mask[id / MASK_BITS] |= 1ul << (id % MASK_BITS);
+  // The kernel drops the last bit of the mask, hence the extra one.
+  syscall(SYS_mbind, from, to - from, MPOL_PREFERRED, mask, NUMA_MAX_NODES + 1, 0);
+}
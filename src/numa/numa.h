@@ -0,0 +1,15 @@
+#ifndef NUMA_H
+#define NUMA_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Nodes are numbered from 0 to `numaNodeCount() - 1`, whatever the ids the kernel gives them. Machines without NUMA,
+// or where the topology can't be read, have a single node, on which pinning and placement do nothing.
+uint32_t numaNodeCount(void);
+bool numaPinThread(uint32_t node);
+void* numaAlloc(size_t size, size_t span);
+void numaFree(void* buf, size_t size);
+
+#endif
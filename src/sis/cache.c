@@ -0,0 +1,225 @@
+#define _GNU_SOURCE
+
+#include "cache.h"
+#include "../bmp/bmp.h"
+#include "sis.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#define CACHE_BUCKETS 256
+
+struct CacheEntry {
+  char* path;
+  dev_t dev;
+  ino_t ino;
+  off_t size;
+  struct timespec mtime;
+  BMP bmp;
+  uint8_t* shadow_bytes;   // Only with `extract`, the pixels of `bmp` are dropped then.
+  size_t bytes;            // Memory held by the entry.
+  uint32_t refs;           // Jobs using the entry, plus one while it is in the cache.
+  struct CacheEntry* prev; // LRU list, most recently used first.
+  struct CacheEntry* next; //
+  struct CacheEntry* bucket_next;
+};
+
+struct CarrierCache {
+  pthread_mutex_t lock;
+  size_t budget;
+  bool extract;
+  CacheEntry* buckets[CACHE_BUCKETS];
+  CacheEntry* lru_head;
+  CacheEntry* lru_tail;
+  CacheStats stats;
+};
+
+static uint32_t hashPath(const char* path);
+static CacheEntry* findEntry(CarrierCache* cache, const char* path);
+static bool entryMatches(const CacheEntry* entry, const struct stat* file_stat);
+static CacheEntry* loadEntry(CarrierCache* cache, const char* path, const struct stat* file_stat);
+static void insertEntry(CarrierCache* cache, CacheEntry* entry);
+static void unlinkEntry(CarrierCache* cache, CacheEntry* entry);
+static void evictEntry(CarrierCache* cache, CacheEntry* entry);
+static void freeEntry(CacheEntry* entry);
+
+CarrierCache* cacheNew(size_t budget, bool extract) {
+  CarrierCache* cache = calloc(1, sizeof(CarrierCache));
+  if (cache == NULL) {
+    perror("calloc");
+    return NULL;
+  }
+  pthread_mutex_init(&cache->lock, NULL);
+  cache->budget = budget;
+  cache->extract = extract;
+  return cache;
+}
+
+// Returns the parsed carrier at `path`, parsing it only if it isn't cached or the file changed since it was. The
+// entry stays valid until `cacheRelease`, even if it gets evicted meanwhile.
+CacheEntry* cacheAcquire(CarrierCache* cache, const char* path) {
+  struct stat file_stat;
+  if (stat(path, &file_stat) != 0) {
+    perror("stat");
+    return NULL;
+  }
+
+  pthread_mutex_lock(&cache->lock);
+  CacheEntry* entry = findEntry(cache, path);
+  if (entry != NULL && entryMatches(entry, &file_stat)) {
+    ++entry->refs;
+    // Move to the front of the LRU list.
+    unlinkEntry(cache, entry);
+    insertEntry(cache, entry);
+    ++cache->stats.hits;
+    pthread_mutex_unlock(&cache->lock);
+    return entry;
+  }
+  if (entry != NULL) evictEntry(cache, entry);
+  ++cache->stats.misses;
+  pthread_mutex_unlock(&cache->lock);
+
+  // Parsed without the lock, so other jobs aren't held back by the I/O.
+  entry = loadEntry(cache, path, &file_stat);
+  if (entry == NULL) return NULL;
+
+  pthread_mutex_lock(&cache->lock);
+  // Another job may have cached the same carrier meanwhile.
+  CacheEntry* other = findEntry(cache, path);
+  if (other != NULL) evictEntry(cache, other);
+  entry->refs = 2;
+  insertEntry(cache, entry);
+  while (cache->stats.bytes > cache->budget && cache->lru_tail != NULL) {
+    ++cache->stats.evictions;
+    evictEntry(cache, cache->lru_tail);
+  }
+  pthread_mutex_unlock(&cache->lock);
+  return entry;
+}
+
+void cacheRelease(CarrierCache* cache, CacheEntry* entry) {
+  pthread_mutex_lock(&cache->lock);
+  bool last = --entry->refs == 0;
+  pthread_mutex_unlock(&cache->lock);
+  if (last) freeEntry(entry);
+}
+
+BMP cacheEntryBmp(const CacheEntry* entry) {
+  return entry->bmp;
+}
+
+// NULL unless the cache extracts shadow bytes.
+const uint8_t* cacheEntryShadowBytes(const CacheEntry* entry) {
+  return entry->shadow_bytes;
+}
+
+CacheStats cacheStats(CarrierCache* cache) {
+  pthread_mutex_lock(&cache->lock);
+  CacheStats stats = cache->stats;
+  pthread_mutex_unlock(&cache->lock);
+  return stats;
+}
+
+// Entries still acquired by a job must be released first.
+void cacheFree(CarrierCache* cache) {
+  if (cache == NULL) return;
+  while (cache->lru_head != NULL) evictEntry(cache, cache->lru_head);
+  pthread_mutex_destroy(&cache->lock);
+  free(cache);
+}
+
+// Internal functions
+
+// FNV-1a.
+static uint32_t hashPath(const char* path) {
+  uint32_t hash = 2166136261u;
+  for (const char* c = path; *c != '\0'; ++c) hash = (hash ^ (uint8_t)*c) * 16777619u;
+  return hash;
+}
+
+static CacheEntry* findEntry(CarrierCache* cache, const char* path) {
+  CacheEntry* entry = cache->buckets[hashPath(path) % CACHE_BUCKETS];
+  while (entry != NULL && strcmp(entry->path, path) != 0) entry = entry->bucket_next;
+  return entry;
+}
+
+static bool entryMatches(const CacheEntry* entry, const struct stat* file_stat) {
+  return entry->dev == file_stat->st_dev && entry->ino == file_stat->st_ino && entry->size == file_stat->st_size &&
+         entry->mtime.tv_sec == file_stat->st_mtim.tv_sec && entry->mtime.tv_nsec == file_stat->st_mtim.tv_nsec;
+}
+
+static CacheEntry* loadEntry(CarrierCache* cache, const char* path, const struct stat* file_stat) {
+  CacheEntry* entry = calloc(1, sizeof(CacheEntry));
+  if (entry == NULL) {
+    perror("calloc");
+    return NULL;
+  }
+  entry->path = strdup(path);
+  entry->bmp = bmpParse(path);
+  if (entry->path == NULL || entry->bmp == NULL) {
+    fprintf(stderr, "Error parsing bmp `%s`\n", path);
+    freeEntry(entry);
+    return NULL;
+  }
+  uint64_t image_size = bmpImageSize(entry->bmp);
+  if (cache->extract) {
+    entry->shadow_bytes = malloc(image_size / 8 + 1);
+    if (entry->shadow_bytes == NULL) {
+      perror("malloc");
+      freeEntry(entry);
+      return NULL;
+    }
+    sisExtractShadowBytes(entry->bmp, entry->shadow_bytes);
+    bmpDropImage(entry->bmp);
+  }
+  entry->dev = file_stat->st_dev;
+  entry->ino = file_stat->st_ino;
+  entry->size = file_stat->st_size;
+  entry->mtime = file_stat->st_mtim;
+  entry->bytes = sizeof(CacheEntry) + strlen(path) + 1 + (cache->extract ? image_size / 8 : image_size) +
+                 bmpExtraSize(entry->bmp) + (bmpNColors(entry->bmp) * sizeof(Color));
+  return entry;
+}
+
+static void insertEntry(CarrierCache* cache, CacheEntry* entry) {
+  uint32_t bucket = hashPath(entry->path) % CACHE_BUCKETS;
+  entry->bucket_next = cache->buckets[bucket];
+  cache->buckets[bucket] = entry;
+  entry->prev = NULL;
+  entry->next = cache->lru_head;
+  if (cache->lru_head != NULL) cache->lru_head->prev = entry;
+  else cache->lru_tail = entry;
+  cache->lru_head = entry;
+  cache->stats.bytes += entry->bytes;
+  ++cache->stats.entries;
+}
+
+static void unlinkEntry(CarrierCache* cache, CacheEntry* entry) {
+  CacheEntry** link = &cache->buckets[hashPath(entry->path) % CACHE_BUCKETS];
+  while (*link != entry) link = &(*link)->bucket_next;
+  *link = entry->bucket_next;
+  if (entry->prev != NULL) entry->prev->next = entry->next;
+  else cache->lru_head = entry->next;
+  if (entry->next != NULL) entry->next->prev = entry->prev;
+  else cache->lru_tail = entry->prev;
+  cache->stats.bytes -= entry->bytes;
+  --cache->stats.entries;
+}
+
+// Unlinks `entry` and drops the reference of the cache, freeing it unless a job still uses it.
+static void evictEntry(CarrierCache* cache, CacheEntry* entry) {
+  unlinkEntry(cache, entry);
+  if (--entry->refs == 0) freeEntry(entry);
+}
+
+static void freeEntry(CacheEntry* entry) {
+  free(entry->path);
+  bmpFree(entry->bmp);
+  free(entry->shadow_bytes);
+  free(entry);
+}
@@ -0,0 +1,32 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include "../bmp/bmp.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Parsed carriers kept across jobs, keyed by path and validated against the inode, size and mtime of the file, so a
+// carrier that was rewritten is parsed again. Least recently used carriers are evicted once the cache holds more than
+// its memory budget. With `extract`, the shadow bytes of every carrier are gathered from its pixels once and the
+// pixels are dropped, which takes 8 times less memory and skips the LSB extraction on every hit.
+typedef struct CarrierCache CarrierCache;
+typedef struct CacheEntry CacheEntry;
+
+typedef struct CacheStats {
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t evictions;
+  size_t bytes; // Memory held by the cached carriers.
+  uint32_t entries;
+} CacheStats;
+
+CarrierCache* cacheNew(size_t budget, bool extract);
+CacheEntry* cacheAcquire(CarrierCache* cache, const char* path);
+void cacheRelease(CarrierCache* cache, CacheEntry* entry);
+BMP cacheEntryBmp(const CacheEntry* entry);
+const uint8_t* cacheEntryShadowBytes(const CacheEntry* entry);
+CacheStats cacheStats(CarrierCache* cache);
+void cacheFree(CarrierCache* cache);
+
+#endif
@@ -0,0 +1,212 @@
+#define _GNU_SOURCE
+
+#include "delta.h"
+#include "../bmp/bmp.h"
+#include "../io/io.h"
+#include "../utils/utils.h"
+#include "sis.h"
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define DELTA_MAGIC 0x4C444853u // "SHDL"
+#define DELTA_VERSION 1
+// Bytes of the carrier hashed at a time.
+#define HASH_CHUNK (1u << 20u)
+
+// Followed by the path of the carrier, the extra data and the shadow bytes [from, to). Fields are in host byte order,
+// like the extra data.
+typedef struct {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t path_size;       // Absolute path of the carrier, NUL included.
+  uint8_t reserved[4];      // Reserved bytes of the shadow header.
+  uint32_t extra_data_size; //
+  uint64_t carrier_size;    // Size in bytes of the carrier file.
+  uint64_t carrier_hash;    // FNV-1a of the whole carrier file.
+  uint64_t from;            // Shadow bytes [from, to) are the only ones that differ from the carrier.
+  uint64_t to;              //
+  uint64_t checksum;        // FNV-1a of the whole delta, with this field set to 0.
+} DeltaHeader;
+
+static bool hashFile(const char* filename, uint64_t* size, uint64_t* hash);
+static uint64_t deltaChecksum(const DeltaHeader* header, const uint8_t* data, size_t size);
+
+// Writes the delta of `shadow`, which was parsed from `carrier_path` and must hold the pixels of its dirty range.
+bool deltaWrite(const char* filename, BMP shadow, const char* carrier_path) {
+  char* carrier = realpath(carrier_path, NULL);
+  if (carrier == NULL) {
+    perror("realpath");
+    return false;
+  }
+  DeltaHeader header;
+  memset(&header, 0, sizeof(header));
+  size_t path_size = strlen(carrier) + 1;
+  if (path_size > UINT16_MAX || !hashFile(carrier, &header.carrier_size, &header.carrier_hash)) {
+    if (path_size > UINT16_MAX) fprintf(stderr, "deltaWrite: The path of `%s` is too long.\n", carrier_path);
+    free(carrier);
+    return false;
+  }
+  // Shadow bytes hide in 8 pixel bytes each, the range is rounded out to whole shadow bytes.
+  uint64_t dirty_from;
+  uint64_t dirty_to;
+  bmpDirtyRange(shadow, &dirty_from, &dirty_to);
+  header.from = dirty_from / 8;
+  header.to = dirty_from < dirty_to ? ceilDiv(dirty_to, 8) : header.from;
+
+  uint32_t extra_data_size = bmpExtraSize(shadow);
+  size_t data_size = path_size + extra_data_size + (header.to - header.from);
+  uint8_t* data = malloc(data_size);
+  if (data == NULL) {
+    perror("malloc");
+    free(carrier);
+    return false;
+  }
+  memcpy(data, carrier, path_size);
+  memcpy(data + path_size, bmpExtraData(shadow), extra_data_size);
+  sisExtractShadowRange(shadow, header.from, header.to, data + path_size + extra_data_size);
+  free(carrier);
+
+  header.magic = DELTA_MAGIC;
+  header.version = DELTA_VERSION;
+  header.path_size = path_size;
+  memcpy(header.reserved, bmpReserved(shadow), 4);
+  header.extra_data_size = extra_data_size;
+  header.checksum = deltaChecksum(&header, data, data_size);
+
+  int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    perror("open");
+    free(data);
+    return false;
+  }
+  uint32_t n_requests = 1 + ioChunkCount(data_size, sizeof(DeltaHeader));
+  IoRequest* requests = malloc(n_requests * sizeof(IoRequest));
+  bool ok = requests != NULL;
+  if (!ok) perror("malloc");
+  if (ok) {
+    requests[0] = (IoRequest){.fd = fd, .buf = &header, .size = sizeof(header), .offset = 0};
+    ioSplit(fd, data, data_size, sizeof(DeltaHeader), &requests[1]);
+    ok = ioWrite(n_requests, requests);
+  }
+  free(requests);
+  free(data);
+  if (close(fd) != 0) {
+    perror("close");
+    return false;
+  }
+  return ok;
+}
+
+// Writes the shadow `filename` was made from to `out_filename`, after checking that its carrier didn't change. The
+// header and the modified pixels are written, the rest of the pixels is cloned from the carrier (see `bmpPatchFile`).
+bool deltaMaterialize(const char* filename, const char* out_filename) {
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) {
+    perror("open");
+    return false;
+  }
+  struct stat file_stat;
+  if (fstat(fd, &file_stat) != 0) {
+    perror("fstat");
+    close(fd);
+    return false;
+  }
+  if ((size_t)file_stat.st_size < sizeof(DeltaHeader)) {
+    fprintf(stderr, "Error: `%s` is not a delta.\n", filename);
+    close(fd);
+    return false;
+  }
+  uint8_t* map = mmap(NULL, file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    perror("mmap");
+    return false;
+  }
+
+  const DeltaHeader* header = (const DeltaHeader*)map;
+  const uint8_t* data = map + sizeof(DeltaHeader);
+  size_t data_size = file_stat.st_size - sizeof(DeltaHeader);
+  bool ok = header->magic == DELTA_MAGIC && header->version == DELTA_VERSION && header->from <= header->to &&
+            header->to - header->from <= data_size &&
+            (uint64_t)header->path_size + header->extra_data_size + (header->to - header->from) == data_size &&
+            header->path_size > 0 && data[header->path_size - 1] == '\0';
+  if (!ok) fprintf(stderr, "Error: `%s` is not a delta or is truncated.\n", filename);
+  if (ok && deltaChecksum(header, data, data_size) != header->checksum) {
+    fprintf(stderr, "Error: Checksum mismatch in delta `%s`.\n", filename);
+    ok = false;
+  }
+
+  const char* carrier = (const char*)data;
+  uint64_t carrier_size;
+  uint64_t carrier_hash;
+  ok = ok && hashFile(carrier, &carrier_size, &carrier_hash);
+  if (ok && (carrier_size != header->carrier_size || carrier_hash != header->carrier_hash)) {
+    fprintf(stderr, "Error: The carrier `%s` of `%s` changed since the delta was written.\n", carrier, filename);
+    ok = false;
+  }
+
+  BMP shadow = NULL;
+  if (ok) {
+    shadow = bmpParseWindow(carrier, 0, 0);
+    ok = shadow != NULL && header->to <= bmpImageSize(shadow) / 8;
+    if (!ok) fprintf(stderr, "Error: `%s` doesn't fit its carrier `%s`.\n", filename, carrier);
+  }
+  if (ok) {
+    // The mapping is read only, `bmpSetExtraData` copies the extra data.
+    uint8_t reserved[4];
+    memcpy(reserved, header->reserved, 4);
+    bmpSetReserved(shadow, reserved);
+    bmpSetExtraData(shadow, header->extra_data_size, (uint8_t*)data + header->path_size);
+    ok = bmpLoadWindow(shadow, carrier, 8 * header->from, 8 * header->to);
+  }
+  if (ok) {
+    sisHideShadowRange(shadow, header->from, header->to, data + header->path_size + header->extra_data_size);
+    printf("Saving `%s`...\n", out_filename);
+    ok = bmpPatchFile(out_filename, carrier, shadow) == 0;
+  }
+  bmpFree(shadow);
+  munmap(map, file_stat.st_size);
+  return ok;
+}
+
+// Internal functions
+
+static bool hashFile(const char* filename, uint64_t* size, uint64_t* hash) {
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) {
+    perror("open");
+    return false;
+  }
+  uint8_t* chunk = malloc(HASH_CHUNK);
+  if (chunk == NULL) {
+    perror("malloc");
+    close(fd);
+    return false;
+  }
+  *size = 0;
+  *hash = FNV_OFFSET_BASIS;
+  ssize_t n;
+  while ((n = read(fd, chunk, HASH_CHUNK)) > 0) {
+    *hash = fnv1a(*hash, chunk, n);
+    *size += n;
+  }
+  if (n < 0) perror("read");
+  free(chunk);
+  close(fd);
+  return n == 0;
+}
+
+static uint64_t deltaChecksum(const DeltaHeader* header, const uint8_t* data, size_t size) {
+  DeltaHeader zeroed = *header;
+  zeroed.checksum = 0;
+  uint64_t hash = fnv1a(FNV_OFFSET_BASIS, (const uint8_t*)&zeroed, sizeof(zeroed));
+  return fnv1a(hash, data, size);
+}
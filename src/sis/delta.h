@@ -0,0 +1,18 @@
+#ifndef DELTA_H
+#define DELTA_H
+
+#include "../bmp/bmp.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+// A delta stores a shadow as what sets it apart from its carrier: the reserved bytes and the extra data of its header,
+// and the shadow bytes of the range its pixels were modified in, which are the LSB plane of that range packed 8 to a
+// byte. The carrier is referenced by path and checked against the size and FNV-1a hash of the whole file, so a delta
+// takes about 8 times less than the shadow and is materialized back into the exact same file as long as its carrier is
+// kept. Deltas are written in place of the shadows, with `DELTA_SUFFIX` appended to their name.
+#define DELTA_SUFFIX ".dlt"
+
+bool deltaWrite(const char* filename, BMP shadow, const char* carrier_path);
+bool deltaMaterialize(const char* filename, const char* out_filename);
+
+#endif
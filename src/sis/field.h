@@ -0,0 +1,31 @@
+#ifndef FIELD_H
+#define FIELD_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Arithmetic the shadows are computed in. GF(257) is the scheme of the paper, where shares that equal 256 don't fit in
+// a byte and force the coefficients to be altered. GF(2^8) shares always fit in a byte, so it is lossless.
+typedef enum Field {
+  FIELD_GF257 = 0,
+  FIELD_GF256 = 1,
+} Field;
+
+extern const uint8_t gf256Exp[510];
+extern const uint8_t gf256Log[256];
+
+static inline uint8_t gf256Mul(uint8_t a, uint8_t b) {
+  if (a == 0 || b == 0) return 0;
+  return gf256Exp[gf256Log[a] + gf256Log[b]];
+}
+
+uint32_t fieldAdd(Field field, uint32_t a, uint32_t b);
+uint32_t fieldSub(Field field, uint32_t a, uint32_t b);
+uint32_t fieldMul(Field field, uint32_t a, uint32_t b);
+uint32_t fieldInv(Field field, uint32_t a);
+uint32_t fieldPolyEval(Field field, uint8_t n_coefs, const uint8_t coefs[n_coefs], uint32_t x);
+bool fieldInvertMatrix(Field field, uint32_t n, const uint32_t* matrix, uint32_t* inverse);
+bool fieldInterpolationWeights(Field field, uint32_t n, const uint16_t xs[n], uint32_t* weights);
+const char* fieldName(Field field);
+
+#endif
@@ -0,0 +1,318 @@
+#include "kernels.h"
+#include "../globals.h"
+#include "field.h"
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define KERNEL_AVX2 1
+#include <immintrin.h>
+#else
+#define KERNEL_AVX2 0
+#endif
+
+// The kernels are written once with `k` as a parameter and always inlined, so every specialization generated by
+// `DEFINE_KERNELS` gets `k` as a constant and its loops over the coefficients fully unrolled.
+#define KERNEL_INLINE static inline __attribute__((always_inline))
+
+KERNEL_INLINE void shareGf257(
+  uint8_t k, uint8_t tot_shadows, uint32_t n_blocks, uint8_t* coefficients, uint8_t* shares, uint32_t stride
+);
+KERNEL_INLINE void shareGf256(
+  uint8_t k, uint8_t tot_shadows, uint32_t n_blocks, const uint8_t* coefficients, uint8_t* shares, uint32_t stride
+);
+KERNEL_INLINE void interpolateGf257(uint8_t k, const uint32_t* weights, const uint8_t* ys, uint8_t* coefs);
+KERNEL_INLINE void interpolateGf256(uint8_t k, const uint32_t* weights, const uint8_t* ys, uint8_t* coefs);
+static void interpolateRangeGf257(
+  uint8_t k, const uint32_t* weights, uint32_t first, uint32_t n_blocks, const uint8_t* const ys[], uint8_t* out,
+  uint32_t stride
+);
+static void interpolateRangeGf256(
+  uint8_t k, const uint32_t* weights, uint32_t first, uint32_t n_blocks, const uint8_t* const ys[], uint8_t* out,
+  uint32_t stride
+);
+static void interpolateBatchGf257(
+  uint8_t min_shadows, const uint32_t* weights, uint32_t n_blocks, const uint8_t* const ys[], uint8_t* out,
+  uint32_t stride
+);
+static void interpolateBatchGf256(
+  uint8_t min_shadows, const uint32_t* weights, uint32_t n_blocks, const uint8_t* const ys[], uint8_t* out,
+  uint32_t stride
+);
+#if KERNEL_AVX2
+static void interpolateBatchGf257Avx2(
+  uint8_t min_shadows, const uint32_t* weights, uint32_t n_blocks, const uint8_t* const ys[], uint8_t* out,
+  uint32_t stride
+);
+static void interpolateBatchGf256Avx2(
+  uint8_t min_shadows, const uint32_t* weights, uint32_t n_blocks, const uint8_t* const ys[], uint8_t* out,
+  uint32_t stride
+);
+#endif
+
+#define DEFINE_KERNELS(K, SUFFIX)                                                                                      \
+  static void shareGf257##SUFFIX(                                                                                      \
+    uint8_t min_shadows, uint8_t tot_shadows, uint32_t n_blocks, uint8_t* coefficients, uint8_t* shares,             \
+    uint32_t stride                                                                                                    \
+  ) {                                                                                                                  \
+    (void)min_shadows;                                                                                                 \
+    shareGf257(K, tot_shadows, n_blocks, coefficients, shares, stride);                                                \
+  }                                                                                                                    \
+  static void shareGf256##SUFFIX(                                                                                      \
+    uint8_t min_shadows, uint8_t tot_shadows, uint32_t n_blocks, uint8_t* coefficients, uint8_t* shares,             \
+    uint32_t stride                                                                                                    \
+  ) {                                                                                                                  \
+    (void)min_shadows;                                                                                                 \
+    shareGf256(K, tot_shadows, n_blocks, coefficients, shares, stride);                                                \
+  }                                                                                                                    \
+  static void interpolateGf257##SUFFIX(                                                                                \
+    uint8_t min_shadows, const uint32_t* weights, const uint8_t* ys, uint8_t* coefs                                    \
+  ) {                                                                                                                  \
+    (void)min_shadows;                                                                                                 \
+    interpolateGf257(K, weights, ys, coefs);                                                                           \
+  }                                                                                                                    \
+  static void interpolateGf256##SUFFIX(                                                                                \
+    uint8_t min_shadows, const uint32_t* weights, const uint8_t* ys, uint8_t* coefs                                    \
+  ) {                                                                                                                  \
+    (void)min_shadows;                                                                                                 \
+    interpolateGf256(K, weights, ys, coefs);                                                                           \
+  }
+
+DEFINE_KERNELS(2, K2)
+DEFINE_KERNELS(3, K3)
+DEFINE_KERNELS(4, K4)
+DEFINE_KERNELS(5, K5)
+DEFINE_KERNELS(6, K6)
+DEFINE_KERNELS(7, K7)
+DEFINE_KERNELS(8, K8)
+DEFINE_KERNELS(min_shadows, Generic)
+
+#define KERNEL_TABLE(NAME)                                                                                             \
+  {[2] = NAME##K2, [3] = NAME##K3, [4] = NAME##K4, [5] = NAME##K5, [6] = NAME##K6, [7] = NAME##K7, [8] = NAME##K8}
+
+static const ShareKernel share_kernels[2][KERNEL_MAX_K + 1] = {
+  [FIELD_GF257] = KERNEL_TABLE(shareGf257),
+  [FIELD_GF256] = KERNEL_TABLE(shareGf256),
+};
+
+static const InterpolateKernel interpolate_kernels[2][KERNEL_MAX_K + 1] = {
+  [FIELD_GF257] = KERNEL_TABLE(interpolateGf257),
+  [FIELD_GF256] = KERNEL_TABLE(interpolateGf256),
+};
+
+ShareKernel kernelShare(Field field, uint8_t min_shadows) {
+  if (min_shadows <= KERNEL_MAX_K) return share_kernels[field][min_shadows];
+  return field == FIELD_GF256 ? shareGf256Generic : shareGf257Generic;
+}
+
+InterpolateKernel kernelInterpolate(Field field, uint8_t min_shadows) {
+  if (min_shadows <= KERNEL_MAX_K) return interpolate_kernels[field][min_shadows];
+  return field == FIELD_GF256 ? interpolateGf256Generic : interpolateGf257Generic;
+}
+
+InterpolateBatchKernel kernelInterpolateBatch(Field field) {
+#if KERNEL_AVX2
+  if (__builtin_cpu_supports("avx2")) {
+    return field == FIELD_GF256 ? interpolateBatchGf256Avx2 : interpolateBatchGf257Avx2;
+  }
+#endif
+  return field == FIELD_GF256 ? interpolateBatchGf256 : interpolateBatchGf257;
+}
+
+// Internal functions
+
+// Horner's rule, reduced at every step. A share of 256 doesn't fit in a byte, so the first non-zero coefficient of the
+// block is decremented and the block is evaluated again from the first shadow.
+KERNEL_INLINE void shareGf257(
+  uint8_t k, uint8_t tot_shadows, uint32_t n_blocks, uint8_t* coefficients, uint8_t* shares, uint32_t stride
+) {
+  for (uint32_t t = 0; t < n_blocks; ++t) {
+    uint8_t* coefs = &coefficients[(size_t)t * k];
+    for (uint32_t x = 1; x <= tot_shadows; ++x) {
+      uint32_t val = coefs[k - 1];
+#pragma GCC unroll 8
+      for (int j = k - 2; j >= 0; --j) val = ((val * x) + coefs[j]) % MOD;
+      if (val == 256) {
+        int j = 0;
+        while (j < k && coefs[j] == 0) ++j;
+        assert(j < k && "Expected at least one non-zero coefficient");
+        --coefs[j];
+        x = 0;
+        continue;
+      }
+      shares[((size_t)(x - 1) * stride) + t] = val;
+    }
+  }
+}
+
+KERNEL_INLINE void shareGf256(
+  uint8_t k, uint8_t tot_shadows, uint32_t n_blocks, const uint8_t* coefficients, uint8_t* shares, uint32_t stride
+) {
+  for (uint32_t t = 0; t < n_blocks; ++t) {
+    const uint8_t* coefs = &coefficients[(size_t)t * k];
+    for (uint32_t x = 1; x <= tot_shadows; ++x) {
+      uint8_t val = coefs[k - 1];
+#pragma GCC unroll 8
+      for (int j = k - 2; j >= 0; --j) val = gf256Mul(val, x) ^ coefs[j];
+      shares[((size_t)(x - 1) * stride) + t] = val;
+    }
+  }
+}
+
+// Sums are reduced once per coefficient, the weights are below 257 so they can't overflow.
+KERNEL_INLINE void interpolateGf257(uint8_t k, const uint32_t* weights, const uint8_t* ys, uint8_t* coefs) {
+#pragma GCC unroll 8
+  for (int i = 0; i < k; ++i) {
+    uint32_t val = 0;
+#pragma GCC unroll 8
+    for (int j = 0; j < k; ++j) val += weights[(i * k) + j] * ys[j];
+    coefs[i] = val % MOD;
+  }
+}
+
+KERNEL_INLINE void interpolateGf256(uint8_t k, const uint32_t* weights, const uint8_t* ys, uint8_t* coefs) {
+#pragma GCC unroll 8
+  for (int i = 0; i < k; ++i) {
+    uint8_t val = 0;
+#pragma GCC unroll 8
+    for (int j = 0; j < k; ++j) val ^= gf256Mul(weights[(i * k) + j], ys[j]);
+    coefs[i] = val;
+  }
+}
+
+// Blocks `first` to `n_blocks - 1` of a batch, one at a time. The vectorized kernels finish their batches with these.
+static void interpolateRangeGf257(
+  uint8_t k, const uint32_t* weights, uint32_t first, uint32_t n_blocks, const uint8_t* const ys[], uint8_t* out,
+  uint32_t stride
+) {
+  for (uint32_t t = first; t < n_blocks; ++t) {
+    for (int i = 0; i < k; ++i) {
+      uint32_t val = 0;
+      for (int j = 0; j < k; ++j) val += weights[(i * k) + j] * ys[j][t];
+      out[((size_t)i * stride) + t] = val % MOD;
+    }
+  }
+}
+
+static void interpolateRangeGf256(
+  uint8_t k, const uint32_t* weights, uint32_t first, uint32_t n_blocks, const uint8_t* const ys[], uint8_t* out,
+  uint32_t stride
+) {
+  for (uint32_t t = first; t < n_blocks; ++t) {
+    for (int i = 0; i < k; ++i) {
+      uint8_t val = 0;
+      for (int j = 0; j < k; ++j) val ^= gf256Mul(weights[(i * k) + j], ys[j][t]);
+      out[((size_t)i * stride) + t] = val;
+    }
+  }
+}
+
+static void interpolateBatchGf257(
+  uint8_t min_shadows, const uint32_t* weights, uint32_t n_blocks, const uint8_t* const ys[], uint8_t* out,
+  uint32_t stride
+) {
+  interpolateRangeGf257(min_shadows, weights, 0, n_blocks, ys, out, stride);
+}
+
+static void interpolateBatchGf256(
+  uint8_t min_shadows, const uint32_t* weights, uint32_t n_blocks, const uint8_t* const ys[], uint8_t* out,
+  uint32_t stride
+) {
+  interpolateRangeGf256(min_shadows, weights, 0, n_blocks, ys, out, stride);
+}
+
+#if KERNEL_AVX2
+
+// 256 = -1 (mod 257), so a sum below 2^24 with bytes x0, x1 and x2 is x0 - x1 + x2, which is in [2, 767] once 257 is
+// added and is then brought below 257 by two conditional subtractions. The result is masked to a byte, so 256 wraps
+// to 0 like it does when the scalar kernels store it.
+__attribute__((target("avx2"))) static inline __m256i reduceGf257Avx2(__m256i x) {
+  const __m256i byte = _mm256_set1_epi32(0xFF);
+  const __m256i mod = _mm256_set1_epi32(MOD);
+  __m256i r = _mm256_add_epi32(_mm256_and_si256(x, byte), _mm256_srli_epi32(x, 16));
+  r = _mm256_sub_epi32(_mm256_add_epi32(r, mod), _mm256_and_si256(_mm256_srli_epi32(x, 8), byte));
+  r = _mm256_min_epu32(r, _mm256_sub_epi32(r, mod));
+  r = _mm256_min_epu32(r, _mm256_sub_epi32(r, mod));
+  return _mm256_and_si256(r, byte);
+}
+
+// 16 blocks at a time. The bytes of shadows 2p and 2p + 1 are interleaved as 16-bit pairs that `_mm256_madd_epi16`
+// multiplies by the pair of weights and adds into 32-bit lanes, and the sums are reduced once per coefficient: with
+// weights up to 256 they stay below 2^24 for any k.
+__attribute__((target("avx2"))) static void interpolateBatchGf257Avx2(
+  uint8_t min_shadows, const uint32_t* weights, uint32_t n_blocks, const uint8_t* const ys[], uint8_t* out,
+  uint32_t stride
+) {
+  uint8_t k = min_shadows;
+  int n_pairs = (k + 1) / 2;
+  int32_t pair_weights[k][n_pairs];
+  for (int i = 0; i < k; ++i) {
+    for (int p = 0; p < n_pairs; ++p) {
+      uint32_t high = (2 * p) + 1 < k ? weights[(i * k) + (2 * p) + 1] : 0;
+      pair_weights[i][p] = (int32_t)(weights[(i * k) + (2 * p)] | (high << 16u));
+    }
+  }
+
+  __m256i pairs[n_pairs][2];
+  uint32_t t = 0;
+  for (; t + 16 <= n_blocks; t += 16) {
+    for (int p = 0; p < n_pairs; ++p) {
+      __m128i a = _mm_loadu_si128((const __m128i*)(ys[2 * p] + t));
+      __m128i b = (2 * p) + 1 < k ? _mm_loadu_si128((const __m128i*)(ys[(2 * p) + 1] + t)) : _mm_setzero_si128();
+      pairs[p][0] = _mm256_cvtepu8_epi16(_mm_unpacklo_epi8(a, b));
+      pairs[p][1] = _mm256_cvtepu8_epi16(_mm_unpackhi_epi8(a, b));
+    }
+    for (int i = 0; i < k; ++i) {
+      __m256i low = _mm256_setzero_si256();
+      __m256i high = _mm256_setzero_si256();
+      for (int p = 0; p < n_pairs; ++p) {
+        __m256i w = _mm256_set1_epi32(pair_weights[i][p]);
+        low = _mm256_add_epi32(low, _mm256_madd_epi16(pairs[p][0], w));
+        high = _mm256_add_epi32(high, _mm256_madd_epi16(pairs[p][1], w));
+      }
+      // The packs work within 128-bit halves, the permutation puts the 16-bit values back in block order.
+      __m256i words = _mm256_packus_epi32(reduceGf257Avx2(low), reduceGf257Avx2(high));
+      words = _mm256_permute4x64_epi64(words, 0xD8);
+      __m128i bytes = _mm_packus_epi16(_mm256_castsi256_si128(words), _mm256_extracti128_si256(words, 1));
+      _mm_storeu_si128((__m128i*)(out + ((size_t)i * stride) + t), bytes);
+    }
+  }
+  interpolateRangeGf257(k, weights, t, n_blocks, ys, out, stride);
+}
+
+// 32 blocks at a time. Multiplying by a weight is linear over XOR, so the product of every byte is the XOR of the
+// products of its low and high nibbles, looked up in 16-byte tables with `_mm256_shuffle_epi8`.
+__attribute__((target("avx2"))) static void interpolateBatchGf256Avx2(
+  uint8_t min_shadows, const uint32_t* weights, uint32_t n_blocks, const uint8_t* const ys[], uint8_t* out,
+  uint32_t stride
+) {
+  uint8_t k = min_shadows;
+  uint32_t vec_end = n_blocks - (n_blocks % 32);
+  const __m256i nibble = _mm256_set1_epi8(0x0F);
+  for (int i = 0; i < k; ++i) {
+    uint8_t* row = out + ((size_t)i * stride);
+    for (int j = 0; j < k; ++j) {
+      uint8_t low_products[16];
+      uint8_t high_products[16];
+      for (int n = 0; n < 16; ++n) {
+        low_products[n] = gf256Mul(weights[(i * k) + j], n);
+        high_products[n] = gf256Mul(weights[(i * k) + j], n << 4u);
+      }
+      __m256i low = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)low_products));
+      __m256i high = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)high_products));
+      for (uint32_t t = 0; t < vec_end; t += 32) {
+        __m256i y = _mm256_loadu_si256((const __m256i*)(ys[j] + t));
+        __m256i product = _mm256_xor_si256(
+          _mm256_shuffle_epi8(low, _mm256_and_si256(y, nibble)),
+          _mm256_shuffle_epi8(high, _mm256_and_si256(_mm256_srli_epi16(y, 4), nibble))
+        );
+        if (j > 0) product = _mm256_xor_si256(product, _mm256_loadu_si256((const __m256i*)(row + t)));
+        _mm256_storeu_si256((__m256i*)(row + t), product);
+      }
+    }
+  }
+  interpolateRangeGf256(k, weights, vec_end, n_blocks, ys, out, stride);
+}
+
+#endif
@@ -0,0 +1,35 @@
+#ifndef KERNELS_H
+#define KERNELS_H
+
+#include "field.h"
+#include <stdint.h>
+
+// Block kernels unrolled for every k (the number of coefficients of a block) from 2 to `KERNEL_MAX_K`, generated by
+// macros in kernels.c, so that the coefficients and weights of a block stay in registers. Larger k get generic kernels
+// looping over `min_shadows`.
+#define KERNEL_MAX_K 8
+
+// Evaluates the polynomials of `n_blocks` consecutive blocks of `min_shadows` coefficients at x = 1..tot_shadows. The
+// share of shadow `j` for block `t` goes to `shares[j * stride + t]`. In GF(257), the coefficients of blocks with a
+// share of 256 are altered until every share fits in a byte.
+typedef void (*ShareKernel)(
+  uint8_t min_shadows, uint8_t tot_shadows, uint32_t n_blocks, uint8_t* coefficients, uint8_t* shares, uint32_t stride
+);
+
+// Computes the `min_shadows` coefficients of a block from its shadow bytes `ys` and the interpolation weights of the
+// shadows (see `fieldInterpolationWeights`).
+typedef void (*InterpolateKernel)(uint8_t min_shadows, const uint32_t* weights, const uint8_t* ys, uint8_t* coefs);
+
+// Interpolates `n_blocks` blocks at once from shadow bytes laid out by shadow, `ys[j][t]` being the byte of shadow `j`
+// for block `t`. Coefficient `i` of block `t` goes to `out[i * stride + t]`.
+typedef void (*InterpolateBatchKernel)(
+  uint8_t min_shadows, const uint32_t* weights, uint32_t n_blocks, const uint8_t* const ys[], uint8_t* out,
+  uint32_t stride
+);
+
+ShareKernel kernelShare(Field field, uint8_t min_shadows);
+InterpolateKernel kernelInterpolate(Field field, uint8_t min_shadows);
+// The AVX2 kernels when the CPU has AVX2, scalar ones giving the same bytes otherwise.
+InterpolateBatchKernel kernelInterpolateBatch(Field field);
+
+#endif
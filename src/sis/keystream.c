@@ -0,0 +1,296 @@
+#define _GNU_SOURCE
+
+#include "keystream.h"
+#include "../utils/utils.h"
+#include "permutation.h"
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Files grow to the end of the request, rounded up to `KEYSTREAM_ROUND` bytes, so a small mask costs no more than
+// generating it. Once they reach `KEYSTREAM_GROWTH` bytes they grow by half their length at least, so that big masks
+// requested a tile at a time only get their file mapped a few times.
+#define KEYSTREAM_ROUND (32u * 1024u)
+#define KEYSTREAM_GROWTH (1u << 20u)
+// Keystream bytes generated, written or checked at a time.
+#define KEYSTREAM_CHUNK (1u << 20u)
+#define KEYSTREAM_MAGIC 0x534B4853u // "SHKS"
+#define KEYSTREAM_VERSION 1
+
+// Followed by the keystream. Fields are in host byte order.
+typedef struct {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t mask;
+  uint64_t seed;
+  uint64_t length; // Keystream bytes written, the file may hold more from a process that didn't finish growing it.
+  uint64_t hash;   // FNV-1a of the `length` keystream bytes.
+} KeystreamHeader;
+
+// Mappings replaced by a longer one. Callers may still be reading them, so they are only unmapped on close.
+typedef struct RetiredMapping {
+  uint8_t* data;
+  uint64_t length;
+  struct RetiredMapping* next;
+} RetiredMapping;
+
+typedef struct KeystreamFile {
+  Mask mask;
+  uint64_t seed;
+  char* path;
+  pthread_mutex_t lock;       // Held while the file grows, requests for other files don't wait for it.
+  int fd;                     // -1 once the file failed, its mask is generated from then on.
+  uint8_t* data;              // Mapping of the header and the first `length` keystream bytes, NULL until the first
+  uint64_t length;            // request.
+  uint64_t hash;              // FNV-1a of the first `length` keystream bytes, checked against the file.
+  RetiredMapping* retired;    //
+  struct KeystreamFile* next; //
+} KeystreamFile;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static char* cache_directory = NULL;
+static KeystreamFile* files = NULL;
+
+static KeystreamFile* findFile(Mask mask, uint64_t seed);
+static bool growFile(KeystreamFile* file, uint64_t end);
+static bool checkFile(KeystreamFile* file, KeystreamHeader* header);
+static bool appendKeystream(KeystreamFile* file, KeystreamHeader* header, uint64_t to);
+static void dropFile(KeystreamFile* file);
+static void retireMapping(KeystreamFile* file);
+
+bool keystreamCacheOpen(const char* directory) {
+  struct stat dir_stat;
+  if (stat(directory, &dir_stat) != 0 || !S_ISDIR(dir_stat.st_mode)) {
+    fprintf(stderr, "Error: '%s' is not a valid directory.\n", directory);
+    return false;
+  }
+  pthread_mutex_lock(&lock);
+  free(cache_directory);
+  cache_directory = strdup(directory);
+  bool ok = cache_directory != NULL;
+  pthread_mutex_unlock(&lock);
+  if (!ok) perror("strdup");
+  return ok;
+}
+
+void keystreamCacheClose(void) {
+  pthread_mutex_lock(&lock);
+  while (files != NULL) {
+    KeystreamFile* file = files;
+    files = file->next;
+    dropFile(file);
+    while (file->retired != NULL) {
+      RetiredMapping* mapping = file->retired;
+      file->retired = mapping->next;
+      munmap(mapping->data, mapping->length);
+      free(mapping);
+    }
+    pthread_mutex_destroy(&file->lock);
+    free(file->path);
+    free(file);
+  }
+  free(cache_directory);
+  cache_directory = NULL;
+  pthread_mutex_unlock(&lock);
+}
+
+// Bytes [offset, offset + size) of the mask for `seed`, read from the cache directory and generated into it first when
+// the file is shorter. Returns NULL without a cache or when the file can't be used, the mask has to be generated then
+// (see `permutationMatrix`). The bytes stay valid until `keystreamCacheClose`.
+const uint8_t* keystreamCached(Mask mask, uint64_t seed, uint64_t offset, uint64_t size) {
+  uint64_t end = offset + size;
+  const uint8_t* keystream = NULL;
+  pthread_mutex_lock(&lock);
+  KeystreamFile* file = cache_directory != NULL && size > 0 ? findFile(mask, seed) : NULL;
+  pthread_mutex_unlock(&lock);
+  if (file == NULL) return NULL;
+  pthread_mutex_lock(&file->lock);
+  if (file->fd >= 0 && (file->length >= end || growFile(file, end))) {
+    keystream = file->data + sizeof(KeystreamHeader) + offset;
+  }
+  pthread_mutex_unlock(&file->lock);
+  return keystream;
+}
+
+// Internal functions
+
+static KeystreamFile* findFile(Mask mask, uint64_t seed) {
+  for (KeystreamFile* file = files; file != NULL; file = file->next) {
+    if (file->mask == mask && file->seed == seed) return file->fd >= 0 ? file : NULL;
+  }
+  KeystreamFile* file = calloc(1, sizeof(KeystreamFile));
+  if (file == NULL) {
+    perror("calloc");
+    return NULL;
+  }
+  char path[4096];
+  snprintf(
+    path, sizeof(path), "%s/%s-%016lx.ks", cache_directory, mask == MASK_CHACHA ? "chacha" : "lcg",
+    (unsigned long)seed
+  );
+  *file = (KeystreamFile){
+    .mask = mask, .seed = seed, .path = strdup(path), .fd = -1, .hash = FNV_OFFSET_BASIS, .next = files
+  };
+  pthread_mutex_init(&file->lock, NULL);
+  files = file;
+  if (file->path != NULL) file->fd = open(path, O_RDWR | O_CREAT, 0644);
+  if (file->fd < 0) {
+    fprintf(stderr, "Warning: Can't open the keystream cache `%s`, generating the mask instead.\n", path);
+    return NULL;
+  }
+  return file;
+}
+
+// Grows the file to at least `end` keystream bytes and maps it again. Other processes may be growing the same file:
+// they append the same bytes, and the file lock keeps anyone from mapping bytes that are still being written. The bytes
+// other processes wrote are checked against the hash in the header first, and a file that doesn't check out is
+// replaced by a new one, generated from the first byte.
+static bool growFile(KeystreamFile* file, uint64_t end) {
+  uint64_t length = file->length >= KEYSTREAM_GROWTH ? file->length + (file->length / 2) : 0;
+  uint64_t rounded = ceilDiv(end, KEYSTREAM_ROUND) * KEYSTREAM_ROUND;
+  if (length < rounded) length = rounded;
+  if (flock(file->fd, LOCK_EX) != 0) {
+    perror("flock");
+    dropFile(file);
+    return false;
+  }
+  KeystreamHeader header;
+  bool ok = checkFile(file, &header);
+  if (!ok && file->fd >= 0) {
+    fprintf(stderr, "Warning: The keystream cache `%s` is corrupt, generating it again.\n", file->path);
+    // Processes that mapped the old file keep reading it, so it is replaced instead of truncated.
+    unlink(file->path);
+    flock(file->fd, LOCK_UN);
+    close(file->fd);
+    retireMapping(file);
+    file->length = 0;
+    file->hash = FNV_OFFSET_BASIS;
+    file->fd = open(file->path, O_RDWR | O_CREAT, 0644);
+    if (file->fd < 0) perror("open");
+    ok = file->fd >= 0 && flock(file->fd, LOCK_EX) == 0 && checkFile(file, &header);
+  }
+  if (ok && header.length > length) length = header.length;
+  ok = ok && appendKeystream(file, &header, length);
+  if (file->fd >= 0) flock(file->fd, LOCK_UN);
+
+  uint64_t map_length = sizeof(KeystreamHeader) + length;
+  void* data = ok ? mmap(NULL, map_length, PROT_READ, MAP_SHARED, file->fd, 0) : MAP_FAILED;
+  if (ok && data == MAP_FAILED) perror("mmap");
+  if (data == MAP_FAILED) {
+    dropFile(file);
+    return false;
+  }
+  retireMapping(file);
+  file->data = data;
+  file->length = length;
+  file->hash = header.hash;
+  return true;
+}
+
+// Reads the header of the file, locked by the caller, into `header`, and checks it against the mask, the seed and the
+// keystream bytes added since `file` was last mapped. An empty file gets a new header. False when the file is corrupt,
+// or with a negative `file->fd` when it can't be read.
+static bool checkFile(KeystreamFile* file, KeystreamHeader* header) {
+  struct stat file_stat;
+  if (fstat(file->fd, &file_stat) != 0) {
+    perror("fstat");
+    dropFile(file);
+    return false;
+  }
+  if (file_stat.st_size == 0) {
+    *header = (KeystreamHeader){
+      .magic = KEYSTREAM_MAGIC,
+      .version = KEYSTREAM_VERSION,
+      .mask = (uint16_t)file->mask,
+      .seed = file->seed,
+      .length = 0,
+      .hash = FNV_OFFSET_BASIS,
+    };
+    return file->length == 0;
+  }
+  if (pread(file->fd, header, sizeof(*header), 0) != sizeof(*header) || header->magic != KEYSTREAM_MAGIC ||
+      header->version != KEYSTREAM_VERSION || header->mask != (uint16_t)file->mask || header->seed != file->seed ||
+      header->length < file->length || sizeof(*header) + header->length > (uint64_t)file_stat.st_size) {
+    return false;
+  }
+  if (header->length == file->length) return header->hash == file->hash;
+
+  uint8_t* chunk = malloc(KEYSTREAM_CHUNK);
+  if (chunk == NULL) {
+    perror("malloc");
+    dropFile(file);
+    return false;
+  }
+  uint64_t hash = file->hash;
+  bool ok = true;
+  for (uint64_t from = file->length; ok && from < header->length;) {
+    uint64_t n = header->length - from < KEYSTREAM_CHUNK ? header->length - from : KEYSTREAM_CHUNK;
+    ok = pread(file->fd, chunk, n, (off_t)(sizeof(*header) + from)) == (ssize_t)n;
+    if (ok) hash = fnv1a(hash, chunk, n);
+    from += n;
+  }
+  free(chunk);
+  return ok && hash == header->hash;
+}
+
+// Generates the keystream bytes [header->length, to), writes them after the ones in the file and then the header
+// covering them.
+static bool appendKeystream(KeystreamFile* file, KeystreamHeader* header, uint64_t to) {
+  if (header->length >= to) return true;
+  uint8_t* chunk = malloc(KEYSTREAM_CHUNK);
+  if (chunk == NULL) {
+    perror("malloc");
+    return false;
+  }
+  bool ok = true;
+  uint64_t from = header->length;
+  while (ok && from < to) {
+    uint64_t n = to - from < KEYSTREAM_CHUNK ? to - from : KEYSTREAM_CHUNK;
+    permutationMatrix(file->mask, file->seed, from, n, chunk);
+    header->hash = fnv1a(header->hash, chunk, n);
+    for (uint64_t done = 0; ok && done < n;) {
+      ssize_t written = pwrite(file->fd, chunk + done, n - done, (off_t)(sizeof(*header) + from + done));
+      ok = written > 0;
+      if (ok) done += written;
+      else perror("pwrite");
+    }
+    from += n;
+  }
+  free(chunk);
+  if (ok) {
+    header->length = to;
+    ok = pwrite(file->fd, header, sizeof(*header), 0) == sizeof(*header);
+    if (!ok) perror("pwrite");
+  }
+  return ok;
+}
+
+// Stops using the file of `file`, generating its mask from then on.
+static void dropFile(KeystreamFile* file) {
+  retireMapping(file);
+  if (file->fd >= 0) close(file->fd);
+  file->fd = -1;
+  file->data = NULL;
+  file->length = 0;
+}
+
+static void retireMapping(KeystreamFile* file) {
+  if (file->data == NULL) return;
+  RetiredMapping* mapping = malloc(sizeof(RetiredMapping));
+  // Without memory to remember it, the mapping is left until the process exits.
+  if (mapping != NULL) {
+    *mapping = (RetiredMapping){
+      .data = file->data, .length = sizeof(KeystreamHeader) + file->length, .next = file->retired
+    };
+    file->retired = mapping;
+  }
+  file->data = NULL;
+}
@@ -0,0 +1,17 @@
+#ifndef KEYSTREAM_H
+#define KEYSTREAM_H
+
+#include "permutation.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+// Masks kept on disk across runs, for deployments where the same seeds keep coming back. Every mask and seed gets a
+// file in the cache directory holding its keystream from the first byte on, grown to the longest length requested so
+// far, after a header with the mask, the seed and a hash of the keystream that is checked before the file is used.
+// Files are mapped, so masking from the cache is a XOR with memory shared by every process using it. The LCG mask is
+// generated serially, a hit saves a whole pass over it.
+bool keystreamCacheOpen(const char* directory);
+void keystreamCacheClose(void);
+const uint8_t* keystreamCached(Mask mask, uint64_t seed, uint64_t offset, uint64_t size);
+
+#endif
@@ -1,24 +1,33 @@
+#include "permutation.h"
 #include <stdint.h>
+#include <string.h>
 
-static uint64_t _seed;
+#define LCG_MUL 0x5DEECE66Dlu
+#define LCG_ADD 0xBlu
+#define LCG_BITS ((1llu << 48u) - 1)
 
-void setSeed(uint64_t seed) {
-  _seed = (seed ^ 0x5DEECE66Dlu) & ((1llu << 48u) - 1);
-}
+#define CHACHA_ROUNDS 8
+#define CHACHA_BLOCK 64
+// Blocks computed at once. Every step of a round is done on the same word of all the blocks, which compilers turn
+// into SIMD instructions.
+#define CHACHA_LANES 8
 
-uint8_t nextChar() {
-  _seed = (_seed * 0x5DEECE66DL + 0xBL) & ((1llu << 48u) - 1);
-  return (uint8_t)(_seed >> 40u);
-}
+static uint64_t initialState(uint64_t seed);
+static uint64_t lcgSkip(uint64_t state, uint64_t steps);
+static uint8_t nextChar(uint64_t* state);
+static void lcgMask(uint64_t seed, uint64_t offset, uint64_t size, uint8_t* matrix);
+static void chachaMask(uint64_t seed, uint64_t offset, uint64_t size, uint8_t* matrix);
+static void chachaBlocks(uint64_t seed, uint64_t first_block, uint8_t out[CHACHA_LANES * CHACHA_BLOCK]);
 
-void permutationMatrix(uint32_t size, uint8_t* matrix) {
-  for (uint32_t i = 0; i < size; ++i) {
-    matrix[i] = nextChar();
-  }
+// Writes the bytes [offset, offset + size) of the mask for `seed` to `matrix`. The generator state is local to every
+// call, so several threads can generate permutation matrices at once.
+void permutationMatrix(Mask mask, uint64_t seed, uint64_t offset, uint64_t size, uint8_t* matrix) {
+  if (mask == MASK_CHACHA) chachaMask(seed, offset, size, matrix);
+  else lcgMask(seed, offset, size, matrix);
 }
 
-void xorMatrixes(uint32_t size, uint8_t* dest, const uint8_t* other) {
-  for (uint32_t i = 0; i < size; ++i) dest[i] ^= other[i];
+void xorMatrixes(uint64_t size, uint8_t* dest, const uint8_t* other) {
+  for (uint64_t i = 0; i < size; ++i) dest[i] ^= other[i];
 
   // TODO: Try this and test that it works in pampero.
   // This uses AVX2 (Advanced Vector Extensions 2) to process 32 bytes in a single instruction!
@@ -33,3 +42,108 @@ void xorMatrixes(uint32_t size, uint8_t* dest, const uint8_t* other) {
   //     dst[i] = a[i] ^ b[i];
   // }
 }
+
+// Internal functions
+
+static uint64_t initialState(uint64_t seed) {
+  return (seed ^ LCG_MUL) & LCG_BITS;
+}
+
+// Advances `state` by `steps` steps in O(log steps), squaring the affine step x -> mul * x + add.
+static uint64_t lcgSkip(uint64_t state, uint64_t steps) {
+  uint64_t mul = 1;
+  uint64_t add = 0;
+  uint64_t step_mul = LCG_MUL;
+  uint64_t step_add = LCG_ADD;
+  for (; steps > 0; steps >>= 1u) {
+    if (steps & 1u) {
+      mul *= step_mul;
+      add = (add * step_mul) + step_add;
+    }
+    step_add *= step_mul + 1;
+    step_mul *= step_mul;
+  }
+  return ((mul * state) + add) & LCG_BITS;
+}
+
+static uint8_t nextChar(uint64_t* state) {
+  *state = (*state * LCG_MUL + LCG_ADD) & LCG_BITS;
+  return (uint8_t)(*state >> 40u);
+}
+
+static void lcgMask(uint64_t seed, uint64_t offset, uint64_t size, uint8_t* matrix) {
+  uint64_t state = lcgSkip(initialState(seed), offset);
+  for (uint64_t i = 0; i < size; ++i) {
+    matrix[i] = nextChar(&state);
+  }
+}
+
+static void chachaMask(uint64_t seed, uint64_t offset, uint64_t size, uint8_t* matrix) {
+  uint8_t blocks[CHACHA_LANES * CHACHA_BLOCK];
+  uint64_t block = offset / CHACHA_BLOCK;
+  uint32_t skip = offset % CHACHA_BLOCK;
+  while (size > 0) {
+    chachaBlocks(seed, block, blocks);
+    uint64_t n = sizeof(blocks) - skip;
+    if (n > size) n = size;
+    memcpy(matrix, blocks + skip, n);
+    matrix += n;
+    size -= n;
+    skip = 0;
+    block += CHACHA_LANES;
+  }
+}
+
+#define ROTL(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+#define QUARTER_ROUND(x, a, b, c, d)                                                                                   \
+  for (int l = 0; l < CHACHA_LANES; ++l) {                                                                             \
+    x[a][l] += x[b][l];                                                                                                \
+    x[d][l] = ROTL(x[d][l] ^ x[a][l], 16);                                                                             \
+    x[c][l] += x[d][l];                                                                                                \
+    x[b][l] = ROTL(x[b][l] ^ x[c][l], 12);                                                                             \
+    x[a][l] += x[b][l];                                                                                                \
+    x[d][l] = ROTL(x[d][l] ^ x[a][l], 8);                                                                              \
+    x[c][l] += x[d][l];                                                                                                \
+    x[b][l] = ROTL(x[b][l] ^ x[c][l], 7);                                                                              \
+  }
+
+// ChaCha blocks `first_block` to `first_block + CHACHA_LANES - 1`, keyed by `seed` with a zero nonce. The block index
+// is the 64-bit counter.
+static void chachaBlocks(uint64_t seed, uint64_t first_block, uint8_t out[CHACHA_LANES * CHACHA_BLOCK]) {
+  static const uint32_t sigma[4] = {0x61707865u, 0x3320646Eu, 0x79622D32u, 0x6B206574u}; // "expand 32-byte k"
+  uint32_t input[16][CHACHA_LANES];
+  uint32_t x[16][CHACHA_LANES];
+  for (int l = 0; l < CHACHA_LANES; ++l) {
+    uint64_t counter = first_block + l;
+    for (int i = 0; i < 4; ++i) input[i][l] = sigma[i];
+    input[4][l] = (uint32_t)seed;
+    input[5][l] = (uint32_t)(seed >> 32u);
+    for (int i = 6; i < 12; ++i) input[i][l] = 0;
+    input[12][l] = (uint32_t)counter;
+    input[13][l] = (uint32_t)(counter >> 32u);
+    input[14][l] = 0;
+    input[15][l] = 0;
+  }
+  memcpy(x, input, sizeof(x));
+  for (int r = 0; r < CHACHA_ROUNDS; r += 2) {
+    QUARTER_ROUND(x, 0, 4, 8, 12);
+    QUARTER_ROUND(x, 1, 5, 9, 13);
+    QUARTER_ROUND(x, 2, 6, 10, 14);
+    QUARTER_ROUND(x, 3, 7, 11, 15);
+    QUARTER_ROUND(x, 0, 5, 10, 15);
+    QUARTER_ROUND(x, 1, 6, 11, 12);
+    QUARTER_ROUND(x, 2, 7, 8, 13);
+    QUARTER_ROUND(x, 3, 4, 9, 14);
+  }
+  // Little-endian output, whatever the host byte order.
+  for (int l = 0; l < CHACHA_LANES; ++l) {
+    uint8_t* block = out + (l * CHACHA_BLOCK);
+    for (int i = 0; i < 16; ++i) {
+      uint32_t word = x[i][l] + input[i][l];
+      block[4 * i] = word;
+      block[(4 * i) + 1] = word >> 8u;
+      block[(4 * i) + 2] = word >> 16u;
+      block[(4 * i) + 3] = word >> 24u;
+    }
+  }
+}
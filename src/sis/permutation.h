@@ -3,8 +3,15 @@
 
 #include <stdint.h>
 
-void setSeed(uint64_t seed);
-void permutationMatrix(uint32_t size, uint8_t* matrix);
-void xorMatrixes(uint32_t size, uint8_t* dest, const uint8_t* other);
+// Masks the secret is XORed with before it is shared. The LCG mask takes a 16-bit seed and generates a byte per step.
+// The ChaCha mask is the keystream of ChaCha8 in counter mode keyed by a 64-bit seed: 64 bytes per block, computed
+// from the block index alone, so any range of it is generated without the bytes before it.
+typedef enum Mask {
+  MASK_LCG = 0,
+  MASK_CHACHA = 1,
+} Mask;
+
+void permutationMatrix(Mask mask, uint64_t seed, uint64_t offset, uint64_t size, uint8_t* matrix);
+void xorMatrixes(uint64_t size, uint8_t* dest, const uint8_t* other);
 
 #endif
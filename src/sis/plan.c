@@ -0,0 +1,707 @@
+#include "plan.h"
+#include "../bmp/bmp.h"
+#include "../utils/utils.h"
+#include "delta.h"
+#include "scan.h"
+#include "sidecar.h"
+#include "sis.h"
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+// Streamed groups are computed at least this many shadow bytes at a time, every carrier holding a window of 8 times as
+// many pixel bytes. Chunks are multiples of it.
+#define MIN_CHUNK_SIZE 4096
+
+// Outputs that are carriers of the batch are written next to their final path with this suffix, and renamed once
+// every shadow is written.
+#define STAGED_SUFFIX ".tmp"
+
+static void sortBySizeDesc(uint32_t n_secrets, const uint64_t shadow_sizes[n_secrets], uint32_t order[n_secrets]);
+static bool pickCarriers(
+  const CarrierList* carriers, uint64_t shadow_size, uint8_t tot_shadows, const uint32_t usage[], bool exclusive,
+  uint32_t picked[tot_shadows]
+);
+static uint64_t groupCapacity(const CarrierList* carriers, uint8_t tot_shadows, const uint32_t picked[tot_shadows]);
+static uint64_t groupDirtySize(const Plan* plan, uint32_t group);
+static bool groupPath(
+  char* path, size_t path_len, const Plan* plan, uint32_t group, const char* directory_out,
+  const char* secret_filename, int shadow
+);
+static bool* stagedOutputs(
+  const Plan* plan, const CarrierList* carriers, const char* const secret_filenames[], const char* directory_out,
+  bool deltas
+);
+static bool commitOutputs(
+  const Plan* plan, const bool staged[], const char* const secret_filenames[], const char* directory_out, bool ok
+);
+static uint64_t cachedMemory(const Plan* plan, const CarrierList* carriers, uint8_t min_shadows, uint32_t* held);
+static uint64_t streamedMemory(const Plan* plan, uint8_t min_shadows, uint64_t chunk_size);
+static bool streamGroup(
+  const Plan* plan, uint32_t group, const CarrierList* carriers, const char* const secret_filenames[],
+  uint8_t min_shadows, uint64_t seed, Field field, Mask mask, const char* directory_out, const SisEngine* engine,
+  const bool staged[]
+);
+
+// Every group gets `tot_shadows` distinct carriers. Carriers may be reused by several groups since each group
+// writes its own output files. The cost of a shadow is the size of the carrier it is written to, so the smallest
+// carriers that fit are preferred, and among equally sized carriers one that is already used by another group is
+// picked, so that it is read only once for the whole batch. When distributing `in_place` every carrier is used once.
+// Secrets are placed biggest first. Without `pack` every secret is a group of its own. With `pack` this is a first
+// fit decreasing bin packing: a secret goes to the first group with enough room left, and new groups are opened on
+// carriers big enough for as many of the remaining secrets as possible.
+Plan* planAssign(
+  const CarrierList* carriers, uint32_t n_secrets, const uint64_t shadow_sizes[n_secrets], uint8_t tot_shadows,
+  bool pack, bool in_place
+) {
+  Plan* plan = calloc(1, sizeof(Plan));
+  uint32_t* usage = calloc(carriers->count + 1, sizeof(uint32_t));
+  uint32_t* group_of = malloc((n_secrets + 1) * sizeof(uint32_t));
+  uint64_t* group_used = malloc((n_secrets + 1) * sizeof(uint64_t));
+  uint64_t* group_capacity = malloc((n_secrets + 1) * sizeof(uint64_t));
+  uint32_t* sorted = malloc((n_secrets + 1) * sizeof(uint32_t));
+  bool ok = plan != NULL && usage != NULL && group_of != NULL && group_used != NULL && group_capacity != NULL &&
+            sorted != NULL;
+  if (ok) {
+    plan->n_secrets = n_secrets;
+    plan->tot_shadows = tot_shadows;
+    plan->packed = pack;
+    plan->in_place = in_place;
+    plan->shadow_sizes = malloc(n_secrets * sizeof(uint64_t));
+    plan->order = malloc(n_secrets * sizeof(uint32_t));
+    plan->group_start = malloc((n_secrets + 1) * sizeof(uint32_t));
+    plan->assignment = malloc((size_t)n_secrets * tot_shadows * sizeof(uint32_t));
+    ok = plan->shadow_sizes != NULL && plan->order != NULL && plan->group_start != NULL && plan->assignment != NULL;
+  }
+  if (!ok) perror("malloc");
+  else {
+    memcpy(plan->shadow_sizes, shadow_sizes, n_secrets * sizeof(uint64_t));
+    sortBySizeDesc(n_secrets, shadow_sizes, sorted);
+  }
+
+  for (uint32_t i = 0; ok && i < n_secrets; ++i) {
+    uint32_t s = sorted[i];
+    uint32_t g = 0;
+    while (pack && g < plan->n_groups && group_used[g] + shadow_sizes[s] > group_capacity[g]) ++g;
+    if (pack && g < plan->n_groups) {
+      group_of[s] = g;
+      group_used[g] += shadow_sizes[s];
+      continue;
+    }
+
+    g = plan->n_groups;
+    uint32_t* picked = &plan->assignment[(size_t)g * tot_shadows];
+    // Try to make room for all the remaining secrets, then for fewer and fewer of them.
+    uint32_t remaining = pack ? n_secrets - i : 1;
+    bool found = false;
+    while (!found && remaining > 0) {
+      uint64_t wanted = 0;
+      for (uint32_t r = i; r < i + remaining; ++r) wanted += shadow_sizes[sorted[r]];
+      found = pickCarriers(carriers, wanted, tot_shadows, usage, in_place, picked);
+      --remaining;
+    }
+    if (!found) {
+      fprintf(
+        stderr, "planAssign: Not enough carriers for secret %u. Need %u carriers that can hide %lu bytes each.\n", s,
+        tot_shadows, (unsigned long)shadow_sizes[s]
+      );
+      ok = false;
+      break;
+    }
+    for (int j = 0; j < tot_shadows; ++j) {
+      if (usage[picked[j]]++ == 0) ++plan->carriers_used;
+    }
+    group_of[s] = g;
+    group_used[g] = shadow_sizes[s];
+    group_capacity[g] = groupCapacity(carriers, tot_shadows, picked);
+    ++plan->n_groups;
+  }
+
+  if (ok) {
+    // Lay the secrets out group by group, keeping them biggest first inside every group.
+    uint32_t next = 0;
+    for (uint32_t g = 0; g < plan->n_groups; ++g) {
+      plan->bytes_written += (uint64_t)tot_shadows * 8 * group_used[g];
+      plan->group_start[g] = next;
+      for (uint32_t i = 0; i < n_secrets; ++i) {
+        if (group_of[sorted[i]] == g) plan->order[next++] = sorted[i];
+      }
+    }
+    plan->group_start[plan->n_groups] = next;
+  }
+
+  free(usage);
+  free(group_of);
+  free(group_used);
+  free(group_capacity);
+  free(sorted);
+  if (!ok) {
+    planFree(plan);
+    return NULL;
+  }
+  return plan;
+}
+
+// Picks how the plan runs so that it fits in `max_memory` bytes, without a limit if 0. Carriers are loaded whole and
+// kept for all their groups when that fits, which reads every carrier once. Otherwise every group is streamed: its
+// shadows are computed a chunk at a time from windows of the secrets and of the carriers, with the biggest chunks that
+// fit, and every chunk is written out before the next one is read. When even the smallest chunks don't fit, fewer
+// workers are used. With a budget but no workers asked for, a thread per CPU is started. Carriers patched in place may
+// have to be rewritten whole, and sidecars are extracted from whole carriers, so neither can be streamed.
+bool planSchedule(
+  Plan* plan, const CarrierList* carriers, uint8_t min_shadows, uint64_t max_memory, bool sidecars, bool deltas,
+  uint32_t processes, uint32_t threads
+) {
+  if (max_memory > 0 && processes <= 1 && threads == 0) {
+    long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    threads = n_cpus > 1 ? n_cpus : 1;
+  }
+  bool streamable = !plan->in_place && !sidecars && !deltas;
+  uint64_t max_span = 0;
+  for (uint32_t g = 0; g < plan->n_groups; ++g) {
+    if (groupDirtySize(plan, g) / 8 > max_span) max_span = groupDirtySize(plan, g) / 8;
+  }
+  uint64_t max_chunks = ceilDiv(max_span, MIN_CHUNK_SIZE);
+  if (max_chunks == 0) max_chunks = 1;
+  plan->max_memory = max_memory;
+
+  while (true) {
+    plan->processes = processes;
+    plan->threads = threads;
+    plan->chunk_size = 0;
+    plan->peak_memory = cachedMemory(plan, carriers, min_shadows, &plan->carriers_held);
+    if (max_memory == 0 || plan->peak_memory <= max_memory) return true;
+    uint64_t smallest = streamedMemory(plan, min_shadows, MIN_CHUNK_SIZE);
+    if (streamable && smallest <= max_memory) {
+      // The memory taken only grows with the chunks.
+      uint64_t low = 1;
+      uint64_t high = max_chunks;
+      while (low < high) {
+        uint64_t mid = low + ((high - low + 1) / 2);
+        if (streamedMemory(plan, min_shadows, mid * MIN_CHUNK_SIZE) <= max_memory) low = mid;
+        else high = mid - 1;
+      }
+      plan->chunk_size = low * MIN_CHUNK_SIZE;
+      plan->carriers_held = plan->tot_shadows;
+      plan->peak_memory = streamedMemory(plan, min_shadows, plan->chunk_size);
+      return true;
+    }
+    if (processes > 1) processes /= 2;
+    else if (threads > 1) threads /= 2;
+    else {
+      uint64_t needed = (streamable && smallest < plan->peak_memory) ? smallest : plan->peak_memory;
+      fprintf(
+        stderr, "planSchedule: The batch needs at least %lu MiB, more than the %lu MiB allowed%s.\n",
+        (unsigned long)ceilDiv(needed, 1024 * 1024), (unsigned long)(max_memory / (1024 * 1024)),
+        streamable ? "" : " (carriers can't be streamed in place nor with sidecars or deltas)"
+      );
+      return false;
+    }
+  }
+}
+
+void planPrint(const Plan* plan, const CarrierList* carriers, const char* const secret_filenames[]) {
+  printf("=== Distribution plan ===\n");
+  for (uint32_t g = 0; g < plan->n_groups; ++g) {
+    printf("Group %u:\n", g);
+    for (uint32_t i = plan->group_start[g]; i < plan->group_start[g + 1]; ++i) {
+      uint32_t s = plan->order[i];
+      printf(
+        "  secret `%s` (shadow size %lu bytes, index %u)\n", secret_filenames[s], (unsigned long)plan->shadow_sizes[s],
+        i - plan->group_start[g]
+      );
+    }
+    for (int j = 0; j < plan->tot_shadows; ++j) {
+      const CarrierInfo* info = &carriers->carriers[plan->assignment[((size_t)g * plan->tot_shadows) + j]];
+      printf("  shadow %3d -> `%s` (capacity %lu bytes)\n", j, info->path, (unsigned long)info->capacity);
+    }
+  }
+  printf("Carriers read:       %u\n", plan->carriers_used);
+  printf("Pixel bytes written: %lu\n", (unsigned long)plan->bytes_written);
+  if (plan->max_memory > 0) printf("Memory budget:       %lu bytes\n", (unsigned long)plan->max_memory);
+  if (plan->chunk_size == 0) printf("Execution:           in memory, carriers loaded whole\n");
+  else printf("Execution:           streamed, %lu shadow bytes per chunk\n", (unsigned long)plan->chunk_size);
+  printf("Carriers held:       %u\n", plan->carriers_held);
+  if (plan->processes > 1) printf("Workers:             %u processes\n", plan->processes);
+  else if (plan->threads > 1) printf("Workers:             %u threads\n", plan->threads);
+  else printf("Workers:             1 thread\n");
+  printf("Estimated peak:      %lu bytes\n", (unsigned long)plan->peak_memory);
+}
+
+// Each carrier is parsed once for the whole batch and freed after its last use. Since only the first
+// `8 * shadow_size` pixel bytes of a carrier are modified, the biggest span any of its groups modifies is saved the
+// first time a carrier is used, and the span the previous group modified is restored from it before the carrier is
+// reused, so no shadow leaks into the output of another group.
+// With `sidecars`, the sidecar of every shadow is written next to it, and with `deltas` every shadow is written as a
+// delta of its carrier (see `deltaWrite`). The shares are computed by `engine`, and with several threads the images
+// are spread over the NUMA nodes to match the slices each node computes. Streamed plans go through `streamGroup`
+// instead (see `planSchedule`). Outputs that are also carriers of the batch are staged (see `stagedOutputs`).
+bool planExecute(
+  const Plan* plan, const CarrierList* carriers, const char* const secret_filenames[], uint8_t min_shadows,
+  uint64_t seed, Field field, Mask mask, const char* directory_out, bool sidecars, bool deltas,
+  const SisEngine* engine
+) {
+  bool* staged = stagedOutputs(plan, carriers, secret_filenames, directory_out, deltas);
+  if (staged == NULL) return false;
+  if (plan->chunk_size > 0) {
+    bool ok = true;
+    for (uint32_t g = 0; ok && g < plan->n_groups; ++g) {
+      ok = streamGroup(
+        plan, g, carriers, secret_filenames, min_shadows, seed, field, mask, directory_out, engine,
+        &staged[(size_t)g * plan->tot_shadows]
+      );
+    }
+    ok = commitOutputs(plan, staged, secret_filenames, directory_out, ok);
+    free(staged);
+    return ok;
+  }
+
+  uint32_t n_carriers = carriers->count;
+  BMP* loaded = calloc(n_carriers + 1, sizeof(BMP));
+  uint8_t** pristine = calloc(n_carriers + 1, sizeof(uint8_t*));
+  uint64_t* pristine_size = calloc(n_carriers + 1, sizeof(uint64_t));
+  uint32_t* last_use = calloc(n_carriers + 1, sizeof(uint32_t));
+  bool ok = loaded != NULL && pristine != NULL && pristine_size != NULL && last_use != NULL;
+  if (!ok) perror("calloc");
+  bool spread = engine != NULL && engine->pool == NULL && engine->threads > 1;
+
+  for (uint32_t g = 0; ok && g < plan->n_groups; ++g) {
+    const uint32_t* assigned = &plan->assignment[(size_t)g * plan->tot_shadows];
+    uint64_t dirty_size = groupDirtySize(plan, g);
+    for (int j = 0; j < plan->tot_shadows; ++j) {
+      last_use[assigned[j]] = g;
+      if (dirty_size > pristine_size[assigned[j]]) pristine_size[assigned[j]] = dirty_size;
+    }
+  }
+
+  for (uint32_t g = 0; ok && g < plan->n_groups; ++g) {
+    const uint32_t* assigned = &plan->assignment[(size_t)g * plan->tot_shadows];
+    uint32_t first = plan->group_start[g];
+    uint32_t n_group_secrets = plan->group_start[g + 1] - first;
+    BMP shadow_bmps[plan->tot_shadows];
+
+    for (int j = 0; ok && j < plan->tot_shadows; ++j) {
+      uint32_t c = assigned[j];
+      if (loaded[c] == NULL) {
+        printf("parsing bmp: `%s`...\n", carriers->carriers[c].path);
+        loaded[c] = spread ? bmpParseSpread(carriers->carriers[c].path, pristine_size[c])
+                           : bmpParse(carriers->carriers[c].path);
+        if (loaded[c] == NULL) {
+          fprintf(stderr, "Error parsing bmp `%s`\n", carriers->carriers[c].path);
+          ok = false;
+          break;
+        }
+        if (last_use[c] > g) {
+          pristine[c] = malloc(pristine_size[c]);
+          if (pristine[c] == NULL) {
+            perror("malloc");
+            ok = false;
+            break;
+          }
+          memcpy(pristine[c], bmpImage(loaded[c]), pristine_size[c]);
+        }
+      } else {
+        uint64_t dirty_from;
+        uint64_t dirty_to;
+        bmpDirtyRange(loaded[c], &dirty_from, &dirty_to);
+        if (dirty_to > pristine_size[c]) dirty_to = pristine_size[c];
+        if (dirty_from < dirty_to) {
+          memcpy(bmpImage(loaded[c]) + dirty_from, pristine[c] + dirty_from, dirty_to - dirty_from);
+        }
+        bmpMarkClean(loaded[c]);
+      }
+      shadow_bmps[j] = loaded[c];
+    }
+
+    BMP secrets[n_group_secrets];
+    uint8_t group_min_shadows[n_group_secrets];
+    uint64_t seeds[n_group_secrets];
+    uint32_t n_parsed = 0;
+    for (uint32_t i = 0; ok && i < n_group_secrets; ++i) {
+      const char* secret_filename = secret_filenames[plan->order[first + i]];
+      printf("parsing secret: `%s`...\n", secret_filename);
+      secrets[i] = spread ? bmpParseSpread(secret_filename, UINT64_MAX) : bmpParse(secret_filename);
+      if (secrets[i] == NULL) {
+        fprintf(stderr, "Error parsing bmp `%s`\n", secret_filename);
+        ok = false;
+        break;
+      }
+      group_min_shadows[i] = min_shadows;
+      seeds[i] = seed;
+      ++n_parsed;
+    }
+
+    if (ok && n_group_secrets == 1) {
+      ok = sisShadows(secrets[0], min_shadows, plan->tot_shadows, shadow_bmps, seed, field, mask, engine);
+    } else if (ok) {
+      ok = sisShadowsPacked(
+        n_group_secrets, secrets, group_min_shadows, seeds, plan->tot_shadows, shadow_bmps, field, mask, engine
+      );
+    }
+    for (uint32_t i = 0; i < n_parsed; ++i) bmpFree(secrets[i]);
+
+    // Only the header and the modified pixels are written, the rest is cloned from the carrier file.
+    for (int j = 0; ok && j < plan->tot_shadows; ++j) {
+      const char* carrier_path = carriers->carriers[assigned[j]].path;
+      char full_path[4096];
+      if (plan->in_place) snprintf(full_path, sizeof(full_path), "%s", carrier_path);
+      else {
+        const char* secret_filename = secret_filenames[plan->order[first]];
+        ok = groupPath(full_path, sizeof(full_path), plan, g, directory_out, secret_filename, j);
+      }
+      if (!ok) break;
+      if (deltas) {
+        char delta_path[4096 + sizeof(DELTA_SUFFIX)];
+        snprintf(delta_path, sizeof(delta_path), "%s%s", full_path, DELTA_SUFFIX);
+        printf("Saving `%s`...\n", delta_path);
+        ok = deltaWrite(delta_path, shadow_bmps[j], carrier_path);
+      } else if (staged[((size_t)g * plan->tot_shadows) + j]) {
+        char staged_path[4096 + sizeof(STAGED_SUFFIX)];
+        snprintf(staged_path, sizeof(staged_path), "%s%s", full_path, STAGED_SUFFIX);
+        printf("Saving `%s`...\n", staged_path);
+        ok = bmpPatchFile(staged_path, carrier_path, shadow_bmps[j]) == 0;
+      } else {
+        printf("Saving `%s`...\n", full_path);
+        ok = bmpPatchFile(full_path, carrier_path, shadow_bmps[j]) == 0;
+      }
+      if (ok && sidecars) {
+        char sidecar_path[4096 + sizeof(SIDECAR_SUFFIX)];
+        snprintf(sidecar_path, sizeof(sidecar_path), "%s%s", full_path, SIDECAR_SUFFIX);
+        printf("Saving `%s`...\n", sidecar_path);
+        ok = sidecarWrite(sidecar_path, shadow_bmps[j], min_shadows);
+      }
+    }
+
+    for (int j = 0; j < plan->tot_shadows; ++j) {
+      uint32_t c = assigned[j];
+      if (last_use[c] == g && loaded[c] != NULL) {
+        bmpFree(loaded[c]);
+        loaded[c] = NULL;
+        free(pristine[c]);
+        pristine[c] = NULL;
+      }
+    }
+  }
+
+  for (uint32_t c = 0; loaded != NULL && pristine != NULL && c < n_carriers; ++c) {
+    bmpFree(loaded[c]);
+    free(pristine[c]);
+  }
+  ok = commitOutputs(plan, staged, secret_filenames, directory_out, ok);
+  free(staged);
+  free((void*)loaded);
+  free((void*)pristine);
+  free(pristine_size);
+  free(last_use);
+  return ok;
+}
+
+void planFree(Plan* plan) {
+  if (plan == NULL) return;
+  free(plan->shadow_sizes);
+  free(plan->order);
+  free(plan->group_start);
+  free(plan->assignment);
+  free(plan);
+}
+
+// Internal functions
+
+static void sortBySizeDesc(uint32_t n_secrets, const uint64_t shadow_sizes[n_secrets], uint32_t order[n_secrets]) {
+  // Insertion sort, batches are small and this keeps equally sized secrets in their original order.
+  for (uint32_t i = 0; i < n_secrets; ++i) {
+    uint32_t j = i;
+    while (j > 0 && shadow_sizes[order[j - 1]] < shadow_sizes[i]) {
+      order[j] = order[j - 1];
+      --j;
+    }
+    order[j] = i;
+  }
+}
+
+static bool pickCarriers(
+  const CarrierList* carriers, uint64_t shadow_size, uint8_t tot_shadows, const uint32_t usage[], bool exclusive,
+  uint32_t picked[tot_shadows]
+) {
+  bool taken[carriers->count + 1];
+  memset(taken, 0, sizeof(taken));
+  for (int j = 0; j < tot_shadows; ++j) {
+    uint32_t best = UINT32_MAX;
+    for (uint32_t c = 0; c < carriers->count; ++c) {
+      const CarrierInfo* info = &carriers->carriers[c];
+      if (taken[c] || info->capacity < shadow_size || (exclusive && usage[c] > 0)) continue;
+      if (best == UINT32_MAX || info->image_size < carriers->carriers[best].image_size ||
+          (info->image_size == carriers->carriers[best].image_size && usage[c] > usage[best])) {
+        best = c;
+      }
+    }
+    if (best == UINT32_MAX) return false;
+    taken[best] = true;
+    picked[j] = best;
+  }
+  return true;
+}
+
+static uint64_t groupCapacity(const CarrierList* carriers, uint8_t tot_shadows, const uint32_t picked[tot_shadows]) {
+  uint64_t capacity = UINT64_MAX;
+  for (int j = 0; j < tot_shadows; ++j) {
+    if (carriers->carriers[picked[j]].capacity < capacity) capacity = carriers->carriers[picked[j]].capacity;
+  }
+  return capacity;
+}
+
+static uint64_t groupDirtySize(const Plan* plan, uint32_t group) {
+  uint64_t dirty_size = 0;
+  for (uint32_t i = plan->group_start[group]; i < plan->group_start[group + 1]; ++i) {
+    dirty_size += 8 * plan->shadow_sizes[plan->order[i]];
+  }
+  return dirty_size;
+}
+
+static bool groupPath(
+  char* path, size_t path_len, const Plan* plan, uint32_t group, const char* directory_out,
+  const char* secret_filename, int shadow
+) {
+  if (plan->n_groups == 1) {
+    snprintf(path, path_len, "%s/shadow-%03d.bmp", directory_out, shadow);
+    return true;
+  }
+
+  // Batches write the shadows of each group to their own sub-directory, named after the secret, or after the group
+  // when packing.
+  char base[path_len];
+  if (plan->packed) snprintf(base, path_len, "pack-%03u", group);
+  else fileStem(base, path_len, secret_filename);
+  snprintf(path, path_len, "%s/%s", directory_out, base);
+  if (mkdir(path, 0755) != 0 && errno != EEXIST) {
+    perror("mkdir");
+    return false;
+  }
+  snprintf(path, path_len, "%s/%s/shadow-%03d.bmp", directory_out, base, shadow);
+  return true;
+}
+
+// Marks the outputs that already exist as one of the carriers of the batch. Writing them in place would clone other
+// shadows from a carrier that was overwritten, or lose a carrier that a later group still reads, so they are written
+// to their path with `STAGED_SUFFIX` instead and only renamed over the carriers by `commitOutputs`. Nothing is staged
+// when distributing in place nor with deltas, which don't write over their path. Fails with NULL.
+static bool* stagedOutputs(
+  const Plan* plan, const CarrierList* carriers, const char* const secret_filenames[], const char* directory_out,
+  bool deltas
+) {
+  size_t n_outputs = (size_t)plan->n_groups * plan->tot_shadows;
+  bool* staged = calloc(n_outputs + 1, sizeof(bool));
+  dev_t* devs = malloc((carriers->count + 1) * sizeof(dev_t));
+  ino_t* inos = malloc((carriers->count + 1) * sizeof(ino_t));
+  bool ok = staged != NULL && devs != NULL && inos != NULL;
+  if (!ok) perror("malloc");
+  uint32_t n_ids = 0;
+  for (uint32_t c = 0; ok && !plan->in_place && !deltas && c < carriers->count; ++c) {
+    struct stat carrier_stat;
+    if (stat(carriers->carriers[c].path, &carrier_stat) != 0) continue;
+    devs[n_ids] = carrier_stat.st_dev;
+    inos[n_ids++] = carrier_stat.st_ino;
+  }
+  for (uint32_t g = 0; ok && n_ids > 0 && g < plan->n_groups; ++g) {
+    const char* secret_filename = secret_filenames[plan->order[plan->group_start[g]]];
+    for (int j = 0; ok && j < plan->tot_shadows; ++j) {
+      char path[4096];
+      struct stat output_stat;
+      ok = groupPath(path, sizeof(path), plan, g, directory_out, secret_filename, j);
+      if (!ok || stat(path, &output_stat) != 0) continue;
+      for (uint32_t c = 0; c < n_ids; ++c) {
+        if (output_stat.st_dev == devs[c] && output_stat.st_ino == inos[c]) {
+          staged[((size_t)g * plan->tot_shadows) + j] = true;
+          break;
+        }
+      }
+    }
+  }
+  free(devs);
+  free(inos);
+  if (!ok) {
+    free(staged);
+    return NULL;
+  }
+  return staged;
+}
+
+// Renames the staged outputs over their paths when every shadow was written, `ok`, and removes them otherwise, leaving
+// the carriers untouched.
+static bool commitOutputs(
+  const Plan* plan, const bool staged[], const char* const secret_filenames[], const char* directory_out, bool ok
+) {
+  bool committed = ok;
+  for (uint32_t g = 0; g < plan->n_groups; ++g) {
+    const char* secret_filename = secret_filenames[plan->order[plan->group_start[g]]];
+    for (int j = 0; j < plan->tot_shadows; ++j) {
+      if (!staged[((size_t)g * plan->tot_shadows) + j]) continue;
+      char path[4096];
+      char staged_path[4096 + sizeof(STAGED_SUFFIX)];
+      if (!groupPath(path, sizeof(path), plan, g, directory_out, secret_filename, j)) {
+        committed = false;
+        continue;
+      }
+      snprintf(staged_path, sizeof(staged_path), "%s%s", path, STAGED_SUFFIX);
+      if (ok && rename(staged_path, path) != 0) {
+        perror("rename");
+        committed = false;
+      } else if (!ok) unlink(staged_path);
+    }
+  }
+  return committed;
+}
+
+// Memory held at once by `planExecute` when carriers are loaded whole: the carriers of every group stay in memory
+// from their first group to their last, along with their pristine pixels when they are reused, and the secrets of a
+// group are loaded whole. Fails with UINT64_MAX.
+static uint64_t cachedMemory(const Plan* plan, const CarrierList* carriers, uint8_t min_shadows, uint32_t* held) {
+  uint32_t n_carriers = carriers->count;
+  uint32_t* first_use = malloc((n_carriers + 1) * sizeof(uint32_t));
+  uint32_t* last_use = calloc(n_carriers + 1, sizeof(uint32_t));
+  uint64_t* pristine_size = calloc(n_carriers + 1, sizeof(uint64_t));
+  if (first_use == NULL || last_use == NULL || pristine_size == NULL) {
+    perror("malloc");
+    free(first_use);
+    free(last_use);
+    free(pristine_size);
+    return UINT64_MAX;
+  }
+  for (uint32_t c = 0; c < n_carriers; ++c) first_use[c] = UINT32_MAX;
+  for (uint32_t g = 0; g < plan->n_groups; ++g) {
+    for (int j = 0; j < plan->tot_shadows; ++j) {
+      uint32_t c = plan->assignment[((size_t)g * plan->tot_shadows) + j];
+      if (first_use[c] == UINT32_MAX) first_use[c] = g;
+      last_use[c] = g;
+      if (groupDirtySize(plan, g) > pristine_size[c]) pristine_size[c] = groupDirtySize(plan, g);
+    }
+  }
+
+  uint64_t peak = 0;
+  *held = 0;
+  for (uint32_t g = 0; g < plan->n_groups; ++g) {
+    uint64_t memory = 0;
+    uint32_t n_held = 0;
+    for (uint32_t c = 0; c < n_carriers; ++c) {
+      if (first_use[c] > g || last_use[c] < g) continue;
+      memory += carriers->carriers[c].image_size + (last_use[c] > first_use[c] ? pristine_size[c] : 0);
+      ++n_held;
+    }
+    // Secrets are placed biggest first inside their group.
+    uint64_t biggest = plan->shadow_sizes[plan->order[plan->group_start[g]]];
+    for (uint32_t i = plan->group_start[g]; i < plan->group_start[g + 1]; ++i) {
+      memory += (uint64_t)min_shadows * plan->shadow_sizes[plan->order[i]];
+    }
+    memory += sisEngineMemory(plan->processes, plan->threads, min_shadows, plan->tot_shadows, biggest);
+    if (memory > peak) peak = memory;
+    if (n_held > *held) *held = n_held;
+  }
+  free(first_use);
+  free(last_use);
+  free(pristine_size);
+  return peak;
+}
+
+// Memory held at once by `streamGroup`: a window of every carrier and of one secret at a time.
+static uint64_t streamedMemory(const Plan* plan, uint8_t min_shadows, uint64_t chunk_size) {
+  uint64_t peak = 0;
+  for (uint32_t g = 0; g < plan->n_groups; ++g) {
+    uint64_t span = groupDirtySize(plan, g) / 8;
+    uint64_t biggest = plan->shadow_sizes[plan->order[plan->group_start[g]]];
+    uint64_t window = span < chunk_size ? span : chunk_size;
+    uint64_t secret_window = biggest < chunk_size ? biggest : chunk_size;
+    uint64_t memory = ((uint64_t)plan->tot_shadows * 8 * window) + ((uint64_t)min_shadows * secret_window) +
+                      sisEngineMemory(plan->processes, plan->threads, min_shadows, plan->tot_shadows, secret_window);
+    if (memory > peak) peak = memory;
+  }
+  return peak;
+}
+
+// Computes the shadows of a group `plan->chunk_size` shadow bytes at a time. Every chunk loads the windows of the
+// carriers it covers and, one secret at a time, the window of the secrets it covers, and is written out before the
+// next one is loaded. The first chunk writes the whole shadows, cloning the carriers, and the others patch them.
+// Shadows marked in `staged` are written to their staged path.
+static bool streamGroup(
+  const Plan* plan, uint32_t group, const CarrierList* carriers, const char* const secret_filenames[],
+  uint8_t min_shadows, uint64_t seed, Field field, Mask mask, const char* directory_out, const SisEngine* engine,
+  const bool staged[]
+) {
+  const uint32_t* assigned = &plan->assignment[(size_t)group * plan->tot_shadows];
+  uint32_t first = plan->group_start[group];
+  uint32_t n_group_secrets = plan->group_start[group + 1] - first;
+  uint64_t span = groupDirtySize(plan, group) / 8;
+  BMP shadow_bmps[plan->tot_shadows];
+  BMP secrets[n_group_secrets];
+  uint8_t group_min_shadows[n_group_secrets];
+  uint64_t seeds[n_group_secrets];
+  uint64_t offsets[n_group_secrets];
+  memset((void*)shadow_bmps, 0, sizeof(shadow_bmps));
+  memset((void*)secrets, 0, sizeof(secrets));
+  char(*paths)[4096 + sizeof(STAGED_SUFFIX)] = malloc(plan->tot_shadows * sizeof(*paths));
+  bool ok = paths != NULL;
+  if (!ok) perror("malloc");
+
+  for (int j = 0; ok && j < plan->tot_shadows; ++j) {
+    const char* carrier_path = carriers->carriers[assigned[j]].path;
+    printf("parsing bmp: `%s`...\n", carrier_path);
+    shadow_bmps[j] = bmpParseWindow(carrier_path, 0, 0);
+    ok = shadow_bmps[j] != NULL;
+    if (!ok) fprintf(stderr, "Error parsing bmp `%s`\n", carrier_path);
+    ok = ok && groupPath(paths[j], 4096, plan, group, directory_out, secret_filenames[plan->order[first]], j);
+    if (ok && staged[j]) strcat(paths[j], STAGED_SUFFIX);
+  }
+  uint64_t offset = 0;
+  for (uint32_t i = 0; ok && i < n_group_secrets; ++i) {
+    const char* secret_filename = secret_filenames[plan->order[first + i]];
+    printf("parsing secret: `%s`...\n", secret_filename);
+    secrets[i] = bmpParseWindow(secret_filename, 0, 0);
+    ok = secrets[i] != NULL;
+    if (!ok) fprintf(stderr, "Error parsing bmp `%s`\n", secret_filename);
+    group_min_shadows[i] = min_shadows;
+    seeds[i] = seed;
+    offsets[i] = offset;
+    offset += plan->shadow_sizes[plan->order[first + i]];
+  }
+  ok = ok && sisShadowHeaders(
+               n_group_secrets, secrets, group_min_shadows, seeds, plan->tot_shadows, shadow_bmps, field, mask,
+               n_group_secrets > 1
+             );
+
+  // A group without shadow bytes still gets its shadows written, by a single empty chunk.
+  for (uint64_t from = 0; ok && (from == 0 || from < span); from += plan->chunk_size) {
+    uint64_t to = (span - from < plan->chunk_size) ? span : from + plan->chunk_size;
+    for (int j = 0; ok && j < plan->tot_shadows; ++j) {
+      ok = bmpLoadWindow(shadow_bmps[j], carriers->carriers[assigned[j]].path, 8 * from, 8 * to);
+    }
+    for (uint32_t i = 0; ok && i < n_group_secrets; ++i) {
+      uint64_t length = plan->shadow_sizes[plan->order[first + i]];
+      if (offsets[i] + length <= from || offsets[i] >= to) continue;
+      uint64_t secret_from = (from > offsets[i] ? from : offsets[i]) - offsets[i];
+      uint64_t secret_to = (to < offsets[i] + length ? to : offsets[i] + length) - offsets[i];
+      const char* secret_filename = secret_filenames[plan->order[first + i]];
+      ok = bmpLoadWindow(secrets[i], secret_filename, secret_from * min_shadows, secret_to * min_shadows) &&
+           sisShadowsRange(
+             secrets[i], min_shadows, plan->tot_shadows, shadow_bmps, seed, field, mask, offsets[i], secret_from,
+             secret_to, engine
+           );
+      bmpDropImage(secrets[i]);
+    }
+    for (int j = 0; ok && j < plan->tot_shadows; ++j) {
+      if (from == 0) {
+        printf("Saving `%s`...\n", paths[j]);
+        ok = bmpPatchFile(paths[j], carriers->carriers[assigned[j]].path, shadow_bmps[j]) == 0;
+      } else ok = bmpWriteDirty(paths[j], shadow_bmps[j]) == 0;
+    }
+  }
+
+  for (int j = 0; j < plan->tot_shadows; ++j) bmpFree(shadow_bmps[j]);
+  for (uint32_t i = 0; i < n_group_secrets; ++i) bmpFree(secrets[i]);
+  free((void*)paths);
+  return ok;
+}
@@ -0,0 +1,50 @@
+#ifndef PLAN_H
+#define PLAN_H
+
+#include "field.h"
+#include "permutation.h"
+#include "scan.h"
+#include "sis.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+// Secrets are distributed in carrier groups: every group is a set of `tot_shadows` distinct carriers that hide the
+// shadows of one secret, or of several secrets at consecutive offsets when packing.
+typedef struct Plan {
+  uint32_t n_secrets;
+  uint8_t tot_shadows;
+  bool packed;
+  bool in_place;          // Shadows overwrite their carriers, so no carrier is used by more than one group.
+  uint64_t* shadow_sizes; // Shadow size in bytes of every secret.
+  uint32_t* order;        // Secrets in execution order. The secrets of a group are contiguous.
+  uint32_t n_groups;      //
+  uint32_t* group_start;  // Group `g` holds the secrets `order[group_start[g]]` to `order[group_start[g + 1] - 1]`.
+  uint32_t* assignment;   // `assignment[g * tot_shadows + j]` is the carrier index of shadow `j` of group `g`.
+  uint32_t carriers_used; // Distinct carriers that have to be read.
+  uint64_t bytes_written; // Carrier pixel bytes modified across the whole batch.
+  // Set by `planSchedule`.
+  uint64_t max_memory;    // Budget in bytes, 0 without one.
+  uint64_t chunk_size;    // Shadow bytes of a group computed at once when streaming, 0 to keep carriers in memory.
+  uint32_t carriers_held; // Carriers in memory at once, whole or a window of them.
+  uint32_t processes;     // Worker processes computing the shares, none if 0 or 1.
+  uint32_t threads;       // Threads computing the shares without worker processes.
+  uint64_t peak_memory;   // Estimate of the memory held at once, in bytes.
+} Plan;
+
+Plan* planAssign(
+  const CarrierList* carriers, uint32_t n_secrets, const uint64_t shadow_sizes[n_secrets], uint8_t tot_shadows,
+  bool pack, bool in_place
+);
+bool planSchedule(
+  Plan* plan, const CarrierList* carriers, uint8_t min_shadows, uint64_t max_memory, bool sidecars, bool deltas,
+  uint32_t processes, uint32_t threads
+);
+void planPrint(const Plan* plan, const CarrierList* carriers, const char* const secret_filenames[]);
+bool planExecute(
+  const Plan* plan, const CarrierList* carriers, const char* const secret_filenames[], uint8_t min_shadows,
+  uint64_t seed, Field field, Mask mask, const char* directory_out, bool sidecars, bool deltas,
+  const SisEngine* engine
+);
+void planFree(Plan* plan);
+
+#endif
@@ -0,0 +1,130 @@
+#include "rs.h"
+#include "field.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static bool solveUnderdetermined(Field field, uint32_t rows, uint32_t unknowns, uint32_t* matrix, uint32_t* solution);
+
+/*
+   The shadow bytes of a block are the evaluations of the block's polynomial P (degree k - 1) at the shadows'
+   x-coordinates, i.e. a Reed-Solomon codeword over the field of the shadows. Berlekamp-Welch decoding corrects up to
+   e = (m - k) / 2 wrong evaluations out of m:
+
+   Let E be the monic error locator polynomial of degree e (its roots are the x of the wrong shadows) and Q = P * E,
+   of degree k + e - 1. For every shadow, Q(x_i) = y_i * E(x_i), which is a linear system of m equations on the
+   k + 2e unknown coefficients of Q and E:
+
+     Q_0 + Q_1 x_i + ... + Q_{k+e-1} x_i^{k+e-1} - y_i (E_0 + ... + E_{e-1} x_i^{e-1}) = y_i x_i^e
+
+   Any solution gives P = Q / E when there are at most e errors.
+*/
+bool rsDecode(
+  Field field, uint8_t min_shadows, uint8_t n_shadows, const uint16_t xs[n_shadows], const uint8_t ys[n_shadows],
+  uint8_t* coefs
+) {
+  uint32_t max_errors = (n_shadows - min_shadows) / 2;
+  uint32_t q_len = min_shadows + max_errors;
+  uint32_t unknowns = q_len + max_errors;
+  uint32_t cols = unknowns + 1;
+
+  uint32_t* system = malloc((size_t)n_shadows * cols * sizeof(uint32_t));
+  uint32_t* solution = malloc((unknowns + 1) * sizeof(uint32_t));
+  if (system == NULL || solution == NULL) {
+    perror("malloc");
+    free(system);
+    free(solution);
+    return false;
+  }
+  uint32_t (*m)[cols] = (uint32_t (*)[cols])system;
+  for (uint32_t i = 0; i < n_shadows; ++i) {
+    uint32_t x_pow = 1;
+    for (uint32_t j = 0; j < q_len; ++j) {
+      m[i][j] = x_pow;
+      if (j < max_errors) m[i][q_len + j] = fieldSub(field, 0, fieldMul(field, ys[i], x_pow));
+      if (j == max_errors) m[i][unknowns] = fieldMul(field, ys[i], x_pow);
+      x_pow = fieldMul(field, x_pow, xs[i]);
+    }
+  }
+
+  bool ok = solveUnderdetermined(field, n_shadows, unknowns, system, solution);
+  free(system);
+  if (!ok) {
+    free(solution);
+    return false;
+  }
+
+  // P = Q / E by long division, E being monic.
+  uint32_t q[q_len];
+  uint32_t e[max_errors + 1];
+  memcpy(q, solution, q_len * sizeof(uint32_t));
+  memcpy(e, solution + q_len, max_errors * sizeof(uint32_t));
+  e[max_errors] = 1;
+  free(solution);
+
+  uint32_t p[min_shadows];
+  for (int32_t i = min_shadows - 1; i >= 0; --i) {
+    uint32_t lead = q[i + max_errors];
+    p[i] = lead;
+    for (uint32_t j = 0; j <= max_errors; ++j) {
+      q[i + j] = fieldSub(field, q[i + j], fieldMul(field, lead, e[j]));
+    }
+  }
+  for (uint32_t i = 0; i < max_errors; ++i) {
+    if (q[i] != 0) return false;
+  }
+
+  // Shadow bytes come from polynomials with byte coefficients that agree with all but at most `max_errors` shadows.
+  uint32_t disagreements = 0;
+  for (uint32_t i = 0; i < n_shadows; ++i) {
+    uint32_t val = 0;
+    for (int32_t j = min_shadows - 1; j >= 0; --j) val = fieldAdd(field, fieldMul(field, val, xs[i]), p[j]);
+    disagreements += val != ys[i];
+  }
+  if (disagreements > max_errors) return false;
+  for (uint32_t i = 0; i < min_shadows; ++i) {
+    if (p[i] > UINT8_MAX) return false;
+    coefs[i] = p[i];
+  }
+  return true;
+}
+
+// Internal functions
+
+// Reduces `matrix` (`rows` x `unknowns + 1`, augmented) to reduced row echelon form and returns one solution, with
+// every free variable set to 0. Returns false if the system is inconsistent.
+static bool solveUnderdetermined(Field field, uint32_t rows, uint32_t unknowns, uint32_t* matrix, uint32_t* solution) {
+  uint32_t cols = unknowns + 1;
+  uint32_t (*m)[cols] = (uint32_t (*)[cols])matrix;
+  uint32_t pivot_col[rows];
+  uint32_t row = 0;
+  for (uint32_t col = 0; col < unknowns && row < rows; ++col) {
+    uint32_t pivot = row;
+    while (pivot < rows && m[pivot][col] == 0) ++pivot;
+    if (pivot == rows) continue;
+    if (pivot != row) {
+      for (uint32_t j = 0; j < cols; ++j) {
+        uint32_t aux = m[row][j];
+        m[row][j] = m[pivot][j];
+        m[pivot][j] = aux;
+      }
+    }
+    uint32_t inv = fieldInv(field, m[row][col]);
+    for (uint32_t j = col; j < cols; ++j) m[row][j] = fieldMul(field, m[row][j], inv);
+    for (uint32_t i = 0; i < rows; ++i) {
+      if (i == row || m[i][col] == 0) continue;
+      uint32_t factor = m[i][col];
+      for (uint32_t j = col; j < cols; ++j) m[i][j] = fieldSub(field, m[i][j], fieldMul(field, factor, m[row][j]));
+    }
+    pivot_col[row++] = col;
+  }
+
+  for (uint32_t i = row; i < rows; ++i) {
+    if (m[i][unknowns] != 0) return false;
+  }
+  memset(solution, 0, unknowns * sizeof(uint32_t));
+  for (uint32_t i = 0; i < row; ++i) solution[pivot_col[i]] = m[i][unknowns];
+  return true;
+}
@@ -0,0 +1,13 @@
+#ifndef RS_H
+#define RS_H
+
+#include "field.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+bool rsDecode(
+  Field field, uint8_t min_shadows, uint8_t n_shadows, const uint16_t xs[n_shadows], const uint8_t ys[n_shadows],
+  uint8_t* coefs
+);
+
+#endif
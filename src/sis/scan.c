@@ -0,0 +1,127 @@
+#define _GNU_SOURCE
+
+#include "scan.h"
+#include "../bmp/bmp.h"
+#include "sidecar.h"
+#include <dirent.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+static CarrierList* scanDirectory(const char* directory, bool sidecars);
+static bool probeFile(const char* full_path, bool sidecars, CarrierInfo* info);
+static bool isRegularFile(const struct dirent* entry, const char* full_path);
+static int compareCarriers(const void* a, const void* b);
+
+// Only the headers are read (see `bmpProbe`), so scanning is cheap even for directories with thousands of large
+// carriers. Files that are not BMPs are skipped. Carriers are sorted by path so that the order is stable.
+CarrierList* scanCarriers(const char* directory) {
+  return scanDirectory(directory, false);
+}
+
+// Same as `scanCarriers` for the sidecars in `directory` (see `sidecarWrite`), only their headers are read.
+CarrierList* scanSidecars(const char* directory) {
+  return scanDirectory(directory, true);
+}
+
+void scanFree(CarrierList* list) {
+  if (list == NULL) return;
+  for (uint32_t i = 0; i < list->count; ++i) free(list->carriers[i].path);
+  free(list->carriers);
+  free(list);
+}
+
+// Internal functions
+
+static CarrierList* scanDirectory(const char* directory, bool sidecars) {
+  DIR* dir = opendir(directory);
+  if (dir == NULL) {
+    perror("opendir");
+    return NULL;
+  }
+
+  CarrierList* list = malloc(sizeof(CarrierList));
+  if (list == NULL) {
+    perror("malloc");
+    closedir(dir);
+    return NULL;
+  }
+  list->count = 0;
+  list->carriers = NULL;
+  uint32_t allocated = 0;
+
+  struct dirent* entry;
+  while ((entry = readdir(dir)) != NULL) {
+    char* full_path;
+    if (asprintf(&full_path, "%s/%s", directory, entry->d_name) < 0) {
+      perror("asprintf");
+      break;
+    }
+    if (!isRegularFile(entry, full_path)) {
+      free(full_path);
+      continue;
+    }
+
+    CarrierInfo info;
+    if (!probeFile(full_path, sidecars, &info)) {
+      free(full_path);
+      continue;
+    }
+
+    if (list->count == allocated) {
+      allocated = allocated == 0 ? 16 : 2 * allocated;
+      CarrierInfo* carriers = realloc(list->carriers, allocated * sizeof(CarrierInfo));
+      if (carriers == NULL) {
+        perror("realloc");
+        free(full_path);
+        break;
+      }
+      list->carriers = carriers;
+    }
+
+    info.path = full_path;
+    list->carriers[list->count++] = info;
+  }
+
+  closedir(dir);
+  if (list->count > 0) qsort(list->carriers, list->count, sizeof(CarrierInfo), compareCarriers);
+  return list;
+}
+
+// Fills every field of `info` but the path.
+static bool probeFile(const char* full_path, bool sidecars, CarrierInfo* info) {
+  uint8_t reserved[4];
+  if (sidecars) {
+    size_t len = strlen(full_path);
+    size_t suffix_len = strlen(SIDECAR_SUFFIX);
+    if (len < suffix_len || strcmp(full_path + len - suffix_len, SIDECAR_SUFFIX) != 0) return false;
+    if (!sidecarProbe(full_path, reserved, &info->capacity)) return false;
+    info->image_size = 8 * info->capacity;
+  } else {
+    // `bmpProbe` fails without printing anything for files that don't start with the "BM" id.
+    BMP bmp = bmpProbe(full_path);
+    if (bmp == NULL) return false;
+    memcpy(reserved, bmpReserved(bmp), 4);
+    info->image_size = bmpImageSize(bmp);
+    info->capacity = info->image_size / 8;
+    bmpFree(bmp);
+  }
+  info->seed = (uint16_t)(reserved[0] | ((uint16_t)reserved[1] << 8u));
+  info->x = reserved[2];
+  return true;
+}
+
+static bool isRegularFile(const struct dirent* entry, const char* full_path) {
+  if (entry->d_type == DT_REG) return true;
+  if (entry->d_type != DT_UNKNOWN) return false;
+  // Some filesystems don't fill `d_type`.
+  struct stat statbuf;
+  return stat(full_path, &statbuf) == 0 && S_ISREG(statbuf.st_mode);
+}
+
+static int compareCarriers(const void* a, const void* b) {
+  return strcmp(((const CarrierInfo*)a)->path, ((const CarrierInfo*)b)->path);
+}
@@ -0,0 +1,23 @@
+#ifndef SCAN_H
+#define SCAN_H
+
+#include <stdint.h>
+
+typedef struct CarrierInfo {
+  char* path;
+  uint64_t image_size; // Pixel array size in bytes.
+  uint64_t capacity;   // Number of shadow bytes that can be hidden (one per 8 pixel bytes).
+  uint16_t seed;       // Seed found in the reserved bytes (0 for untouched carriers).
+  uint8_t x;           // Shadow x-coordinate found in the reserved bytes (0 for untouched carriers).
+} CarrierInfo;
+
+typedef struct CarrierList {
+  uint32_t count;
+  CarrierInfo* carriers;
+} CarrierList;
+
+CarrierList* scanCarriers(const char* directory);
+CarrierList* scanSidecars(const char* directory);
+void scanFree(CarrierList* list);
+
+#endif
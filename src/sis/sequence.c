@@ -0,0 +1,288 @@
+#include "sequence.h"
+#include "../bmp/bmp.h"
+#include "../io/io.h"
+#include "../utils/utils.h"
+#include "delta.h"
+#include "scan.h"
+#include "sidecar.h"
+#include "sis.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+// Frames and carrier sets in flight: one on each side of a handoff, so that two stages never wait on the same buffer.
+#define SEQUENCE_SLOTS 2
+
+// Slots handed from one stage to the next, in frame order. Every channel is guarded by the lock of its sequence.
+typedef struct Channel {
+  uint32_t slots[SEQUENCE_SLOTS];
+  uint32_t head;
+  uint32_t count;
+} Channel;
+
+typedef struct Sequence {
+  uint32_t n_frames;
+  const char* const* frame_filenames;
+  const CarrierList* carriers;
+  uint8_t min_shadows;
+  uint8_t tot_shadows;
+  const uint32_t* assigned;
+  uint64_t window_size;               // Pixel bytes held of every carrier.
+  const char* directory_out;
+  bool sidecars;
+  bool deltas;
+  BMP frames[SEQUENCE_SLOTS];         // Owned by the stage that last popped their slot.
+  BMP* sets[SEQUENCE_SLOTS];          // `tot_shadows` carriers each, loaded on their first use.
+  uint8_t** pristine;                 // First `pristine_size` pixel bytes of every carrier, when sets are reused.
+  uint64_t pristine_size;             //
+  Channel free_frames;                // Reader <- shares.
+  Channel parsed;                     // Reader -> shares.
+  Channel free_sets;                  // Shares <- writer.
+  Channel to_write;                   // Shares -> writer.
+  bool failed;                        // Set by the first stage that fails, every stage stops at its next handoff.
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+} Sequence;
+
+static void channelPush(Sequence* seq, Channel* channel, uint32_t slot);
+static bool channelPop(Sequence* seq, Channel* channel, uint32_t* slot);
+static void sequenceFail(Sequence* seq);
+static bool loadSet(Sequence* seq, uint32_t slot);
+static void restoreSet(Sequence* seq, uint32_t slot);
+static bool framePath(char* path, size_t path_len, const char* directory_out, const char* frame_filename, int shadow);
+static void* readerMain(void* arg);
+static void* writerMain(void* arg);
+
+// Every frame rewrites the headers and only the first `8 * shadow_size` pixel bytes of the carriers are modified, which
+// are saved when a carrier is first loaded. Before a carrier set is reused for a later frame, the span the previous
+// frame modified is restored from them, so no shadow of a frame is left in the output of another. Nothing but the
+// header and the pixels of the new frame are written, the rest is cloned from the carrier file.
+bool sequenceDistribute(
+  uint32_t n_frames, const char* const frame_filenames[n_frames], const CarrierList* carriers, uint8_t min_shadows,
+  uint8_t tot_shadows, const uint32_t assigned[tot_shadows], uint64_t shadow_size, uint64_t seed, Field field,
+  Mask mask, const char* directory_out, bool sidecars, bool deltas, const SisEngine* engine
+) {
+  Sequence* seq = calloc(1, sizeof(Sequence));
+  if (seq == NULL) {
+    perror("calloc");
+    return false;
+  }
+  *seq = (Sequence){
+    .n_frames = n_frames,
+    .frame_filenames = frame_filenames,
+    .carriers = carriers,
+    .min_shadows = min_shadows,
+    .tot_shadows = tot_shadows,
+    .assigned = assigned,
+    .window_size = 8 * shadow_size,
+    .directory_out = directory_out,
+    .sidecars = sidecars,
+    .deltas = deltas,
+    .pristine_size = 8 * shadow_size,
+  };
+  // Sets are only reused when there are more frames than sets.
+  if (n_frames > SEQUENCE_SLOTS) {
+    seq->pristine = calloc(tot_shadows, sizeof(uint8_t*));
+    if (seq->pristine == NULL) {
+      perror("calloc");
+      free(seq);
+      return false;
+    }
+  }
+  for (uint32_t s = 0; s < SEQUENCE_SLOTS; ++s) {
+    seq->free_frames.slots[s] = s;
+    seq->free_sets.slots[s] = s;
+  }
+  seq->free_frames.count = SEQUENCE_SLOTS;
+  seq->free_sets.count = SEQUENCE_SLOTS;
+  pthread_mutex_init(&seq->lock, NULL);
+  pthread_cond_init(&seq->changed, NULL);
+
+  pthread_t reader;
+  pthread_t writer;
+  bool reader_started = pthread_create(&reader, NULL, readerMain, seq) == 0;
+  bool writer_started = reader_started && pthread_create(&writer, NULL, writerMain, seq) == 0;
+  if (!writer_started) {
+    fprintf(stderr, "Error: Couldn't start the threads of the sequence.\n");
+    sequenceFail(seq);
+  }
+
+  uint32_t frame;
+  uint32_t set;
+  for (uint32_t i = 0; writer_started && i < n_frames; ++i) {
+    if (!channelPop(seq, &seq->parsed, &frame)) break;
+    if (!channelPop(seq, &seq->free_sets, &set)) break;
+    if (seq->sets[set] == NULL && !loadSet(seq, set)) {
+      sequenceFail(seq);
+      break;
+    }
+    restoreSet(seq, set);
+    if (!sisShadows(seq->frames[frame], min_shadows, tot_shadows, seq->sets[set], seed, field, mask, engine)) {
+      sequenceFail(seq);
+      break;
+    }
+    channelPush(seq, &seq->free_frames, frame);
+    channelPush(seq, &seq->to_write, set);
+  }
+
+  if (reader_started) pthread_join(reader, NULL);
+  if (writer_started) pthread_join(writer, NULL);
+  bool ok = !seq->failed;
+  for (uint32_t s = 0; s < SEQUENCE_SLOTS; ++s) {
+    bmpFree(seq->frames[s]);
+    for (int j = 0; seq->sets[s] != NULL && j < tot_shadows; ++j) bmpFree(seq->sets[s][j]);
+    free((void*)seq->sets[s]);
+  }
+  for (int j = 0; seq->pristine != NULL && j < tot_shadows; ++j) free(seq->pristine[j]);
+  free((void*)seq->pristine);
+  pthread_cond_destroy(&seq->changed);
+  pthread_mutex_destroy(&seq->lock);
+  free(seq);
+  return ok;
+}
+
+// Internal functions
+
+static void channelPush(Sequence* seq, Channel* channel, uint32_t slot) {
+  pthread_mutex_lock(&seq->lock);
+  channel->slots[(channel->head + channel->count) % SEQUENCE_SLOTS] = slot;
+  ++channel->count;
+  pthread_cond_broadcast(&seq->changed);
+  pthread_mutex_unlock(&seq->lock);
+}
+
+// Waits for the next slot of `channel`. Fails once any stage failed.
+static bool channelPop(Sequence* seq, Channel* channel, uint32_t* slot) {
+  pthread_mutex_lock(&seq->lock);
+  while (channel->count == 0 && !seq->failed) pthread_cond_wait(&seq->changed, &seq->lock);
+  bool ok = !seq->failed;
+  if (ok) {
+    *slot = channel->slots[channel->head];
+    channel->head = (channel->head + 1) % SEQUENCE_SLOTS;
+    --channel->count;
+  }
+  pthread_mutex_unlock(&seq->lock);
+  return ok;
+}
+
+static void sequenceFail(Sequence* seq) {
+  pthread_mutex_lock(&seq->lock);
+  seq->failed = true;
+  pthread_cond_broadcast(&seq->changed);
+  pthread_mutex_unlock(&seq->lock);
+}
+
+static bool loadSet(Sequence* seq, uint32_t slot) {
+  seq->sets[slot] = calloc(seq->tot_shadows, sizeof(BMP));
+  if (seq->sets[slot] == NULL) {
+    perror("calloc");
+    return false;
+  }
+  for (int j = 0; j < seq->tot_shadows; ++j) {
+    const char* carrier_path = seq->carriers->carriers[seq->assigned[j]].path;
+    printf("parsing bmp: `%s`...\n", carrier_path);
+    seq->sets[slot][j] = bmpParseWindow(carrier_path, 0, seq->window_size);
+    if (seq->sets[slot][j] == NULL) {
+      fprintf(stderr, "Error parsing bmp `%s`\n", carrier_path);
+      return false;
+    }
+    if (seq->pristine != NULL && seq->pristine[j] == NULL) {
+      seq->pristine[j] = malloc(seq->pristine_size);
+      if (seq->pristine[j] == NULL) {
+        perror("malloc");
+        return false;
+      }
+      memcpy(seq->pristine[j], bmpImage(seq->sets[slot][j]), seq->pristine_size);
+    }
+  }
+  return true;
+}
+
+// Restores the pixels the previous frame of `slot` modified, a freshly loaded set is left as is.
+static void restoreSet(Sequence* seq, uint32_t slot) {
+  for (int j = 0; j < seq->tot_shadows; ++j) {
+    BMP carrier = seq->sets[slot][j];
+    uint64_t dirty_from;
+    uint64_t dirty_to;
+    bmpDirtyRange(carrier, &dirty_from, &dirty_to);
+    if (dirty_to > seq->pristine_size) dirty_to = seq->pristine_size;
+    if (seq->pristine != NULL && dirty_from < dirty_to) {
+      memcpy(bmpImage(carrier) + dirty_from, seq->pristine[j] + dirty_from, dirty_to - dirty_from);
+    }
+    bmpMarkClean(carrier);
+  }
+}
+
+// Same layout as the shadows of a batch: every frame gets a sub-directory named after it.
+static bool framePath(char* path, size_t path_len, const char* directory_out, const char* frame_filename, int shadow) {
+  char base[path_len];
+  fileStem(base, path_len, frame_filename);
+  snprintf(path, path_len, "%s/%s", directory_out, base);
+  if (mkdir(path, 0755) != 0 && errno != EEXIST) {
+    perror("mkdir");
+    return false;
+  }
+  snprintf(path, path_len, "%s/%s/shadow-%03d.bmp", directory_out, base, shadow);
+  return true;
+}
+
+// Reads frame `i + 1` while the shares of frame `i` are computed, into the buffer of frame `i - 1`.
+static void* readerMain(void* arg) {
+  Sequence* seq = arg;
+  uint32_t slot;
+  for (uint32_t i = 0; i < seq->n_frames && channelPop(seq, &seq->free_frames, &slot); ++i) {
+    const char* frame_filename = seq->frame_filenames[i];
+    printf("parsing secret: `%s`...\n", frame_filename);
+    seq->frames[slot] = bmpParseRecycled(frame_filename, seq->frames[slot]);
+    if (seq->frames[slot] == NULL) {
+      fprintf(stderr, "Error parsing bmp `%s`\n", frame_filename);
+      sequenceFail(seq);
+      break;
+    }
+    channelPush(seq, &seq->parsed, slot);
+  }
+  ioRelease();
+  return NULL;
+}
+
+// Writes the shadows of frame `i - 1` while the shares of frame `i` are computed.
+static void* writerMain(void* arg) {
+  Sequence* seq = arg;
+  uint32_t slot;
+  for (uint32_t i = 0; i < seq->n_frames && channelPop(seq, &seq->to_write, &slot); ++i) {
+    bool ok = true;
+    for (int j = 0; ok && j < seq->tot_shadows; ++j) {
+      const char* carrier_path = seq->carriers->carriers[seq->assigned[j]].path;
+      char full_path[4096];
+      ok = framePath(full_path, sizeof(full_path), seq->directory_out, seq->frame_filenames[i], j);
+      if (!ok) break;
+      if (seq->deltas) {
+        char delta_path[4096 + sizeof(DELTA_SUFFIX)];
+        snprintf(delta_path, sizeof(delta_path), "%s%s", full_path, DELTA_SUFFIX);
+        printf("Saving `%s`...\n", delta_path);
+        ok = deltaWrite(delta_path, seq->sets[slot][j], carrier_path);
+      } else {
+        printf("Saving `%s`...\n", full_path);
+        ok = bmpPatchFile(full_path, carrier_path, seq->sets[slot][j]) == 0;
+      }
+      if (ok && seq->sidecars) {
+        char sidecar_path[4096 + sizeof(SIDECAR_SUFFIX)];
+        snprintf(sidecar_path, sizeof(sidecar_path), "%s%s", full_path, SIDECAR_SUFFIX);
+        printf("Saving `%s`...\n", sidecar_path);
+        ok = sidecarWrite(sidecar_path, seq->sets[slot][j], seq->min_shadows);
+      }
+    }
+    if (!ok) {
+      sequenceFail(seq);
+      break;
+    }
+    channelPush(seq, &seq->free_sets, slot);
+  }
+  ioRelease();
+  return NULL;
+}
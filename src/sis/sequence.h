@@ -0,0 +1,22 @@
+#ifndef SEQUENCE_H
+#define SEQUENCE_H
+
+#include "field.h"
+#include "permutation.h"
+#include "scan.h"
+#include "sis.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+// A sequence is an ordered list of frames (time-lapses, scan series...) that are all hidden in the same carriers, each
+// frame getting its own sub-directory of shadows. Frames go through a three-stage pipeline: while the shares of frame
+// `i` are computed, frame `i + 1` is read by a reader thread and the carriers of frame `i - 1` are written by a writer
+// thread. Frames alternate between two copies of the carriers, each read once, and every stage reuses its buffers from
+// one frame to the next.
+bool sequenceDistribute(
+  uint32_t n_frames, const char* const frame_filenames[n_frames], const CarrierList* carriers, uint8_t min_shadows,
+  uint8_t tot_shadows, const uint32_t assigned[tot_shadows], uint64_t shadow_size, uint64_t seed, Field field,
+  Mask mask, const char* directory_out, bool sidecars, bool deltas, const SisEngine* engine
+);
+
+#endif
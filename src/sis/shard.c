@@ -0,0 +1,305 @@
+#include "shard.h"
+#include "../bmp/bmp.h"
+#include "../utils/utils.h"
+#include "sis.h"
+#include <errno.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define SHARD_MAGIC 0x44524853u // "SHRD"
+// Every worker gets several ranges of a secret, so that a slow range doesn't leave the others idle at the end.
+#define SHARD_RANGES_PER_WORKER 4
+// Bounds the size of the messages, and the memory of the workers.
+#define SHARD_MAX_BLOCKS (4 * 1024 * 1024)
+
+// Followed by the `n_bytes` bytes of the secret the range covers, fewer than `n_blocks * min_shadows` only for the
+// last block of the secret. Fields are in host byte order, like the extra data.
+typedef struct {
+  uint32_t magic;
+  uint8_t field;
+  uint8_t mask;
+  uint8_t min_shadows;
+  uint8_t tot_shadows;
+  uint64_t seed;
+  uint64_t first_block;
+  uint32_t n_blocks;
+  uint32_t n_bytes;
+} ShardRequest;
+
+// Followed by the `tot_shadows * n_blocks` shares of the range, shadow by shadow, if `ok`.
+typedef struct {
+  uint32_t magic;
+  uint32_t ok;
+  uint64_t first_block;
+  uint32_t n_blocks;
+  uint32_t padding;
+} ShardReply;
+
+typedef struct {
+  pid_t pid;
+  int fd;
+  bool busy;
+  uint64_t first_block; // Range in flight when `busy`.
+  uint32_t n_blocks;    //
+} ShardWorker;
+
+struct ShardPool {
+  uint32_t n_workers;
+  ShardWorker* workers;
+  bool broken; // A worker failed with ranges in flight, the pool can't be used anymore.
+};
+
+static uint64_t rangeBlocks(uint32_t n_workers, uint64_t n_blocks);
+static bool shardServe(int fd);
+static bool sendRange(ShardWorker* worker, const ShardRequest* request, BMP secret);
+static bool receiveRange(
+  ShardWorker* worker, uint8_t tot_shadows, uint8_t* shares, uint64_t offset, BMP carrier_bmps[tot_shadows]
+);
+static bool readFull(int fd, void* buf, size_t size);
+static bool writeFull(int fd, const void* buf, size_t size);
+
+// Forks `n_workers` workers, every one of them connected to the coordinator by a socket pair.
+ShardPool* shardStart(uint32_t n_workers) {
+  ShardPool* pool = calloc(1, sizeof(ShardPool));
+  if (pool == NULL || (pool->workers = calloc(n_workers, sizeof(ShardWorker))) == NULL) {
+    perror("calloc");
+    free(pool);
+    return NULL;
+  }
+  // Anything still buffered would be written again by every worker.
+  fflush(stdout);
+  fflush(stderr);
+  for (uint32_t i = 0; i < n_workers; ++i) {
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+      perror("socketpair");
+      shardStop(pool);
+      return NULL;
+    }
+    pid_t pid = fork();
+    if (pid < 0) {
+      perror("fork");
+      close(fds[0]);
+      close(fds[1]);
+      shardStop(pool);
+      return NULL;
+    }
+    if (pid == 0) {
+      // The sockets of the workers forked before this one must only be open in the coordinator, or those workers
+      // would never see them closed.
+      close(fds[0]);
+      for (uint32_t w = 0; w < pool->n_workers; ++w) close(pool->workers[w].fd);
+      _exit(shardServe(fds[1]) ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+    close(fds[1]);
+    pool->workers[pool->n_workers++] = (ShardWorker){.pid = pid, .fd = fds[0]};
+  }
+  return pool;
+}
+
+// Hides the shares of the blocks [from, to) of `secret` at shadow byte `offset` of the carriers, like
+// `sisShadowsRange`. Ranges go to whichever worker is idle, and the shares of a range are hidden as soon as they
+// arrive.
+bool shardShares(
+  ShardPool* pool, Field field, Mask mask, uint8_t min_shadows, uint8_t tot_shadows, uint64_t seed, BMP secret,
+  uint64_t offset, uint64_t from, uint64_t to, BMP carrier_bmps[tot_shadows]
+) {
+  if (pool->broken) return false;
+  uint64_t range = rangeBlocks(pool->n_workers, to - from);
+  uint8_t* shares = malloc((size_t)tot_shadows * range);
+  if (shares == NULL) {
+    perror("malloc");
+    return false;
+  }
+
+  ShardRequest request = {
+    .magic = SHARD_MAGIC,
+    .field = field,
+    .mask = mask,
+    .min_shadows = min_shadows,
+    .tot_shadows = tot_shadows,
+    .seed = seed,
+  };
+  struct pollfd fds[pool->n_workers];
+  uint32_t polled[pool->n_workers];
+  uint64_t next = from;
+  uint32_t in_flight = 0;
+  bool ok = true;
+  while (ok && (next < to || in_flight > 0)) {
+    for (uint32_t w = 0; ok && w < pool->n_workers && next < to; ++w) {
+      if (pool->workers[w].busy) continue;
+      request.first_block = next;
+      request.n_blocks = (to - next < range) ? to - next : range;
+      ok = sendRange(&pool->workers[w], &request, secret);
+      next += request.n_blocks;
+      ++in_flight;
+    }
+
+    uint32_t n_fds = 0;
+    for (uint32_t w = 0; w < pool->n_workers; ++w) {
+      if (!pool->workers[w].busy) continue;
+      fds[n_fds] = (struct pollfd){.fd = pool->workers[w].fd, .events = POLLIN};
+      polled[n_fds++] = w;
+    }
+    if (!ok) break;
+    if (poll(fds, n_fds, -1) < 0) {
+      if (errno == EINTR) continue;
+      perror("poll");
+      ok = false;
+      break;
+    }
+    for (uint32_t i = 0; ok && i < n_fds; ++i) {
+      if (fds[i].revents == 0) continue;
+      ok = receiveRange(&pool->workers[polled[i]], tot_shadows, shares, offset, carrier_bmps);
+      --in_flight;
+    }
+  }
+  free(shares);
+  if (!ok) pool->broken = true;
+  return ok;
+}
+
+// Closing the sockets ends the workers. Fails if any of them didn't exit cleanly.
+bool shardStop(ShardPool* pool) {
+  if (pool == NULL) return true;
+  bool ok = !pool->broken;
+  for (uint32_t w = 0; w < pool->n_workers; ++w) close(pool->workers[w].fd);
+  for (uint32_t w = 0; w < pool->n_workers; ++w) {
+    int status;
+    while (waitpid(pool->workers[w].pid, &status, 0) < 0) {
+      if (errno == EINTR) continue;
+      perror("waitpid");
+      status = EXIT_FAILURE;
+      break;
+    }
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+      fprintf(stderr, "shardStop: Worker %u (pid %d) failed.\n", w, (int)pool->workers[w].pid);
+      ok = false;
+    }
+  }
+  free(pool->workers);
+  free(pool);
+  return ok;
+}
+
+// Memory held at once by the coordinator and the workers of a pool to compute the shares of up to `n_blocks` blocks
+// at a time. Workers keep the buffers of their biggest range until they stop.
+uint64_t shardMemory(uint32_t n_workers, uint8_t min_shadows, uint8_t tot_shadows, uint64_t n_blocks) {
+  uint64_t range = rangeBlocks(n_workers, n_blocks);
+  return ((uint64_t)tot_shadows * range) + ((uint64_t)n_workers * (min_shadows + tot_shadows) * range);
+}
+
+// Internal functions
+
+static uint64_t rangeBlocks(uint32_t n_workers, uint64_t n_blocks) {
+  uint64_t range = ceilDiv(n_blocks, (uint64_t)n_workers * SHARD_RANGES_PER_WORKER);
+  if (range > SHARD_MAX_BLOCKS) range = SHARD_MAX_BLOCKS;
+  return range > 0 ? range : 1;
+}
+
+// Worker loop, answers requests until the coordinator closes the socket.
+static bool shardServe(int fd) {
+  uint8_t* buf = NULL;
+  size_t buf_size = 0;
+  bool ok = true;
+  ShardRequest request;
+  while (ok && readFull(fd, &request, sizeof(request))) {
+    ok = request.magic == SHARD_MAGIC && request.field <= FIELD_GF256 && request.mask <= MASK_CHACHA &&
+         request.min_shadows >= 2 && request.tot_shadows >= request.min_shadows &&
+         request.n_blocks <= SHARD_MAX_BLOCKS && request.n_bytes <= (uint64_t)request.n_blocks * request.min_shadows;
+    if (!ok) {
+      fprintf(stderr, "shardServe: Invalid request.\n");
+      break;
+    }
+    size_t needed = request.n_bytes + ((size_t)request.tot_shadows * request.n_blocks);
+    if (needed > buf_size) {
+      uint8_t* grown = realloc(buf, needed);
+      if (grown == NULL) {
+        perror("realloc");
+        ok = false;
+        break;
+      }
+      buf = grown;
+      buf_size = needed;
+    }
+    if (!readFull(fd, buf, request.n_bytes)) {
+      fprintf(stderr, "shardServe: Truncated request.\n");
+      ok = false;
+      break;
+    }
+
+    uint8_t* shares = buf + request.n_bytes;
+    ShardReply reply = {.magic = SHARD_MAGIC, .first_block = request.first_block, .n_blocks = request.n_blocks};
+    reply.ok = sisShares(
+      request.field, request.mask, request.min_shadows, request.tot_shadows, request.seed, request.first_block,
+      request.n_blocks, buf, request.n_bytes, shares
+    );
+    ok = writeFull(fd, &reply, sizeof(reply)) && reply.ok &&
+         writeFull(fd, shares, (size_t)request.tot_shadows * request.n_blocks);
+  }
+  free(buf);
+  return ok;
+}
+
+// Only the bytes of the range have to be loaded in `secret`.
+static bool sendRange(ShardWorker* worker, const ShardRequest* request, BMP secret) {
+  ShardRequest sent = *request;
+  uint64_t first = request->first_block * request->min_shadows;
+  uint64_t n_bytes = (uint64_t)request->n_blocks * request->min_shadows;
+  if (n_bytes > bmpImageSize(secret) - first) n_bytes = bmpImageSize(secret) - first;
+  const uint8_t* img = bmpImage(secret) + (first - bmpWindowFrom(secret));
+  sent.n_bytes = n_bytes;
+  worker->busy = true;
+  worker->first_block = request->first_block;
+  worker->n_blocks = request->n_blocks;
+  if (!writeFull(worker->fd, &sent, sizeof(sent)) || !writeFull(worker->fd, img, n_bytes)) {
+    fprintf(stderr, "shardShares: Couldn't send a range to worker %d.\n", (int)worker->pid);
+    return false;
+  }
+  return true;
+}
+
+static bool receiveRange(
+  ShardWorker* worker, uint8_t tot_shadows, uint8_t* shares, uint64_t offset, BMP carrier_bmps[tot_shadows]
+) {
+  ShardReply reply;
+  worker->busy = false;
+  if (!readFull(worker->fd, &reply, sizeof(reply)) || reply.magic != SHARD_MAGIC || !reply.ok ||
+      reply.first_block != worker->first_block || reply.n_blocks != worker->n_blocks ||
+      !readFull(worker->fd, shares, (size_t)tot_shadows * reply.n_blocks)) {
+    fprintf(stderr, "shardShares: Worker %d failed to compute its range.\n", (int)worker->pid);
+    return false;
+  }
+  sisHideShares(offset + reply.first_block, reply.n_blocks, tot_shadows, shares, carrier_bmps);
+  return true;
+}
+
+static bool readFull(int fd, void* buf, size_t size) {
+  for (size_t done = 0; done < size;) {
+    ssize_t got = recv(fd, (uint8_t*)buf + done, size - done, 0);
+    if (got < 0 && errno == EINTR) continue;
+    if (got <= 0) return false;
+    done += got;
+  }
+  return true;
+}
+
+// The other end may have died, MSG_NOSIGNAL avoids dying from SIGPIPE.
+static bool writeFull(int fd, const void* buf, size_t size) {
+  for (size_t done = 0; done < size;) {
+    ssize_t sent = send(fd, (const uint8_t*)buf + done, size - done, MSG_NOSIGNAL);
+    if (sent < 0 && errno == EINTR) continue;
+    if (sent <= 0) return false;
+    done += sent;
+  }
+  return true;
+}
@@ -0,0 +1,25 @@
+#ifndef SHARD_H
+#define SHARD_H
+
+#include "../bmp/bmp.h"
+#include "field.h"
+#include "permutation.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+// Distribution split across worker processes. The blocks of a secret are cut into ranges that are computed
+// independently: a range only needs the bytes of the secret it covers and the mask from their offset on. Every worker
+// is sent ranges over its own socket and replies with their shares of every shadow, which the coordinator hides in
+// the carriers. Workers hold nothing but the range they are working on and only talk through their socket, so the
+// same messages can be carried to workers on other machines.
+typedef struct ShardPool ShardPool;
+
+ShardPool* shardStart(uint32_t n_workers);
+bool shardShares(
+  ShardPool* pool, Field field, Mask mask, uint8_t min_shadows, uint8_t tot_shadows, uint64_t seed, BMP secret,
+  uint64_t offset, uint64_t from, uint64_t to, BMP carrier_bmps[tot_shadows]
+);
+bool shardStop(ShardPool* pool);
+uint64_t shardMemory(uint32_t n_workers, uint8_t min_shadows, uint8_t tot_shadows, uint64_t n_blocks);
+
+#endif
@@ -0,0 +1,220 @@
+#define _GNU_SOURCE
+
+#include "sidecar.h"
+#include "../bmp/bmp.h"
+#include "../io/io.h"
+#include "../utils/utils.h"
+#include "sis.h"
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define SIDECAR_MAGIC 0x43444853u // "SHDC"
+#define SIDECAR_VERSION 2
+
+// Followed by the color table of the carrier, the extra data and `length` shadow bytes. Fields are in host byte
+// order, like the extra data.
+typedef struct {
+  uint32_t magic;
+  uint16_t version;
+  uint8_t min_shadows;
+  uint8_t padding;
+  uint8_t reserved[4]; // Reserved bytes of the carrier header.
+  uint32_t width;      // Geometry of the carrier.
+  int32_t height;      // Negative for top-down carriers.
+  uint32_t bpp;        //
+  uint32_t n_colors;
+  uint32_t extra_data_size;
+  uint64_t length;   // Shadow bytes from the first one, those the secrets use (see `sisShadowBytesUsed`).
+  uint64_t checksum; // FNV-1a of the whole file, with this field set to 0.
+} SidecarHeader;
+
+struct Sidecar {
+  uint8_t* map;
+  size_t map_size;
+  BMP bmp; // Header of the carrier, without pixels.
+  const uint8_t* shadow_bytes;
+  uint64_t length;
+  uint8_t min_shadows;
+};
+
+static uint64_t sidecarChecksum(const SidecarHeader* header, const uint8_t* data, size_t size);
+
+// Writes the shadow bytes the secrets use out of those hidden in the pixels of `shadow` to `filename`. The pixels held
+// by `shadow` must cover them (see `bmpLoadWindow`).
+bool sidecarWrite(const char* filename, BMP shadow, uint8_t min_shadows) {
+  uint32_t n_colors = bmpNColors(shadow);
+  uint32_t extra_data_size = bmpExtraSize(shadow);
+  uint64_t length = sisShadowBytesUsed(shadow, min_shadows);
+  size_t meta_size = sizeof(SidecarHeader) + (n_colors * sizeof(Color)) + extra_data_size;
+  // Everything but the header goes in one buffer, so that the checksum is computed in a single pass.
+  size_t data_size = meta_size - sizeof(SidecarHeader) + length;
+  uint8_t* data = malloc(data_size > 0 ? data_size : 1);
+  if (data == NULL) {
+    perror("malloc");
+    return false;
+  }
+  memcpy(data, bmpColors(shadow), n_colors * sizeof(Color));
+  memcpy(data + (n_colors * sizeof(Color)), bmpExtraData(shadow), extra_data_size);
+  sisExtractShadowRange(shadow, 0, length, data + meta_size - sizeof(SidecarHeader));
+
+  SidecarHeader header;
+  memset(&header, 0, sizeof(header));
+  header.magic = SIDECAR_MAGIC;
+  header.version = SIDECAR_VERSION;
+  header.min_shadows = min_shadows;
+  memcpy(header.reserved, bmpReserved(shadow), 4);
+  header.width = bmpWidth(shadow);
+  header.height = bmpTopDown(shadow) ? -(int32_t)bmpHeight(shadow) : (int32_t)bmpHeight(shadow);
+  header.bpp = bmpBpp(shadow);
+  header.n_colors = n_colors;
+  header.extra_data_size = extra_data_size;
+  header.length = length;
+  header.checksum = sidecarChecksum(&header, data, data_size);
+
+  int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    perror("open");
+    free(data);
+    return false;
+  }
+  uint32_t n_requests = 1 + ioChunkCount(data_size, sizeof(SidecarHeader));
+  IoRequest* requests = malloc(n_requests * sizeof(IoRequest));
+  bool ok = requests != NULL;
+  if (!ok) perror("malloc");
+  if (ok) {
+    requests[0] = (IoRequest){.fd = fd, .buf = &header, .size = sizeof(header), .offset = 0};
+    ioSplit(fd, data, data_size, sizeof(SidecarHeader), &requests[1]);
+    ok = ioWrite(n_requests, requests);
+  }
+  free(requests);
+  free(data);
+  if (close(fd) != 0) {
+    perror("close");
+    return false;
+  }
+  return ok;
+}
+
+// Maps `filename` and checks it against its checksum. The shadow bytes are read straight from the mapping.
+Sidecar* sidecarOpen(const char* filename) {
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) {
+    perror("open");
+    return NULL;
+  }
+  struct stat file_stat;
+  if (fstat(fd, &file_stat) != 0) {
+    perror("fstat");
+    close(fd);
+    return NULL;
+  }
+  if ((size_t)file_stat.st_size < sizeof(SidecarHeader)) {
+    fprintf(stderr, "Error: `%s` is not a sidecar.\n", filename);
+    close(fd);
+    return NULL;
+  }
+  uint8_t* map = mmap(NULL, file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    perror("mmap");
+    return NULL;
+  }
+  madvise(map, file_stat.st_size, MADV_SEQUENTIAL);
+
+  Sidecar* sidecar = calloc(1, sizeof(Sidecar));
+  if (sidecar == NULL) {
+    perror("calloc");
+    munmap(map, file_stat.st_size);
+    return NULL;
+  }
+  sidecar->map = map;
+  sidecar->map_size = file_stat.st_size;
+
+  const SidecarHeader* header = (const SidecarHeader*)map;
+  uint64_t expected_size = sizeof(SidecarHeader) + ((uint64_t)header->n_colors * sizeof(Color)) +
+                           header->extra_data_size + header->length;
+  if (header->magic != SIDECAR_MAGIC || header->version != SIDECAR_VERSION || header->n_colors > 256 ||
+      header->length > (uint64_t)file_stat.st_size || expected_size != (uint64_t)file_stat.st_size) {
+    fprintf(stderr, "Error: `%s` is not a sidecar or is truncated.\n", filename);
+    sidecarClose(sidecar);
+    return NULL;
+  }
+  const uint8_t* data = map + sizeof(SidecarHeader);
+  if (sidecarChecksum(header, data, sidecar->map_size - sizeof(SidecarHeader)) != header->checksum) {
+    fprintf(stderr, "Error: Checksum mismatch in sidecar `%s`.\n", filename);
+    sidecarClose(sidecar);
+    return NULL;
+  }
+
+  // The mapping is read only, `bmpNewHeader` copies the color table and the extra data.
+  uint8_t reserved[4];
+  memcpy(reserved, header->reserved, 4);
+  uint32_t extra_offset = header->n_colors * sizeof(Color);
+  sidecar->bmp = bmpNewHeader(
+    header->width, header->height, header->bpp, reserved, header->n_colors, (Color*)data, header->extra_data_size,
+    (uint8_t*)data + extra_offset
+  );
+  if (sidecar->bmp == NULL || header->length > bmpImageSize(sidecar->bmp) / 8) {
+    fprintf(stderr, "Error: Inconsistent carrier geometry in sidecar `%s`.\n", filename);
+    sidecarClose(sidecar);
+    return NULL;
+  }
+  sidecar->shadow_bytes = data + extra_offset + header->extra_data_size;
+  sidecar->length = header->length;
+  sidecar->min_shadows = header->min_shadows;
+  return sidecar;
+}
+
+// Reads only the header of `filename`. Fails without printing anything for files that aren't sidecars.
+bool sidecarProbe(const char* filename, uint8_t reserved[4], uint64_t* length) {
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) return false;
+  SidecarHeader header;
+  bool ok = pread(fd, &header, sizeof(header), 0) == sizeof(header) && header.magic == SIDECAR_MAGIC &&
+            header.version == SIDECAR_VERSION;
+  close(fd);
+  if (!ok) return false;
+  memcpy(reserved, header.reserved, 4);
+  *length = header.length;
+  return true;
+}
+
+BMP sidecarBmp(const Sidecar* sidecar) {
+  return sidecar->bmp;
+}
+
+const uint8_t* sidecarShadowBytes(const Sidecar* sidecar) {
+  return sidecar->shadow_bytes;
+}
+
+uint64_t sidecarShadowLength(const Sidecar* sidecar) {
+  return sidecar->length;
+}
+
+uint8_t sidecarMinShadows(const Sidecar* sidecar) {
+  return sidecar->min_shadows;
+}
+
+void sidecarClose(Sidecar* sidecar) {
+  if (sidecar == NULL) return;
+  bmpFree(sidecar->bmp);
+  munmap(sidecar->map, sidecar->map_size);
+  free(sidecar);
+}
+
+// Internal functions
+
+static uint64_t sidecarChecksum(const SidecarHeader* header, const uint8_t* data, size_t size) {
+  SidecarHeader zeroed = *header;
+  zeroed.checksum = 0;
+  uint64_t hash = fnv1a(FNV_OFFSET_BASIS, (const uint8_t*)&zeroed, sizeof(zeroed));
+  return fnv1a(hash, data, size);
+}
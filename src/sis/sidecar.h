@@ -0,0 +1,27 @@
+#ifndef SIDECAR_H
+#define SIDECAR_H
+
+#include "../bmp/bmp.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+// A sidecar holds the shadow bytes of a carrier that its secrets use, already extracted from its pixels, along with
+// the header fields that recovery needs: the reserved bytes (seed, x-coordinate and flags), the geometry and color
+// table of the carrier, the extra data describing the secret and the `min_shadows` the shadows were made for.
+// Recovering from sidecars reads at least 8 times less than from the carriers and skips the LSB extraction. Sidecars
+// are meant for trusted storage, they reveal the shadows to anyone reading them. They are written next to each shadow,
+// with `SIDECAR_SUFFIX` appended to its name.
+#define SIDECAR_SUFFIX ".shd"
+
+typedef struct Sidecar Sidecar;
+
+bool sidecarWrite(const char* filename, BMP shadow, uint8_t min_shadows);
+Sidecar* sidecarOpen(const char* filename);
+bool sidecarProbe(const char* filename, uint8_t reserved[4], uint64_t* length);
+BMP sidecarBmp(const Sidecar* sidecar);
+const uint8_t* sidecarShadowBytes(const Sidecar* sidecar);
+uint64_t sidecarShadowLength(const Sidecar* sidecar);
+uint8_t sidecarMinShadows(const Sidecar* sidecar);
+void sidecarClose(Sidecar* sidecar);
+
+#endif
@@ -1,9 +1,15 @@
 #include "sis.h"
 #include "../bmp/bmp.h"
 #include "../globals.h"
+#include "../numa/numa.h"
 #include "../utils/utils.h"
+#include "field.h"
+#include "kernels.h"
+#include "keystream.h"
 #include "permutation.h"
+#include "rs.h"
 #include <assert.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
@@ -11,152 +17,436 @@
 #include <stdlib.h>
 #include <string.h>
 
+// With `SIS_FLAG_CHACHA`, the 64-bit seed of the mask follows the color table.
 typedef struct {
   uint32_t width;
-  uint32_t height;
+  int32_t height; // Negative for top-down secrets, like in the BMP header.
   uint32_t bpp;
   uint32_t n_colors;
   Color colors[];
 } ExtraData;
 
-void calculateShadowPixel(
-  uint8_t min_shadows, uint8_t coefficients[min_shadows], uint8_t tot_shadows, uint32_t pixels[tot_shadows]
-);
-void hideShadowPixels(
-  uint32_t shadow_pixel_idx, uint8_t* coefficients, uint8_t min_shadows, uint8_t tot_shadows,
-  BMP carrier_bmps[tot_shadows]
+// Carriers holding the shadows of several secrets start their extra data with an index instead of a single
+// `ExtraData`. The `ExtraData` of each secret follows the index, at `info_offset` bytes from the start of the extra
+// data. A legacy `ExtraData` can't be mistaken for an index since its first field would be an absurd width.
+#define EXTRA_INDEX_MAGIC 0x58444E49u // "INDX"
+
+typedef struct {
+  uint32_t offset;      // Index of the first shadow byte inside the carriers.
+  uint32_t length;      // Number of shadow bytes.
+  uint8_t min_shadows;  //
+  uint8_t flags;        // `SIS_FLAG_*`.
+  uint16_t seed;        // Low bits only with `SIS_FLAG_CHACHA`.
+  uint32_t info_offset; //
+} ExtraIndexEntry;
+
+typedef struct {
+  uint32_t magic;
+  uint32_t n_secrets;
+  ExtraIndexEntry entries[];
+} ExtraIndex;
+
+// Shares are computed a tile of blocks at a time into a scratch buffer holding the tile of every shadow contiguously,
+// and then each carrier gets its whole tile hidden in one pass. Hiding a block's shares right away would touch the
+// pixels of every carrier for every block instead. The tile is sized so that the scratch buffer stays in cache.
+// The mask is generated a tile at a time too, into a buffer of the same size, so that no image sized buffer is ever
+// written and the secret is read only once, both when sharing and when recovering.
+#define SHARE_TILE_BYTES (32 * 1024)
+
+// Interpolation weights of the k-subsets of the shadows that verified recovery falls back to, in the order they are
+// tried. Every block tries the same subsets first, so their weights are computed only once.
+#define MAX_SUBSET_TRIES 256
+#define MAX_CACHED_SUBSETS 64
+
+typedef struct {
+  uint32_t n_cached;
+  uint32_t* weights[MAX_CACHED_SUBSETS];
+  bool singular[MAX_CACHED_SUBSETS];
+} SubsetWeights;
+
+void shareTile(
+  Field field, Mask mask, uint8_t min_shadows, uint8_t tot_shadows, uint64_t seed, uint64_t first_block,
+  uint32_t n_blocks, const uint8_t* bytes, uint64_t n_bytes, uint8_t* masked, uint8_t* shares, uint32_t stride
 );
-void stegHidePixel(uint32_t shadow_pixel_idx, uint8_t* img, uint8_t hide_pixel);
-uint8_t stegRecoverPixel(uint32_t shadow_pixel_idx, uint8_t* img);
-void writeExtraData(BMP bmp, uint8_t* extra_data);
+void stegHidePixel(uint64_t shadow_pixel_idx, uint8_t* img, uint8_t hide_pixel);
+uint8_t stegRecoverPixel(uint64_t shadow_pixel_idx, uint8_t* img);
+uint32_t extraDataSize(BMP bmp, Mask mask);
+void writeExtraData(BMP bmp, Mask mask, uint64_t seed, uint8_t* extra_data);
 void readExtraData(uint8_t* extra_data_raw, ExtraData** extra_data);
+bool validSecretInfo(BMP shadow, uint32_t info_offset);
+bool readMaskSeed(BMP shadow, uint32_t info_offset, uint64_t* seed);
+bool checkCarrierSizes(uint64_t needed_size, uint8_t tot_shadows, BMP carrier_bmps[tot_shadows]);
+bool sharesRange(
+  Field field, Mask mask, BMP bmp, uint8_t min_shadows, uint8_t tot_shadows, BMP carrier_bmps[tot_shadows],
+  uint64_t seed, uint64_t offset, uint64_t from, uint64_t to
+);
+bool sharesThreaded(
+  Field field, Mask mask, BMP bmp, uint8_t min_shadows, uint8_t tot_shadows, BMP carrier_bmps[tot_shadows],
+  uint64_t seed, uint64_t offset, uint64_t from, uint64_t to, uint32_t threads
+);
+void* shareSliceMain(void* arg);
+bool recoverAt(
+  Field field, Mask mask, uint8_t min_shadows, uint8_t n_shadows, BMP shadows[n_shadows],
+  const uint8_t* const shadow_bytes[n_shadows], uint64_t readable, uint64_t seed, uint64_t offset, uint64_t length,
+  BMP secret, SisReport* report
+);
+uint64_t readableShadowBytes(
+  uint8_t n_shadows, BMP shadows[n_shadows], const uint8_t* const shadow_bytes[n_shadows],
+  const uint64_t shadow_lengths[n_shadows]
+);
+void interpolateBlock(
+  Field field, uint8_t min_shadows, const uint32_t* weights, const uint8_t ys[min_shadows], uint8_t* coefs
+);
+void unmaskRange(Mask mask, uint64_t seed, uint8_t* img, uint64_t from, uint64_t to, uint8_t* scratch);
+uint32_t evalAt(Field field, uint8_t min_shadows, const uint8_t* coefs, uint16_t x);
+void recoverFromSubsets(
+  Field field, uint8_t min_shadows, uint8_t n_shadows, const uint16_t xs[n_shadows], const uint8_t ys[n_shadows],
+  SubsetWeights* cache, uint8_t* coefs, bool agrees[n_shadows]
+);
 
-void sisShadows(BMP bmp, uint8_t min_shadows, uint8_t tot_shadows, BMP carrier_bmps[tot_shadows], uint16_t seed) {
-  assert(min_shadows >= 2 && tot_shadows >= min_shadows);
-  const uint8_t* img = bmpImage(bmp);
-  uint32_t img_size = bmpImageSize(bmp);
-  uint32_t shadow_size = ceilDiv(img_size, min_shadows);
+bool sisShadows(
+  BMP bmp, uint8_t min_shadows, uint8_t tot_shadows, BMP carrier_bmps[tot_shadows], uint64_t seed, Field field,
+  Mask mask, const SisEngine* engine
+) {
+  if (!sisShadowHeaders(1, &bmp, &min_shadows, &seed, tot_shadows, carrier_bmps, field, mask, false)) return false;
+  uint64_t shadow_size = ceilDiv(bmpImageSize(bmp), min_shadows);
+  return sisShadowsRange(bmp, min_shadows, tot_shadows, carrier_bmps, seed, field, mask, 0, 0, shadow_size, engine);
+}
 
-  for (int i = 0; i < tot_shadows; ++i) {
-    uint32_t carrier_size = bmpImageSize(carrier_bmps[i]);
-    if (carrier_size < 8 * shadow_size) {
-      fprintf(
-        stderr,
-        "sisShadows: Carrier image size must be at least 8x bigger than shadow size in order to hide the shadows "
-        "(carrier_size %u < 8 x shadow_size %u)",
-        carrier_size, 8 * shadow_size
-      );
-      exit(EXIT_FAILURE);
-    }
+bool sisShadowsPacked(
+  uint32_t n_secrets, BMP secrets[n_secrets], const uint8_t min_shadows[n_secrets], const uint64_t seeds[n_secrets],
+  uint8_t tot_shadows, BMP carrier_bmps[tot_shadows], Field field, Mask mask, const SisEngine* engine
+) {
+  if (!sisShadowHeaders(n_secrets, secrets, min_shadows, seeds, tot_shadows, carrier_bmps, field, mask, true)) {
+    return false;
   }
+  bool ok = true;
+  uint64_t offset = 0;
+  for (uint32_t s = 0; ok && s < n_secrets; ++s) {
+    uint64_t length = ceilDiv(bmpImageSize(secrets[s]), min_shadows[s]);
+    ok = sisShadowsRange(
+      secrets[s], min_shadows[s], tot_shadows, carrier_bmps, seeds[s], field, mask, offset, 0, length, engine
+    );
+    offset += length;
+  }
+  return ok;
+}
 
-  setSeed(seed);
-  uint8_t permMat[img_size];
-  permutationMatrix(img_size, permMat);
-  xorMatrixes(img_size, permMat, img);
-
-  uint8_t seed_low = seed & 0xFFu;
-  uint8_t seed_high = ((uint32_t)seed >> 8u) & 0xFFu;
+// Sets the reserved bytes and the extra data of the carriers for the shadows of the secrets, without hiding anything,
+// after checking that the carriers are big enough. A single secret gets the layout of `sisShadows` unless `packed`,
+// which gives the index of `sisShadowsPacked`, with the shadows of the secrets at consecutive offsets. Only the
+// headers of the secrets are needed, so their pixels can then be hidden a window at a time with `sisShadowsRange`.
+// Only the low 16 bits of the seeds are kept in the reserved bytes, the whole seed is stored along with the info of
+// the secret for `MASK_CHACHA`, and `MASK_LCG` ignores the rest.
+bool sisShadowHeaders(
+  uint32_t n_secrets, BMP secrets[n_secrets], const uint8_t min_shadows[n_secrets], const uint64_t seeds[n_secrets],
+  uint8_t tot_shadows, BMP carrier_bmps[tot_shadows], Field field, Mask mask, bool packed
+) {
+  assert(n_secrets >= 1 && (packed || n_secrets == 1));
+  uint32_t index_size = packed ? sizeof(ExtraIndex) + (n_secrets * sizeof(ExtraIndexEntry)) : 0;
+  uint32_t extra_data_size = index_size;
+  uint64_t total_length = 0;
+  for (uint32_t s = 0; s < n_secrets; ++s) {
+    assert(min_shadows[s] >= 2 && tot_shadows >= min_shadows[s]);
+    extra_data_size += extraDataSize(secrets[s], mask);
+    total_length += ceilDiv(bmpImageSize(secrets[s]), min_shadows[s]);
+  }
+  // The index stores 32-bit offsets.
+  if (packed && total_length > UINT32_MAX) {
+    fprintf(stderr, "sisShadows: The shadows of packed secrets can't take more than 4 GiB of every carrier.\n");
+    return false;
+  }
+  if (!checkCarrierSizes(total_length, tot_shadows, carrier_bmps)) return false;
 
-  uint32_t extra_data_size = (4 * sizeof(uint32_t)) + (bmpNColors(bmp) * sizeof(Color));
-  uint8_t extra_data[extra_data_size];
-  writeExtraData(bmp, extra_data);
+  uint8_t* extra_data = malloc(extra_data_size);
+  if (extra_data == NULL) {
+    perror("malloc");
+    return false;
+  }
+  if (!packed) writeExtraData(secrets[0], mask, seeds[0], extra_data);
+  else {
+    ExtraIndex* index = (ExtraIndex*)extra_data;
+    index->magic = EXTRA_INDEX_MAGIC;
+    index->n_secrets = n_secrets;
+    uint32_t offset = 0;
+    uint32_t info_offset = index_size;
+    for (uint32_t s = 0; s < n_secrets; ++s) {
+      ExtraIndexEntry* entry = &index->entries[s];
+      entry->offset = offset;
+      entry->length = ceilDiv(bmpImageSize(secrets[s]), min_shadows[s]);
+      entry->min_shadows = min_shadows[s];
+      entry->flags = fieldFlags(field) | maskFlags(mask);
+      entry->seed = seeds[s];
+      entry->info_offset = info_offset;
+      writeExtraData(secrets[s], mask, seeds[s], extra_data + info_offset);
+      offset += entry->length;
+      info_offset += extraDataSize(secrets[s], mask);
+    }
+  }
 
+  uint8_t seed_low = seeds[0] & 0xFFu;
+  uint8_t seed_high = (seeds[0] >> 8u) & 0xFFu;
+  uint8_t flags = fieldFlags(field) | maskFlags(mask);
   for (uint8_t i = 0; i < tot_shadows; ++i) {
-    bmpSetReserved(carrier_bmps[i], (uint8_t[]){seed_low, seed_high, i + 1, 0});
+    bmpSetReserved(carrier_bmps[i], (uint8_t[]){seed_low, seed_high, i + 1, flags});
     bmpSetExtraData(carrier_bmps[i], extra_data_size, extra_data);
   }
+  free(extra_data);
+  return true;
+}
 
-  uint8_t coefficients[min_shadows];
-  uint32_t i;
-  for (i = 0; i < img_size / min_shadows; ++i) {
-    for (int j = 0; j < min_shadows; ++j) coefficients[j] = permMat[(i * min_shadows) + j];
-    hideShadowPixels(i, coefficients, min_shadows, tot_shadows, carrier_bmps);
+// Hides the shadow bytes [from, to) of `bmp` in the carriers, which hold its shadows from shadow byte `offset` on.
+// Only the pixels these bytes cover have to be loaded, in `bmp` and in the carriers, so that the shadows of secrets
+// bigger than memory are computed a window at a time (see `bmpLoadWindow`).
+bool sisShadowsRange(
+  BMP bmp, uint8_t min_shadows, uint8_t tot_shadows, BMP carrier_bmps[tot_shadows], uint64_t seed, Field field,
+  Mask mask, uint64_t offset, uint64_t from, uint64_t to, const SisEngine* engine
+) {
+  bool ok;
+  if (engine != NULL && engine->pool != NULL) {
+    ok = shardShares(
+      engine->pool, field, mask, min_shadows, tot_shadows, seed, bmp, offset, from, to, carrier_bmps
+    );
+  } else if (engine != NULL && engine->threads > 1) {
+    ok = sharesThreaded(
+      field, mask, bmp, min_shadows, tot_shadows, carrier_bmps, seed, offset, from, to, engine->threads
+    );
+  } else {
+    ok = sharesRange(field, mask, bmp, min_shadows, tot_shadows, carrier_bmps, seed, offset, from, to);
   }
+  if (!ok) return false;
 
-  // If img_size not multiple of r then use last img_size%r pixels, pad with
-  // zeros and calculate a new shadow pixel.
-  if (img_size % min_shadows != 0) {
-    int j;
-    for (i = i * min_shadows, j = 0; i < img_size; ++i, ++j) coefficients[j] = permMat[i];
-    while (j < min_shadows) coefficients[j++] = 0;
-    hideShadowPixels(shadow_size - 1, coefficients, min_shadows, tot_shadows, carrier_bmps);
-  }
+  for (int j = 0; j < tot_shadows; ++j) bmpMarkDirty(carrier_bmps[j], 8 * (offset + from), 8 * (offset + to));
+  return true;
+}
+
+BMP sisRecover(uint8_t min_shadows, BMP shadows[min_shadows], uint64_t seed) {
+  return sisRecoverPacked(min_shadows, shadows, seed, 0);
+}
+
+BMP sisRecoverPacked(uint8_t min_shadows, BMP shadows[min_shadows], uint64_t seed, uint32_t secret_idx) {
+  return sisRecoverVerified(min_shadows, min_shadows, shadows, seed, secret_idx, NULL);
+}
+
+// With a `report`, the shadows after the first `min_shadows` are used to verify every recovered block (see
+// `recoverAt`). Without one, only the first `min_shadows` shadows are read.
+BMP sisRecoverVerified(
+  uint8_t min_shadows, uint8_t n_shadows, BMP shadows[n_shadows], uint64_t seed, uint32_t secret_idx,
+  SisReport* report
+) {
+  return sisRecoverExtracted(min_shadows, n_shadows, shadows, NULL, NULL, seed, secret_idx, report);
 }
 
-BMP sisRecover(uint8_t min_shadows, BMP shadows[min_shadows], uint16_t seed) {
-  assert(min_shadows >= 2);
+// Same as `sisRecoverVerified`, but the shadow bytes of every shadow with a non NULL `shadow_bytes[i]` (see
+// `sisExtractShadowBytes`) are taken from there instead of from its pixels, which may then have been dropped. Only
+// the first `shadow_lengths[i]` of them are read.
+BMP sisRecoverExtracted(
+  uint8_t min_shadows, uint8_t n_shadows, BMP shadows[n_shadows], const uint8_t* const shadow_bytes[n_shadows],
+  const uint64_t shadow_lengths[n_shadows], uint64_t seed, uint32_t secret_idx, SisReport* report
+) {
+  assert(min_shadows >= 2 && n_shadows >= min_shadows);
   uint32_t extra_data_size = bmpExtraSize(shadows[0]);
+  ExtraIndex* index = (ExtraIndex*)bmpExtraData(shadows[0]);
+  bool packed = extra_data_size >= sizeof(ExtraIndex) && index->magic == EXTRA_INDEX_MAGIC;
+  uint64_t readable = readableShadowBytes(n_shadows, shadows, shadow_bytes, shadow_lengths);
+  if (!packed && secret_idx != 0) {
+    fprintf(stderr, "sisRecover: Secret index %u out of range, carriers hold a single secret.\n", secret_idx);
+    return NULL;
+  }
+
   ExtraData* secret_info;
   BMP secret;
+  uint8_t flags = bmpReserved(shadows[0])[3];
+  uint64_t offset = 0;
+  uint64_t length = 0;
+  uint32_t info_offset = 0;
   if (extra_data_size == 0) {
     fprintf(stderr, "Missing secret image info. Defaulting to: secret size = carrier size, bpp = 8 \n");
     BMP bmp = shadows[0];
-    uint32_t extra_data_size = (4 * sizeof(uint32_t)) + (bmpNColors(bmp) * sizeof(Color));
+    uint32_t extra_data_size = extraDataSize(bmp, MASK_LCG);
     uint8_t extra_data[extra_data_size];
-    writeExtraData(bmp, extra_data);
+    writeExtraData(bmp, MASK_LCG, 0, extra_data);
     readExtraData(extra_data, &secret_info);
     secret = bmpNew(
       secret_info->width, secret_info->height, secret_info->bpp, NULL, secret_info->n_colors, secret_info->colors, 0,
       NULL
     );
+  } else if (packed) {
+    if ((uint64_t)extra_data_size < sizeof(ExtraIndex) + ((uint64_t)index->n_secrets * sizeof(ExtraIndexEntry))) {
+      fprintf(stderr, "sisRecover: The index of the secrets is truncated.\n");
+      return NULL;
+    }
+    if (secret_idx >= index->n_secrets) {
+      fprintf(
+        stderr, "sisRecover: Secret index %u out of range, carriers hold %u secrets.\n", secret_idx, index->n_secrets
+      );
+      return NULL;
+    }
+    const ExtraIndexEntry* entry = &index->entries[secret_idx];
+    if (entry->min_shadows < 2 || !validSecretInfo(shadows[0], entry->info_offset)) {
+      fprintf(stderr, "sisRecover: The info of secret %u is corrupt.\n", secret_idx);
+      return NULL;
+    }
+    if ((uint64_t)entry->offset + entry->length > readable) {
+      fprintf(stderr, "sisRecover: The shadows of secret %u lie past the end of the carriers.\n", secret_idx);
+      return NULL;
+    }
+    if (entry->min_shadows > n_shadows) {
+      fprintf(
+        stderr, "sisRecover: Secret %u needs %u shadows but only %u were given.\n", secret_idx, entry->min_shadows,
+        n_shadows
+      );
+      return NULL;
+    }
+    min_shadows = entry->min_shadows;
+    offset = entry->offset;
+    length = entry->length;
+    info_offset = entry->info_offset;
+    flags = entry->flags;
+    readExtraData(bmpExtraData(shadows[0]) + entry->info_offset, &secret_info);
+    secret = bmpNew(
+      secret_info->width, secret_info->height, secret_info->bpp, NULL, secret_info->n_colors, secret_info->colors, 0,
+      NULL
+    );
   } else {
+    if (!validSecretInfo(shadows[0], 0)) {
+      fprintf(stderr, "sisRecover: The secret info is corrupt.\n");
+      return NULL;
+    }
     readExtraData(bmpExtraData(shadows[0]), &secret_info);
     secret = bmpNew(
       secret_info->width, secret_info->height, secret_info->bpp, NULL, secret_info->n_colors, secret_info->colors, 0,
       NULL
     );
   }
-  if (!secret) exit(EXIT_FAILURE);
+  if (!secret) return NULL;
 
-  uint16_t* reserved;
-  uint16_t shadows_x[min_shadows];
-  // `max_valid_shadow_idx` is used to remove the possibility of a buffer overflow in case an incorrect
-  // `min_shadows` value is used. This way you get a noise image in the output instead of an error.
-  uint32_t max_valid_shadow_idx = UINT32_MAX;
-  for (uint32_t i = 0; i < min_shadows; ++i) {
-    uint32_t shadow_size = bmpImageSize(shadows[i]);
-    uint32_t valid_k = shadow_size / 8;
-    if (valid_k < max_valid_shadow_idx) {
-      max_valid_shadow_idx = valid_k;
-    }
+  if (!packed) length = ceilDiv(bmpImageSize(secret), min_shadows);
+  Field field = (flags & SIS_FLAG_GF256) ? FIELD_GF256 : FIELD_GF257;
+  Mask mask = (flags & SIS_FLAG_CHACHA) ? MASK_CHACHA : MASK_LCG;
+  if (seed == 0 && mask == MASK_CHACHA && !readMaskSeed(shadows[0], info_offset, &seed)) {
+    fprintf(stderr, "sisRecover: The seed of the mask is missing from the secret info.\n");
+    bmpFree(secret);
+    return NULL;
+  }
+  if (seed == 0 && packed) seed = index->entries[secret_idx].seed;
+  if (seed == 0) seed = ((uint16_t*)bmpReserved(shadows[0]))[0];
 
-    reserved = (uint16_t*)bmpReserved(shadows[i]);
-    shadows_x[i] = reserved[1];
+  if (report == NULL) n_shadows = min_shadows;
+  if (!recoverAt(
+        field, mask, min_shadows, n_shadows, shadows, shadow_bytes, readable, seed, offset, length, secret, report
+      )) {
+    bmpFree(secret);
+    return NULL;
   }
-  if (seed == 0) seed = reserved[0];
+  return secret;
+}
 
-  uint8_t* img = bmpImage(secret);
-  uint32_t img_size = bmpImageSize(secret);
-  uint32_t shadow_size = ceilDiv(img_size, min_shadows);
-  uint32_t img_idx = 0;
-  uint32_t safe_shadow_size = (shadow_size < max_valid_shadow_idx) ? shadow_size : max_valid_shadow_idx;
-
-  for (uint32_t k = 0; k < safe_shadow_size; ++k) {
-    uint32_t ec_system[min_shadows][min_shadows + 1];
-    for (int i = 0; i < min_shadows; ++i) {
-      uint32_t x_pow = 1;
-      for (int j = 0; j < min_shadows; ++j) {
-        ec_system[i][j] = x_pow;
-        x_pow = (x_pow * shadows_x[i]) % MOD;
+// Number of shadow bytes, from the first one, that hold the shadows of the secrets described by the header of `shadow`,
+// which was made for `min_shadows`. Carriers without a secret info are used whole, like when recovering from them.
+uint64_t sisShadowBytesUsed(BMP shadow, uint8_t min_shadows) {
+  uint64_t capacity = bmpImageSize(shadow) / 8;
+  uint32_t extra_data_size = bmpExtraSize(shadow);
+  const ExtraIndex* index = (const ExtraIndex*)bmpExtraData(shadow);
+  uint64_t used = capacity;
+  if (extra_data_size >= sizeof(ExtraIndex) && index->magic == EXTRA_INDEX_MAGIC) {
+    if ((uint64_t)extra_data_size >= sizeof(ExtraIndex) + ((uint64_t)index->n_secrets * sizeof(ExtraIndexEntry))) {
+      used = 0;
+      for (uint32_t s = 0; s < index->n_secrets; ++s) {
+        uint64_t end = (uint64_t)index->entries[s].offset + index->entries[s].length;
+        if (end > used) used = end;
       }
-      ec_system[i][min_shadows] = stegRecoverPixel(k, bmpImage(shadows[i]));
     }
-    uint8_t coefs[min_shadows];
-    solveSystem(min_shadows, min_shadows + 1, ec_system[0], coefs);
+  } else if (extra_data_size > 0 && min_shadows > 0 && validSecretInfo(shadow, 0)) {
+    const ExtraData* info = (const ExtraData*)bmpExtraData(shadow);
+    BMP secret = bmpNewHeader(info->width, info->height, info->bpp, NULL, 0, NULL, 0, NULL);
+    if (secret != NULL) used = ceilDiv(bmpImageSize(secret), min_shadows);
+    bmpFree(secret);
+  }
+  return used < capacity ? used : capacity;
+}
 
-    // TODO: memcpy?
-    for (int i = 0; i < min_shadows && img_idx < img_size; ++i, ++img_idx) {
-      img[img_idx] = coefs[i];
-    }
+// Gathers the `bmpImageSize(shadow) / 8` bytes hidden in the pixels of `shadow` into `shadow_bytes`.
+void sisExtractShadowBytes(BMP shadow, uint8_t* shadow_bytes) {
+  uint8_t* img = bmpImage(shadow);
+  uint64_t capacity = bmpImageSize(shadow) / 8;
+  for (uint64_t i = 0; i < capacity; ++i) shadow_bytes[i] = stegRecoverPixel(i, img);
+}
+
+// Same as `sisExtractShadowBytes` for the shadow bytes [from, to) alone, out of the window of pixels held by `shadow`,
+// which must cover them (see `bmpLoadWindow`).
+void sisExtractShadowRange(BMP shadow, uint64_t from, uint64_t to, uint8_t* shadow_bytes) {
+  uint8_t* img = bmpImage(shadow) + ((8 * from) - bmpWindowFrom(shadow));
+  for (uint64_t i = 0; i < to - from; ++i) shadow_bytes[i] = stegRecoverPixel(i, img);
+}
+
+// Hides the shadow bytes [from, to) in the window of pixels held by `shadow`, which must cover them.
+void sisHideShadowRange(BMP shadow, uint64_t from, uint64_t to, const uint8_t* shadow_bytes) {
+  uint8_t* img = bmpImage(shadow) + ((8 * from) - bmpWindowFrom(shadow));
+  for (uint64_t i = 0; i < to - from; ++i) stegHidePixel(i, img, shadow_bytes[i]);
+  bmpMarkDirty(shadow, 8 * from, 8 * to);
+}
+
+// Computes the shares of `n_blocks` blocks of a secret from block `first_block` on, given only the `n_bytes` bytes of
+// the secret they cover, which are fewer than `n_blocks * min_shadows` only for the last block of the secret. The share
+// of shadow `j` for block `t` goes to `shares[j * n_blocks + t]`.
+bool sisShares(
+  Field field, Mask mask, uint8_t min_shadows, uint8_t tot_shadows, uint64_t seed, uint64_t first_block,
+  uint32_t n_blocks, const uint8_t* bytes, uint64_t n_bytes, uint8_t* shares
+) {
+  uint32_t tile = SHARE_TILE_BYTES / tot_shadows;
+  uint8_t* masked = malloc((size_t)min_shadows * tile);
+  if (masked == NULL) {
+    perror("malloc");
+    return false;
+  }
+  for (uint32_t t = 0; t < n_blocks; t += tile) {
+    uint32_t tile_len = (n_blocks - t < tile) ? n_blocks - t : tile;
+    uint64_t first = (uint64_t)t * min_shadows;
+    uint64_t n_tile_bytes = (first >= n_bytes) ? 0 : n_bytes - first;
+    if (n_tile_bytes > (uint64_t)tile_len * min_shadows) n_tile_bytes = (uint64_t)tile_len * min_shadows;
+    shareTile(
+      field, mask, min_shadows, tot_shadows, seed, first_block + t, tile_len, bytes + first, n_tile_bytes, masked,
+      shares + t, n_blocks
+    );
   }
+  free(masked);
+  return true;
+}
 
-  setSeed(seed);
-  uint8_t permMat[img_size];
-  permutationMatrix(img_size, permMat);
-  xorMatrixes(img_size, img, permMat);
+// Hides the shares of `tile` blocks, laid out like those of `sisShares`, from shadow byte `first_pixel_idx` on.
+void sisHideShares(
+  uint64_t first_pixel_idx, uint32_t tile, uint8_t tot_shadows, const uint8_t* shares, BMP carrier_bmps[tot_shadows]
+) {
+  for (int j = 0; j < tot_shadows; ++j) {
+    uint8_t* img = bmpImage(carrier_bmps[j]);
+    uint64_t first = first_pixel_idx - (bmpWindowFrom(carrier_bmps[j]) / 8);
+    const uint8_t* shadow_shares = &shares[(size_t)j * tile];
+    for (uint32_t t = 0; t < tile; ++t) stegHidePixel(first + t, img, shadow_shares[t]);
+  }
+}
 
-  return secret;
+// Scratch memory the shares of up to `n_blocks` blocks at a time take on top of the secret and the carriers, when they
+// are computed by `processes` worker processes, or by `threads` threads without them.
+uint64_t sisEngineMemory(
+  uint32_t processes, uint32_t threads, uint8_t min_shadows, uint8_t tot_shadows, uint64_t n_blocks
+) {
+  if (processes > 1) return shardMemory(processes, min_shadows, tot_shadows, n_blocks);
+  uint64_t tile = SHARE_TILE_BYTES / tot_shadows;
+  return (uint64_t)(threads > 1 ? threads : 1) * (tot_shadows + min_shadows) * tile;
+}
+
+void sisPrintReport(const SisReport* report) {
+  printf("=== Verification report ===\n");
+  printf("Blocks:             %lu\n", (unsigned long)report->blocks);
+  printf("Mismatched blocks:  %lu\n", (unsigned long)report->mismatched_blocks);
+  printf("Repaired blocks:    %lu\n", (unsigned long)report->repaired_blocks);
+  printf("Unresolved blocks:  %lu\n", (unsigned long)report->unresolved_blocks);
+  for (int i = 0; i < report->n_shadows; ++i) {
+    if (report->corrupt_bytes[i] > 0) {
+      printf("Shadow %3d:         %lu corrupt bytes\n", i, (unsigned long)report->corrupt_bytes[i]);
+    }
+  }
 }
 
 /*
@@ -192,39 +482,7 @@ BMP sisRecover(uint8_t min_shadows, BMP shadows[min_shadows], uint16_t seed) {
 
 // Internal functions
 
-void calculateShadowPixel(
-  uint8_t min_shadows, uint8_t coefficients[min_shadows], uint8_t tot_shadows, uint32_t pixels[tot_shadows]
-) {
-  bool recalculate;
-  do {
-    recalculate = false;
-    for (int i = 0; i < tot_shadows; ++i) pixels[i] = polynomialModuloEval(min_shadows - 1, coefficients, i + 1);
-    for (int i = 0; i < tot_shadows; ++i) {
-      if (pixels[i] == 256) {
-        int j = 0;
-        while (j < min_shadows && coefficients[j] == 0) ++j;
-        assert(j < min_shadows && "Expected at least one non-zero coefficient");
-        --coefficients[j];
-        recalculate = true;
-        break;
-      }
-    }
-  } while (recalculate);
-}
-
-void hideShadowPixels(
-  uint32_t shadow_pixel_idx, uint8_t* coefficients, uint8_t min_shadows, uint8_t tot_shadows,
-  BMP carrier_bmps[tot_shadows]
-) {
-  uint32_t pixels[tot_shadows];
-  calculateShadowPixel(min_shadows, coefficients, tot_shadows, pixels);
-  for (int j = 0; j < tot_shadows; ++j) {
-    uint8_t hide_pixel = pixels[j];
-    stegHidePixel(shadow_pixel_idx, bmpImage(carrier_bmps[j]), hide_pixel);
-  }
-}
-
-void stegHidePixel(uint32_t shadow_pixel_idx, uint8_t* img, uint8_t hide_pixel) {
+void stegHidePixel(uint64_t shadow_pixel_idx, uint8_t* img, uint8_t hide_pixel) {
   uint8_t hide_bits[8] = {
     hide_pixel >> 7u,           (hide_pixel & 0x40u) >> 6u, (hide_pixel & 0x20u) >> 5u, (hide_pixel & 0x10u) >> 4u,
     (hide_pixel & 0x08u) >> 3u, (hide_pixel & 0x04u) >> 2u, (hide_pixel & 0x02u) >> 1u, (hide_pixel & 0x01u) >> 0u,
@@ -233,7 +491,7 @@ void stegHidePixel(uint32_t shadow_pixel_idx, uint8_t* img, uint8_t hide_pixel)
   for (int j = 0; j < 8; ++j) offset_img[j] = (offset_img[j] & 0xFEu) | hide_bits[j];
 }
 
-uint8_t stegRecoverPixel(uint32_t shadow_pixel_idx, uint8_t* img) {
+uint8_t stegRecoverPixel(uint64_t shadow_pixel_idx, uint8_t* img) {
   uint8_t recoveredPixel = 0;
   uint8_t* offset_img = img + ((size_t)shadow_pixel_idx * 8);
   for (int j = 0; j < 8; ++j) {
@@ -243,15 +501,413 @@ uint8_t stegRecoverPixel(uint32_t shadow_pixel_idx, uint8_t* img) {
   return recoveredPixel;
 }
 
-void writeExtraData(BMP bmp, uint8_t* extra_data) {
+uint32_t extraDataSize(BMP bmp, Mask mask) {
+  uint32_t seed_size = mask == MASK_CHACHA ? sizeof(uint64_t) : 0;
+  return (4 * sizeof(uint32_t)) + (bmpNColors(bmp) * sizeof(Color)) + seed_size;
+}
+
+void writeExtraData(BMP bmp, Mask mask, uint64_t seed, uint8_t* extra_data) {
   ExtraData* extra_data_struct = (ExtraData*)extra_data;
   extra_data_struct->width = bmpWidth(bmp);
-  extra_data_struct->height = bmpHeight(bmp);
+  extra_data_struct->height = bmpTopDown(bmp) ? -(int32_t)bmpHeight(bmp) : (int32_t)bmpHeight(bmp);
   extra_data_struct->bpp = bmpBpp(bmp);
   extra_data_struct->n_colors = bmpNColors(bmp);
   memcpy(&extra_data_struct->colors, bmpColors(bmp), bmpNColors(bmp) * sizeof(Color));
+  if (mask == MASK_CHACHA) memcpy(&extra_data_struct->colors[bmpNColors(bmp)], &seed, sizeof(seed));
 }
 
 void readExtraData(uint8_t* extra_data_raw, ExtraData** extra_data) {
   *extra_data = (ExtraData*)extra_data_raw;
 }
+
+// Whether the info of the secret at `info_offset`, colors included, lies inside the extra data of `shadow`.
+bool validSecretInfo(BMP shadow, uint32_t info_offset) {
+  uint64_t extra_data_size = bmpExtraSize(shadow);
+  if ((uint64_t)info_offset + sizeof(ExtraData) > extra_data_size) return false;
+  const ExtraData* info = (const ExtraData*)(bmpExtraData(shadow) + info_offset);
+  return info_offset + sizeof(ExtraData) + ((uint64_t)info->n_colors * sizeof(Color)) <= extra_data_size;
+}
+
+// Reads the seed following the info of the secret at `info_offset` in the extra data of `shadow`.
+bool readMaskSeed(BMP shadow, uint32_t info_offset, uint64_t* seed) {
+  uint64_t extra_data_size = bmpExtraSize(shadow);
+  if ((uint64_t)info_offset + sizeof(ExtraData) > extra_data_size) return false;
+  ExtraData* info = (ExtraData*)(bmpExtraData(shadow) + info_offset);
+  uint64_t seed_offset = info_offset + sizeof(ExtraData) + ((uint64_t)info->n_colors * sizeof(Color));
+  if (seed_offset + sizeof(uint64_t) > extra_data_size) return false;
+  memcpy(seed, bmpExtraData(shadow) + seed_offset, sizeof(uint64_t));
+  return true;
+}
+
+bool checkCarrierSizes(uint64_t needed_size, uint8_t tot_shadows, BMP carrier_bmps[tot_shadows]) {
+  for (int i = 0; i < tot_shadows; ++i) {
+    uint64_t carrier_size = bmpImageSize(carrier_bmps[i]);
+    if (carrier_size / 8 < needed_size) {
+      fprintf(
+        stderr,
+        "sisShadows: Carrier image size must be at least 8x bigger than shadow size in order to hide the shadows "
+        "(carrier_size %lu < 8 x shadow_size %lu)\n",
+        (unsigned long)carrier_size, (unsigned long)needed_size
+      );
+      return false;
+    }
+  }
+  return true;
+}
+
+// Computes and hides the shadow bytes [from, to) of `bmp`.
+bool sharesRange(
+  Field field, Mask mask, BMP bmp, uint8_t min_shadows, uint8_t tot_shadows, BMP carrier_bmps[tot_shadows],
+  uint64_t seed, uint64_t offset, uint64_t from, uint64_t to
+) {
+  const uint8_t* img = bmpImage(bmp);
+  uint64_t img_from = bmpWindowFrom(bmp);
+  uint64_t img_size = bmpImageSize(bmp);
+
+  // Heap allocated, worker threads don't have much room on their stacks. The shares of the tile are followed by its
+  // masked secret bytes, the coefficients of its blocks.
+  uint32_t tile = SHARE_TILE_BYTES / tot_shadows;
+  uint8_t* shares = malloc(((size_t)tot_shadows + min_shadows) * tile);
+  if (shares == NULL) {
+    perror("malloc");
+    return false;
+  }
+  uint8_t* masked = shares + ((size_t)tot_shadows * tile);
+  for (uint64_t tile_start = from; tile_start < to; tile_start += tile) {
+    uint32_t tile_len = (to - tile_start < tile) ? to - tile_start : tile;
+    uint64_t first = tile_start * min_shadows;
+    uint64_t n_coefficients = (uint64_t)tile_len * min_shadows;
+    uint64_t n_img = (img_size - first < n_coefficients) ? img_size - first : n_coefficients;
+    shareTile(
+      field, mask, min_shadows, tot_shadows, seed, tile_start, tile_len, img + (first - img_from), n_img, masked,
+      shares, tile_len
+    );
+    sisHideShares(offset + tile_start, tile_len, tot_shadows, shares, carrier_bmps);
+  }
+  free(shares);
+  return true;
+}
+
+// Shadow bytes [from, to) of a secret, computed by a thread of `sharesThreaded` pinned to `node`.
+typedef struct ShareSlice {
+  Field field;
+  Mask mask;
+  BMP bmp;
+  uint8_t min_shadows;
+  uint8_t tot_shadows;
+  BMP* carrier_bmps;
+  uint64_t seed;
+  uint64_t offset;
+  uint32_t node;
+  uint64_t from;
+  uint64_t to;
+  pthread_t thread;
+  bool started;
+  bool ok;
+} ShareSlice;
+
+// Node `i` of the nodes used gets the i-th of as many equal slices of the shadow bytes, which covers the secret bytes
+// and carrier pixels that `bmpParseSpread` placed on it, and splits it between its threads.
+bool sharesThreaded(
+  Field field, Mask mask, BMP bmp, uint8_t min_shadows, uint8_t tot_shadows, BMP carrier_bmps[tot_shadows],
+  uint64_t seed, uint64_t offset, uint64_t from, uint64_t to, uint32_t threads
+) {
+  uint32_t n_nodes = numaNodeCount();
+  if (n_nodes > threads) n_nodes = threads;
+  ShareSlice* slices = calloc(threads, sizeof(ShareSlice));
+  if (slices == NULL) {
+    perror("calloc");
+    return false;
+  }
+
+  uint32_t t = 0;
+  for (uint32_t node = 0; node < n_nodes; ++node) {
+    uint64_t node_from = from + ((to - from) / n_nodes * node);
+    uint64_t node_size = (node + 1 < n_nodes ? from + ((to - from) / n_nodes * (node + 1)) : to) - node_from;
+    uint32_t node_threads = (threads / n_nodes) + (node < threads % n_nodes);
+    for (uint32_t i = 0; i < node_threads; ++i, ++t) {
+      ShareSlice* slice = &slices[t];
+      *slice = (ShareSlice){
+        .field = field,
+        .mask = mask,
+        .bmp = bmp,
+        .min_shadows = min_shadows,
+        .tot_shadows = tot_shadows,
+        .carrier_bmps = carrier_bmps,
+        .seed = seed,
+        .offset = offset,
+        .node = node,
+        .from = node_from + (node_size * i / node_threads),
+        .to = node_from + (node_size * (i + 1) / node_threads),
+      };
+      slice->started = pthread_create(&slice->thread, NULL, shareSliceMain, slice) == 0;
+      // Without a thread of its own, the slice is computed right away, without pinning the calling thread.
+      if (!slice->started) {
+        slice->ok = sharesRange(
+          field, mask, bmp, min_shadows, tot_shadows, carrier_bmps, seed, offset, slice->from, slice->to
+        );
+      }
+    }
+  }
+
+  bool ok = true;
+  for (uint32_t i = 0; i < threads; ++i) {
+    if (slices[i].started) pthread_join(slices[i].thread, NULL);
+    ok = ok && slices[i].ok;
+  }
+  free(slices);
+  return ok;
+}
+
+void* shareSliceMain(void* arg) {
+  ShareSlice* slice = arg;
+  numaPinThread(slice->node);
+  slice->ok = sharesRange(
+    slice->field, slice->mask, slice->bmp, slice->min_shadows, slice->tot_shadows, slice->carrier_bmps, slice->seed,
+    slice->offset, slice->from, slice->to
+  );
+  return NULL;
+}
+
+// Masks the `n_bytes` secret bytes covered by `n_blocks` blocks from `first_block` on into `masked`, padding the
+// last block of the secret with zeros, and computes their shares.
+void shareTile(
+  Field field, Mask mask, uint8_t min_shadows, uint8_t tot_shadows, uint64_t seed, uint64_t first_block,
+  uint32_t n_blocks, const uint8_t* bytes, uint64_t n_bytes, uint8_t* masked, uint8_t* shares, uint32_t stride
+) {
+  const uint8_t* keystream = keystreamCached(mask, seed, first_block * min_shadows, n_bytes);
+  if (keystream == NULL) permutationMatrix(mask, seed, first_block * min_shadows, n_bytes, masked);
+  else memcpy(masked, keystream, n_bytes);
+  xorMatrixes(n_bytes, masked, bytes);
+  memset(masked + n_bytes, 0, ((uint64_t)n_blocks * min_shadows) - n_bytes);
+  kernelShare(field, min_shadows)(min_shadows, tot_shadows, n_blocks, masked, shares, stride);
+}
+
+// Shadow bytes that can be read from every shadow: their capacity, or only `shadow_lengths[i]` of those extracted.
+uint64_t readableShadowBytes(
+  uint8_t n_shadows, BMP shadows[n_shadows], const uint8_t* const shadow_bytes[n_shadows],
+  const uint64_t shadow_lengths[n_shadows]
+) {
+  uint64_t readable = UINT64_MAX;
+  for (int i = 0; i < n_shadows; ++i) {
+    uint64_t shadow_readable = bmpImageSize(shadows[i]) / 8;
+    bool extracted = shadow_bytes != NULL && shadow_bytes[i] != NULL && shadow_lengths != NULL;
+    if (extracted && shadow_lengths[i] < shadow_readable) shadow_readable = shadow_lengths[i];
+    if (shadow_readable < readable) readable = shadow_readable;
+  }
+  return readable;
+}
+
+// Recovers the `length` shadow bytes starting at shadow byte `offset` into the image of `secret`.
+// The polynomial of every block is interpolated from the first `min_shadows` shadows with weights computed once, so a
+// block costs `min_shadows^2` multiply-adds. Every extra shadow is checked against that polynomial with a precomputed
+// row of weights too, which costs `min_shadows` multiply-adds per extra shadow. Only the blocks that fail this check
+// go through Reed-Solomon decoding (see `rsDecode`), which corrects up to half as many wrong shadows as there are
+// extra ones. Beyond that, the polynomial of the subset of shadows that most shadows agree with is kept.
+bool recoverAt(
+  Field field, Mask mask, uint8_t min_shadows, uint8_t n_shadows, BMP shadows[n_shadows],
+  const uint8_t* const shadow_bytes[n_shadows], uint64_t readable, uint64_t seed, uint64_t offset, uint64_t length,
+  BMP secret, SisReport* report
+) {
+  uint16_t shadows_x[n_shadows];
+  bool seen_x[UINT8_MAX + 1] = {false};
+  bool distinct = true;
+  // `max_valid_shadow_idx` is used to remove the possibility of a buffer overflow in case an incorrect
+  // `min_shadows` value is used. This way you get a noise image in the output instead of an error.
+  uint64_t max_valid_shadow_idx = readable;
+  for (uint32_t i = 0; i < n_shadows; ++i) {
+    shadows_x[i] = bmpReserved(shadows[i])[2];
+    // Extra shadows are checked too, a copy of another shadow would always agree with it.
+    if (shadows_x[i] == 0 || seen_x[shadows_x[i]]) distinct = false;
+    seen_x[shadows_x[i]] = true;
+  }
+
+  uint32_t weights[min_shadows * min_shadows];
+  if (!distinct || !fieldInterpolationWeights(field, min_shadows, shadows_x, weights)) {
+    fprintf(stderr, "sisRecover: The x-coordinates of the shadows are not distinct, the secret can't be recovered.\n");
+    return false;
+  }
+  // Row `e` holds the weights that give the value of the polynomial at the x-coordinate of extra shadow `e`.
+  uint8_t n_extra = n_shadows - min_shadows;
+  uint32_t check_rows[n_extra + 1][min_shadows];
+  for (int e = 0; e < n_extra; ++e) {
+    for (int j = 0; j < min_shadows; ++j) {
+      uint32_t val = 0;
+      uint32_t x_pow = 1;
+      for (int i = 0; i < min_shadows; ++i) {
+        val = fieldAdd(field, val, fieldMul(field, x_pow, weights[(i * min_shadows) + j]));
+        x_pow = fieldMul(field, x_pow, shadows_x[min_shadows + e]);
+      }
+      check_rows[e][j] = val;
+    }
+  }
+  if (report != NULL) {
+    memset(report, 0, sizeof(SisReport));
+    report->n_shadows = n_shadows;
+  }
+  SubsetWeights cache = {.n_cached = 0};
+
+  uint8_t* img = bmpImage(secret);
+  uint64_t img_size = bmpImageSize(secret);
+  uint64_t img_idx = 0;
+  uint64_t end = offset + length;
+  uint64_t safe_end = (end < max_valid_shadow_idx) ? end : max_valid_shadow_idx;
+
+  // Blocks are recovered a tile at a time. The shadow bytes of a tile are laid out by shadow for the batched kernel,
+  // which writes the coefficients laid out the same way, and the tile is unmasked while it is still in cache.
+  uint32_t tile = SHARE_TILE_BYTES / min_shadows;
+  uint8_t* scratch = malloc(SHARE_TILE_BYTES + ((uint64_t)(n_shadows + min_shadows) * tile));
+  if (scratch == NULL) {
+    perror("malloc");
+    return false;
+  }
+  uint8_t* lanes = scratch + SHARE_TILE_BYTES;
+  uint8_t* results = lanes + ((uint64_t)n_shadows * tile);
+  uint64_t unmasked = 0;
+
+  const uint8_t* tile_ys[n_shadows];
+  uint8_t ys[n_shadows];
+  uint8_t coefs[min_shadows];
+  bool agrees[n_shadows];
+  InterpolateBatchKernel interpolate = kernelInterpolateBatch(field);
+  for (uint64_t first = offset; first < safe_end; first += tile) {
+    uint32_t tile_len = (safe_end - first < tile) ? safe_end - first : tile;
+    for (int i = 0; i < n_shadows; ++i) {
+      if (shadow_bytes != NULL && shadow_bytes[i] != NULL) {
+        tile_ys[i] = shadow_bytes[i] + first;
+        continue;
+      }
+      uint8_t* lane = lanes + ((uint64_t)i * tile);
+      for (uint32_t t = 0; t < tile_len; ++t) lane[t] = stegRecoverPixel(first + t, bmpImage(shadows[i]));
+      tile_ys[i] = lane;
+    }
+    interpolate(min_shadows, weights, tile_len, tile_ys, results, tile);
+
+    for (uint32_t t = 0; t < tile_len; ++t) {
+      for (int i = 0; i < n_shadows; ++i) ys[i] = tile_ys[i][t];
+      for (int i = 0; i < min_shadows; ++i) coefs[i] = results[((uint64_t)i * tile) + t];
+
+      bool consistent = true;
+      for (int e = 0; e < n_extra && consistent; ++e) {
+        uint32_t expected = 0;
+        if (field == FIELD_GF256) {
+          for (int j = 0; j < min_shadows; ++j) expected ^= gf256Mul(check_rows[e][j], ys[j]);
+        } else {
+          for (int j = 0; j < min_shadows; ++j) expected += check_rows[e][j] * ys[j];
+          expected %= MOD;
+        }
+        consistent = expected == ys[min_shadows + e];
+      }
+      if (report != NULL) ++report->blocks;
+      if (!consistent) {
+        bool repaired = rsDecode(field, min_shadows, n_shadows, shadows_x, ys, coefs);
+        if (repaired) {
+          for (int i = 0; i < n_shadows; ++i) agrees[i] = evalAt(field, min_shadows, coefs, shadows_x[i]) == ys[i];
+        } else {
+          // Too many wrong shadows to decode, keep the polynomial that most shadows agree with as a best guess.
+          recoverFromSubsets(field, min_shadows, n_shadows, shadows_x, ys, &cache, coefs, agrees);
+        }
+        if (report != NULL) {
+          ++report->mismatched_blocks;
+          if (repaired) ++report->repaired_blocks;
+          else ++report->unresolved_blocks;
+          for (int i = 0; i < n_shadows; ++i) report->corrupt_bytes[i] += !agrees[i];
+        }
+      }
+
+      for (int i = 0; i < min_shadows && img_idx < img_size; ++i, ++img_idx) {
+        img[img_idx] = coefs[i];
+      }
+    }
+    unmaskRange(mask, seed, img, unmasked, img_idx, scratch);
+    unmasked = img_idx;
+  }
+
+  for (uint32_t i = 0; i < cache.n_cached; ++i) free(cache.weights[i]);
+
+  // Bytes past the shadows of truncated carriers are unmasked too, like the rest of the image.
+  unmaskRange(mask, seed, img, unmasked, img_size, scratch);
+  free(scratch);
+  return true;
+}
+
+// XORs the bytes [from, to) of `img` with the mask, read from the keystream cache or generated `SHARE_TILE_BYTES` at
+// a time into `scratch`.
+void unmaskRange(Mask mask, uint64_t seed, uint8_t* img, uint64_t from, uint64_t to, uint8_t* scratch) {
+  const uint8_t* keystream = keystreamCached(mask, seed, from, to - from);
+  if (keystream != NULL) {
+    xorMatrixes(to - from, img + from, keystream);
+    return;
+  }
+  while (from < to) {
+    uint64_t n = (to - from < SHARE_TILE_BYTES) ? to - from : SHARE_TILE_BYTES;
+    permutationMatrix(mask, seed, from, n, scratch);
+    xorMatrixes(n, img + from, scratch);
+    from += n;
+  }
+}
+
+void interpolateBlock(
+  Field field, uint8_t min_shadows, const uint32_t* weights, const uint8_t ys[min_shadows], uint8_t* coefs
+) {
+  kernelInterpolate(field, min_shadows)(min_shadows, weights, ys, coefs);
+}
+
+uint32_t evalAt(Field field, uint8_t min_shadows, const uint8_t* coefs, uint16_t x) {
+  return fieldPolyEval(field, min_shadows, coefs, x);
+}
+
+// Tries the subsets of `min_shadows` shadows in lexicographic order and keeps the polynomial that agrees with the
+// most shadows, stopping after `MAX_SUBSET_TRIES`.
+void recoverFromSubsets(
+  Field field, uint8_t min_shadows, uint8_t n_shadows, const uint16_t xs[n_shadows], const uint8_t ys[n_shadows],
+  SubsetWeights* cache, uint8_t* coefs, bool agrees[n_shadows]
+) {
+  uint8_t subset[min_shadows];
+  for (int i = 0; i < min_shadows; ++i) subset[i] = i;
+  uint8_t best_agree = 0;
+  uint8_t candidate[min_shadows];
+  uint32_t scratch[min_shadows * min_shadows];
+
+  for (uint32_t tries = 0; tries < MAX_SUBSET_TRIES; ++tries) {
+    const uint32_t* weights = NULL;
+    if (tries < cache->n_cached) {
+      if (!cache->singular[tries]) weights = cache->weights[tries];
+    } else {
+      uint16_t subset_xs[min_shadows];
+      for (int i = 0; i < min_shadows; ++i) subset_xs[i] = xs[subset[i]];
+      bool ok = fieldInterpolationWeights(field, min_shadows, subset_xs, scratch);
+      if (ok) weights = scratch;
+      if (tries == cache->n_cached && tries < MAX_CACHED_SUBSETS) {
+        cache->weights[tries] = malloc(sizeof(scratch));
+        if (cache->weights[tries] != NULL) {
+          memcpy(cache->weights[tries], scratch, sizeof(scratch));
+          cache->singular[tries] = !ok;
+          ++cache->n_cached;
+        }
+      }
+    }
+
+    if (weights != NULL) {
+      uint8_t ys_subset[min_shadows];
+      for (int i = 0; i < min_shadows; ++i) ys_subset[i] = ys[subset[i]];
+      interpolateBlock(field, min_shadows, weights, ys_subset, candidate);
+      uint8_t n_agree = 0;
+      for (int i = 0; i < n_shadows; ++i) n_agree += evalAt(field, min_shadows, candidate, xs[i]) == ys[i];
+      if (n_agree > best_agree) {
+        best_agree = n_agree;
+        memcpy(coefs, candidate, min_shadows);
+        for (int i = 0; i < n_shadows; ++i) agrees[i] = evalAt(field, min_shadows, candidate, xs[i]) == ys[i];
+      }
+    }
+
+    // Next subset in lexicographic order.
+    int i = min_shadows - 1;
+    while (i >= 0 && subset[i] == n_shadows - min_shadows + i) --i;
+    if (i < 0) break;
+    ++subset[i];
+    for (int j = i + 1; j < min_shadows; ++j) subset[j] = subset[j - 1] + 1;
+  }
+
+  if (best_agree == 0) memset(agrees, 0, n_shadows * sizeof(bool));
+}
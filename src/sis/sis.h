@@ -2,11 +2,83 @@
 #define SIS_H
 
 #include "../bmp/bmp.h"
+#include "field.h"
+#include "permutation.h"
+#include "shard.h"
+#include <stdbool.h>
 #include <stdint.h>
 
 extern Color colors[256];
 
-void sisShadows(BMP bmp, uint8_t min_shadows, uint8_t tot_shadows, BMP carrier_bmps[tot_shadows], uint16_t seed);
-BMP sisRecover(uint8_t min_shadows, BMP shadows[min_shadows], uint16_t seed);
+// Flags of the shadows, stored in the 4th reserved byte of the header and in the index entries of packed carriers.
+#define SIS_FLAG_GF256 0x01u  // The shadows were computed in GF(2^8) instead of GF(257).
+#define SIS_FLAG_CHACHA 0x02u // The secret was masked with `MASK_CHACHA`, its seed follows the info of the secret.
+
+static inline uint8_t fieldFlags(Field field) {
+  return field == FIELD_GF256 ? SIS_FLAG_GF256 : 0;
+}
+
+static inline uint8_t maskFlags(Mask mask) {
+  return mask == MASK_CHACHA ? SIS_FLAG_CHACHA : 0;
+}
+
+// How the shares of a distribution are computed: by the worker processes of `pool` if not NULL, otherwise by `threads`
+// threads spread over the NUMA nodes, every node working on the part of the buffers placed on it (see
+// `bmpParseSpread`). Without an engine, or with a single thread, they are computed by the calling thread.
+typedef struct SisEngine {
+  ShardPool* pool;
+  uint32_t threads;
+} SisEngine;
+
+typedef struct SisReport {
+  uint8_t n_shadows;
+  uint64_t blocks;             // Blocks recovered.
+  uint64_t mismatched_blocks;  // Blocks where the extra shadows disagreed with the first `min_shadows` shadows.
+  uint64_t repaired_blocks;    // Mismatched blocks corrected by Reed-Solomon decoding.
+  uint64_t unresolved_blocks;  // Mismatched blocks with too many wrong shadows, recovered on a best guess.
+  uint64_t corrupt_bytes[256]; // Per shadow, bytes that disagreed with the polynomial kept for their block.
+} SisReport;
+
+bool sisShadows(
+  BMP bmp, uint8_t min_shadows, uint8_t tot_shadows, BMP carrier_bmps[tot_shadows], uint64_t seed, Field field,
+  Mask mask, const SisEngine* engine
+);
+bool sisShadowsPacked(
+  uint32_t n_secrets, BMP secrets[n_secrets], const uint8_t min_shadows[n_secrets], const uint64_t seeds[n_secrets],
+  uint8_t tot_shadows, BMP carrier_bmps[tot_shadows], Field field, Mask mask, const SisEngine* engine
+);
+bool sisShadowHeaders(
+  uint32_t n_secrets, BMP secrets[n_secrets], const uint8_t min_shadows[n_secrets], const uint64_t seeds[n_secrets],
+  uint8_t tot_shadows, BMP carrier_bmps[tot_shadows], Field field, Mask mask, bool packed
+);
+bool sisShadowsRange(
+  BMP bmp, uint8_t min_shadows, uint8_t tot_shadows, BMP carrier_bmps[tot_shadows], uint64_t seed, Field field,
+  Mask mask, uint64_t offset, uint64_t from, uint64_t to, const SisEngine* engine
+);
+BMP sisRecover(uint8_t min_shadows, BMP shadows[min_shadows], uint64_t seed);
+BMP sisRecoverPacked(uint8_t min_shadows, BMP shadows[min_shadows], uint64_t seed, uint32_t secret_idx);
+BMP sisRecoverVerified(
+  uint8_t min_shadows, uint8_t n_shadows, BMP shadows[n_shadows], uint64_t seed, uint32_t secret_idx,
+  SisReport* report
+);
+BMP sisRecoverExtracted(
+  uint8_t min_shadows, uint8_t n_shadows, BMP shadows[n_shadows], const uint8_t* const shadow_bytes[n_shadows],
+  const uint64_t shadow_lengths[n_shadows], uint64_t seed, uint32_t secret_idx, SisReport* report
+);
+bool sisShares(
+  Field field, Mask mask, uint8_t min_shadows, uint8_t tot_shadows, uint64_t seed, uint64_t first_block,
+  uint32_t n_blocks, const uint8_t* bytes, uint64_t n_bytes, uint8_t* shares
+);
+void sisHideShares(
+  uint64_t first_pixel_idx, uint32_t tile, uint8_t tot_shadows, const uint8_t* shares, BMP carrier_bmps[tot_shadows]
+);
+uint64_t sisEngineMemory(
+  uint32_t processes, uint32_t threads, uint8_t min_shadows, uint8_t tot_shadows, uint64_t n_blocks
+);
+uint64_t sisShadowBytesUsed(BMP shadow, uint8_t min_shadows);
+void sisExtractShadowBytes(BMP shadow, uint8_t* shadow_bytes);
+void sisExtractShadowRange(BMP shadow, uint64_t from, uint64_t to, uint8_t* shadow_bytes);
+void sisHideShadowRange(BMP shadow, uint64_t from, uint64_t to, const uint8_t* shadow_bytes);
+void sisPrintReport(const SisReport* report);
 
 #endif
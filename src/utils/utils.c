@@ -1,17 +1,34 @@
 #include "utils.h"
 #include "../globals.h"
+#include <libgen.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
-uint32_t ceilDiv(uint32_t numerator, uint32_t denominator) {
+uint64_t ceilDiv(uint64_t numerator, uint64_t denominator) {
   if (denominator == 0) {
-    fprintf(stderr, "Devided by zero, stupid... -> %d/%d", numerator, denominator);
+    fprintf(stderr, "Devided by zero, stupid... -> %lu/%lu", (unsigned long)numerator, (unsigned long)denominator);
     return -1;
   }
-  return ((uint64_t)numerator + denominator - 1) / denominator;
+  return (numerator / denominator) + (numerator % denominator != 0);
+}
+
+// 64-bit FNV-1a of `data`, continuing from `hash`, which is `FNV_OFFSET_BASIS` for the first block of data.
+uint64_t fnv1a(uint64_t hash, const uint8_t* data, size_t size) {
+  for (size_t i = 0; i < size; ++i) hash = (hash ^ data[i]) * 1099511628211u;
+  return hash;
+}
+
+// Name of `filename` without its directory nor its extension, which names the outputs made from it.
+void fileStem(char* stem, size_t stem_len, const char* filename) {
+  char name[stem_len];
+  snprintf(name, stem_len, "%s", filename);
+  char* base = basename(name);
+  char* extension = strrchr(base, '.');
+  if (extension != NULL && extension != base) *extension = '\0';
+  snprintf(stem, stem_len, "%s", base);
 }
 
 void closestDivisors(uint32_t size, uint32_t* rows_out, uint32_t* cols_out) {
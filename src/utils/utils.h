@@ -1,13 +1,21 @@
 #ifndef UTILS_H
 #define UTILS_H
 
+#include <stddef.h>
 #include <stdint.h>
 
-uint32_t ceilDiv(uint32_t numerator, uint32_t denominator);
+extern const uint32_t inverseMod257[];
+
+#define FNV_OFFSET_BASIS 14695981039346656037u
+
+uint64_t ceilDiv(uint64_t numerator, uint64_t denominator);
+uint64_t fnv1a(uint64_t hash, const uint8_t* data, size_t size);
+void fileStem(char* stem, size_t stem_len, const char* filename);
 void closestDivisors(uint32_t size, uint32_t* rows_out, uint32_t* cols_out);
 uint32_t polynomialModuloEval(uint8_t order, const uint8_t coefficients[], uint8_t x);
 void gaussEliminationModulo(uint32_t rows, uint32_t cols, uint32_t* matrix);
 void solveSystem(uint32_t rows, uint32_t cols, uint32_t* matrix, uint8_t* coeficients);
+void swapRows(size_t cols, uint32_t* matrix, size_t swap_row_1, size_t swap_row_2);
 
 // TODO: remove
 void printMatrix(uint32_t rows, uint32_t cols, uint32_t* matrix);